@@ -0,0 +1,98 @@
+/*
+	Copyright 2026, Philip Rose, GM3ZZA
+
+	This file is part of ZZACOMMON.
+
+	ZZACOMMON is free software: you can redistribute it and/or modify it under the
+	terms of the Lesser GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later version.
+
+	ZZACOMMON is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+	without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+	PURPOSE. See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along with ZZACOMMON.
+	If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#pragma once
+
+#include <cstddef>
+#include <string_view>
+
+//! \file zc_http_parser.h
+//! In-place parsing of HTTP/1.1 message headers.
+
+//! \brief This class parses the start line and header fields of an HTTP message
+//! held in a contiguous buffer.
+//!
+//! Nothing is copied or allocated: the method, target, version, header fields and
+//! body are returned as views into the buffer, which must outlive the parser.
+//! A response can be parsed too - the start line parts are then the version,
+//! status code and reason phrase.
+class zc_http_parser
+{
+public:
+	//! Result of parsing.
+	enum result_t {
+		HTTP_INCOMPLETE,       //!< The header has not all arrived
+		HTTP_OK,               //!< The header has been parsed
+		HTTP_ERROR             //!< Malformed or too many header fields
+	};
+
+	//! Most header fields kept - a message with more is rejected.
+	static const size_t MAX_FIELDS = 64;
+
+	//! A header field.
+	struct field_t {
+		std::string_view name;     //!< Field name as received
+		std::string_view value;    //!< Value without surrounding whitespace
+	};
+
+	//! Parse the header at the start of \p length bytes at \p data.
+	
+	//! A header giving two different Content-Length values is malformed.
+	result_t parse(const char* data, size_t length);
+
+	//! Method (e.g. POST) - or the version of a response.
+	std::string_view method() const { return method_; }
+	//! Request target (e.g. /RPC2) - or the status code of a response.
+	std::string_view target() const { return target_; }
+	//! Protocol version (e.g. HTTP/1.1) - or the reason phrase of a response.
+	std::string_view version() const { return version_; }
+	//! Returns the value of field \p name (case-insensitive), empty if absent.
+	std::string_view field(std::string_view name) const;
+	//! Returns true if field \p name (case-insensitive) is present.
+	bool has_field(std::string_view name) const;
+	//! Returns true if any field \p name holds \p token in its comma-separated list (both case-insensitive).
+	bool field_has_token(std::string_view name, std::string_view token) const;
+	//! Number of header fields.
+	size_t num_fields() const { return num_fields_; }
+	//! Header field \p ix.
+	const field_t& field(size_t ix) const { return fields_[ix]; }
+	//! Length of the header including the blank line that ends it.
+	size_t header_length() const { return header_length_; }
+	//! Value of Content-Length - 0 if absent.
+	size_t content_length() const { return content_length_; }
+	//! Returns true if Transfer-Encoding is given - i.e. the body is chunked.
+	bool chunked() const { return chunked_; }
+	//! Returns true if the header and Content-Length bytes of body are all in the buffer.
+	bool complete() const { return header_length_ && header_length_ + content_length_ <= length_; }
+	//! The body - truncated to what is in the buffer.
+	std::string_view body() const;
+
+	//! Compare \p a and \p b ignoring ASCII case.
+	static bool equal_nocase(std::string_view a, std::string_view b);
+
+protected:
+	const char* data_{ nullptr };        //!< The message
+	size_t length_{ 0 };                 //!< Bytes in the buffer
+	size_t header_length_{ 0 };          //!< Bytes in the header
+	size_t content_length_{ 0 };         //!< Bytes of body
+	bool chunked_{ false };              //!< Transfer-Encoding present
+	std::string_view method_;            //!< Start line - first part
+	std::string_view target_;            //!< Start line - second part
+	std::string_view version_;           //!< Start line - the rest
+	field_t fields_[MAX_FIELDS];         //!< The header fields
+	size_t num_fields_{ 0 };             //!< Number of header fields
+};
@@ -0,0 +1,119 @@
+/*
+	Copyright 2026, Philip Rose, GM3ZZA
+
+	This file is part of ZZACOMMON.
+
+	ZZACOMMON is free software: you can redistribute it and/or modify it under the
+	terms of the Lesser GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later version.
+
+	ZZACOMMON is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+	without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+	PURPOSE. See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along with ZZACOMMON.
+	If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+//! \file zc_protocol_handler.h
+//! Framing of stream protocols served by zc_socket_server.
+
+//! \brief This class splits the byte stream received on a connection into messages
+//! and frames the responses sent back.
+//!
+//! zc_socket_server clones the handler registered for a service once per accepted
+//! connection, so an implementation may keep per-connection state. frame() is called
+//! in the listener thread; encode() is called by whichever thread sends the response.
+class zc_protocol_handler
+{
+public:
+	//! Result of examining received data.
+	enum frame_t {
+		FRAME_INCOMPLETE,      //!< No complete frame yet - wait for more data
+		FRAME_MESSAGE,         //!< A message has been extracted for the callback
+		FRAME_CONTROL,         //!< Protocol data consumed (e.g. handshake or ping) - no message
+		FRAME_CLOSE,           //!< Peer asked to close - send any reply and close
+		FRAME_ERROR            //!< Protocol error - close the connection
+	};
+
+	//! Destructor.
+	virtual ~zc_protocol_handler() {}
+
+	//! Returns a new handler, in its initial state, for a new connection.
+	virtual zc_protocol_handler* clone() const = 0;
+
+	//! Look for a complete frame at the start of the received data.
+
+	//! \param data Received data not yet consumed.
+	//! \param length Number of bytes at \p data.
+	//! \param used Receives the number of bytes consumed.
+	//! \param message Receives the message to pass to the callback (FRAME_MESSAGE).
+	//! \param reply Receives any data to send straight back, e.g. a handshake response.
+	//! \return What was found.
+	virtual frame_t frame(const char* data, size_t length, size_t& used, std::string& message, std::string& reply) = 0;
+
+	//! Generate the framing that precedes a response of \p length bytes - default none.
+	virtual void encode(size_t /*length*/, std::string& header) { header.clear(); }
+};
+
+//! \brief HTTP/1.1 requests - a request is complete once its header and
+//! Content-Length bytes of body have arrived. The message is the whole request.
+class zc_http_protocol : public zc_protocol_handler
+{
+public:
+	zc_protocol_handler* clone() const override { return new zc_http_protocol; }
+	frame_t frame(const char* data, size_t length, size_t& used, std::string& message, std::string& reply) override;
+};
+
+//! \brief Line-oriented text (e.g. rigctld or CAT commands). Each message is a
+//! line without its CR/LF terminator: responses are sent as supplied.
+class zc_line_protocol : public zc_protocol_handler
+{
+public:
+	zc_protocol_handler* clone() const override { return new zc_line_protocol; }
+	frame_t frame(const char* data, size_t length, size_t& used, std::string& message, std::string& reply) override;
+};
+
+//! \brief Binary messages each preceded by a 32-bit big-endian length.
+//! Responses are given the same prefix.
+class zc_length_protocol : public zc_protocol_handler
+{
+public:
+	zc_protocol_handler* clone() const override { return new zc_length_protocol; }
+	frame_t frame(const char* data, size_t length, size_t& used, std::string& message, std::string& reply) override;
+	void encode(size_t length, std::string& header) override;
+};
+
+//! \brief WebSocket (RFC 6455) messages. The connection starts with an HTTP
+//! upgrade handshake which is answered here - a request that is not a version 13
+//! upgrade is refused (400, or 426 for another version). Fragmented messages are reassembled,
+//! pings answered and close frames acknowledged. Responses are sent as a single
+//! frame of the same type (text or binary) as the last message received.
+class zc_websocket_protocol : public zc_protocol_handler
+{
+public:
+	zc_protocol_handler* clone() const override { return new zc_websocket_protocol; }
+	frame_t frame(const char* data, size_t length, size_t& used, std::string& message, std::string& reply) override;
+	void encode(size_t length, std::string& header) override;
+
+protected:
+	//! Answer the HTTP upgrade request.
+	frame_t handshake(const char* data, size_t length, size_t& used, std::string& reply);
+	//! Generate the header for a frame with \p opcode and \p length bytes of payload.
+	static void frame_header(unsigned char opcode, size_t length, std::string& header);
+
+	//! The upgrade handshake has been completed.
+	bool upgraded_{ false };
+	//! Payload of a fragmented message received so far.
+	std::string fragments_;
+	//! Opcode of the fragmented message.
+	unsigned char fragment_opcode_{ 0 };
+	//! The last message was binary - reply in kind.
+	std::atomic<bool> binary_{ false };
+};
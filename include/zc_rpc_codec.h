@@ -0,0 +1,128 @@
+/*
+	Copyright 2026, Philip Rose, GM3ZZA
+
+	This file is part of ZZACOMMON.
+
+	ZZACOMMON is free software: you can redistribute it and/or modify it under the
+	terms of the Lesser GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later version.
+
+	ZZACOMMON is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+	without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+	PURPOSE. See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along with ZZACOMMON.
+	If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#pragma once
+
+#include "zc_rpc_data_item.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+//! \file zc_rpc_codec.h
+//! Single-pass XML-RPC encoding and decoding.
+
+//! \brief This class converts between zc_rpc_data_item and XML-RPC messages
+//! without building a document tree.
+//!
+//! The encoder appends compact XML directly to a string. The decoder is a pull
+//! parser that walks the message once, creating data items as each value closes.
+//! Only the XML that XML-RPC uses is understood: elements, character data with
+//! the predefined and numeric entities, CDATA sections, comments and the XML declaration.
+//! A numeric reference that does not name a Unicode character makes the message malformed.
+class zc_rpc_codec
+{
+public:
+	//! Append a methodCall for \p method_name with \p params to \p xml.
+	static void write_request(const std::string& method_name, zc_rpc_data_item::rpc_list* params, std::string& xml);
+	//! Append a methodResponse to \p xml - \p response is the fault struct if \p fault is true.
+	static void write_response(bool fault, zc_rpc_data_item* response, std::string& xml);
+	//! Append a methodResponse to \p xml whose \<value\> element is already encoded in \p value.
+	static void write_encoded_response(std::string_view value, std::string& xml);
+	//! Append the \<value\> element for \p item to \p xml.
+	static void write_value(zc_rpc_data_item& item, std::string& xml);
+	//! Append \p length bytes at \p text to \p xml, escaping markup characters.
+	static void write_text(const char* text, size_t length, std::string& xml);
+
+	//! Decode a methodCall.
+
+	//! \param xml Start of the message.
+	//! \param length Length of the message in bytes.
+	//! \param method_name Receives the method name.
+	//! \param params Receives the parameters - the caller owns the new items unless \p arena is given.
+	//! \param arena If not nullptr the items are created in (and owned by) this arena.
+	//! \return true if successful.
+	static bool read_request(const char* xml, size_t length, std::string& method_name, zc_rpc_data_item::rpc_list* params,
+		zc_rpc_arena* arena = nullptr);
+	//! Decode a methodResponse.
+
+	//! \param xml Start of the message.
+	//! \param length Length of the message in bytes.
+	//! \param response Receives the returned value (or the fault struct).
+	//! \param fault Receives true if the response is a fault.
+	//! \param arena If not nullptr the nested items are created in this arena, which
+	//! must then be the one that created \p response.
+	//! \return true if successful.
+	static bool read_response(const char* xml, size_t length, zc_rpc_data_item* response, bool& fault,
+		zc_rpc_arena* arena = nullptr);
+
+	//! Deepest nesting of arrays and structs that will be decoded - a message nested deeper is rejected.
+	static const int MAX_DEPTH = 512;
+
+protected:
+	//! Markup returned by the pull parser.
+	enum token_t {
+		T_START,           //!< \<name\>
+		T_END,             //!< \</name\>
+		T_EMPTY,           //!< \<name/\>
+		T_TEXT,            //!< Character data (unescaped)
+		T_EOF,             //!< End of the message
+		T_ERROR            //!< Malformed XML
+	};
+
+	//! Pull parser over a message.
+	
+	//! Names and character data are returned as views into the message (or
+	//! into an internal buffer when entities have been replaced), so reading
+	//! a token does not allocate.
+	class reader
+	{
+	public:
+		//! Read from \p length bytes at \p xml, creating items in \p arena (or on the heap if nullptr).
+		reader(const char* xml, size_t length, zc_rpc_arena* arena = nullptr);
+		//! Returns the next token.
+		token_t next();
+		//! Returns the next token that is not whitespace-only text.
+		token_t next_tag();
+		//! Element name of the last tag.
+		std::string_view name() const { return name_; }
+		//! Character data of the last T_TEXT token - valid until the next call to next().
+		std::string_view text() const { return text_; }
+		//! Read a \<value\> element whose start tag has been read into \p item.
+		bool read_value(zc_rpc_data_item& item);
+		//! Expect \<\p name\> next - returns false if it is not.
+		bool expect_start(std::string_view name);
+		//! Expect \</\p name\> next - returns false if it is not.
+		bool expect_end(std::string_view name);
+		//! Read character data up to \</\p name\> into \p text.
+		bool read_text(std::string_view name, std::string& text);
+
+	protected:
+		//! Returns a new item, array or struct from the arena or the heap.
+		zc_rpc_data_item* new_item();
+		zc_rpc_data_item::rpc_array* new_array();      //!< \copydoc new_item
+		zc_rpc_data_item::rpc_struct* new_struct();    //!< \copydoc new_item
+
+		const char* p_;            //!< Current position
+		const char* end_;          //!< End of the message
+		std::string_view name_;    //!< Element name
+		std::string_view text_;    //!< Character data
+		std::string buffer_;       //!< Character data with entities replaced
+		zc_rpc_arena* arena_;      //!< Where to create items
+		int depth_;                //!< Arrays and structs open around the current value
+	};
+};
@@ -21,9 +21,12 @@
 #include <cstdint>
 #include <list>
 #include <map>
+#include <memory_resource>
 #include <string>
+#include <variant>
 #include <vector>
 
+	class zc_rpc_arena;
 
 	//! XML-RPC data types
 	enum rpc_data_t {
@@ -40,22 +43,40 @@
 	};
 
 	//! This class describes an Remote Procedure Call (XML-RPC) data item 
+	
+	//! The value is held in a std::variant so an item only carries the
+	//! representation for its type. Items created with new own their arrays and
+	//! structs and delete them recursively. Items created by a zc_rpc_arena are
+	//! owned by the arena, as are their arrays and structs: nothing is deleted
+	//! individually and the arena frees the lot at once.
+	//! Copying an item makes a deep copy: a new item is on the heap, whichever way
+	//! the original was created.
 	class zc_rpc_data_item
 	{
+		friend class zc_rpc_arena;
+
 	public:
 		// Compound RPC data-types
-		//! RPC Array of data items
-		typedef std::vector<zc_rpc_data_item*> rpc_array;
-		//! RPC Structure
-		typedef std::map<std::string, zc_rpc_data_item*> rpc_struct;
+		//! RPC Array of data items - memory comes from the arena if made by one.
+		typedef std::pmr::vector<zc_rpc_data_item*> rpc_array;
+		//! RPC Structure - memory comes from the arena if made by one.
+		typedef std::pmr::map<std::string, zc_rpc_data_item*> rpc_struct;
 		//! RPC List
 		typedef std::list<zc_rpc_data_item*> rpc_list;
 
 	public:
 		//! Constructor.
 		zc_rpc_data_item();
+		//! Copy constructor - deep copy.
+		zc_rpc_data_item(const zc_rpc_data_item& other);
+		//! Move constructor - takes ownership of \p other's value.
+		zc_rpc_data_item(zc_rpc_data_item&& other);
 		//! Destructor.
 		~zc_rpc_data_item();
+		//! Copy assignment - deep copy.
+		zc_rpc_data_item& operator=(const zc_rpc_data_item& other);
+		//! Move assignment - takes ownership of \p other's value.
+		zc_rpc_data_item& operator=(zc_rpc_data_item&& other);
 
 		//! Returns the data type of this data item
 		rpc_data_t type() const;
@@ -67,7 +88,7 @@
 		bool get(rpc_struct*& mp);   //!< Receives item as a structure, returns false if not a structure.
 		// Returns the data as specific type
 		int32_t get_int() const;           //!< Returns item as a 32-bit integer
-		std::string get_string();         //!< Returns item as a string
+		const std::string& get_string() const;    //!< Returns item as a string - empty if it is not one
 		double get_double() const;         //!< Returns item as a double-precision value
 		rpc_array* get_array();      //!< Returns item as an array
 		rpc_struct* get_struct();    //!< Returns item as a structure
@@ -79,22 +100,67 @@
 		//! Set the data as a string or byte encoded string or a date/time
 		void set(std::string s, rpc_data_t Type);
 		void set(double d);          //!< Set the item as a double-precision value.
-		void set(rpc_array* ap);     //!< Set the item as an array
-		void set(rpc_struct* mp);    //!< Set the item as a structure.
+		//! Set the item as an array - the item takes ownership of \p ap.
+		
+		//! An item made by a zc_rpc_arena must be given an array made by the same arena.
+		void set(rpc_array* ap);
+		//! Set the item as a structure - the item takes ownership of \p mp.
+		
+		//! An item made by a zc_rpc_arena must be given a struct made by the same arena.
+		void set(rpc_struct* mp);
 
 	protected:
+		//! Release the current value (and any array or struct it owns).
+		void clear();
+		//! Deep copy the value of \p other into this (empty) item - in the same arena as this.
+		void copy(const zc_rpc_data_item& other);
+
+		//! Representation of the value - which alternative depends on type_.
+		typedef std::variant<std::monostate, int32_t, double, std::string, rpc_array*, rpc_struct*> value_t;
+
 		//! The type of data
 		rpc_data_t type_;
-		//! Its representation as a 32-bit integer
-		int32_t i_;
-		//! Its representation as a string
-		std::string s_;
-		//! Its representation as a double-precision value
-		double d_;
-		//! Its representation as an array
-		rpc_array* array_;
-		//! Its representation as a structure
-		rpc_struct* struct_;
+		//! The arena the item, and its array or struct, belong to - nullptr if on the heap.
+		zc_rpc_arena* arena_;
+		//! The value
+		value_t value_;
+
+	};
+
+	//! \brief This class provides the memory for a tree of zc_rpc_data_item.
+	
+	//! Items, arrays and structs are carved from a std::pmr::monotonic_buffer_resource
+	//! so decoding a message takes a few large allocations rather than one for each
+	//! value, array element and struct member. Everything is destroyed and freed
+	//! together when the arena is released or destroyed, so none of it may be
+	//! deleted individually nor outlive the arena - copy an item to keep it.
+	class zc_rpc_arena
+	{
+	public:
+		//! Constructor - \p block_size is the size of the first block of memory.
+		zc_rpc_arena(size_t block_size = 4096);
+		//! Destructor - destroys all the items.
+		~zc_rpc_arena();
+		zc_rpc_arena(const zc_rpc_arena&) = delete;
+		zc_rpc_arena& operator=(const zc_rpc_arena&) = delete;
+
+		//! Returns a new empty item.
+		zc_rpc_data_item* new_item();
+		//! Returns a new empty array.
+		zc_rpc_data_item::rpc_array* new_array();
+		//! Returns a new empty struct.
+		zc_rpc_data_item::rpc_struct* new_struct();
+		//! Destroy all the items and make the memory available for reuse.
+		void release();
+		//! The memory resource.
+		std::pmr::memory_resource* resource() { return &resource_; }
+
+	protected:
+		//! The memory
+		std::pmr::monotonic_buffer_resource resource_;
+		//! The items to destroy - on the heap, as a vector growing in the arena
+		//! would leave each outgrown buffer behind until release().
+		std::vector<zc_rpc_data_item*> items_;
 
 	};
 #endif 
\ No newline at end of file
@@ -20,32 +20,95 @@
 
 #include "zc_rpc_data_item.h"
 
-#include "pugixml.hpp"
-
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
 #include <istream>
-#include <map>
+#include <list>
+#include <memory>
+#include <mutex>
 #include <ostream>
 #include <sstream>
 #include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 class zc_socket_server;
 class zc_url_handler;
 
 	//! This class acts as both a server or a client for the XML-RPC interfcae.
+	
+	//! XML-RPC is used by default. The server also accepts JSON-RPC 2.0, answering
+	//! in the encoding of each request as given by its Content-Type, and the client
+	//! can be set to send JSON-RPC with client_encoding().
 	class zc_rpc_handler
 	{
 	public:
 		//! The only HTTP codes supported
 		enum http_code {
 			OK = 200,           //<! 200 OK
+			NO_CONTENT = 204,   //<! 204 No Content - reply to a JSON-RPC notification
 			BAD_REQUEST = 400   //<! 400 Bad Request.
 		};
+		//! Fault codes from the XML-RPC fault code interoperability specification
+		enum fault_code {
+			FAULT_PARSE_ERROR = -32700,       //!< Request not well formed
+			FAULT_UNKNOWN_METHOD = -32601,    //!< Requested method not found
+			FAULT_INVALID_PARAMS = -32602,    //!< Invalid method parameters
+			FAULT_INTERNAL_ERROR = -32603     //!< Internal error - eg an asynchronous method did not reply
+		};
+		//! Encoding of the messages
+		enum rpc_encoding {
+			XML_RPC,          //!< XML-RPC - Content-Type text/xml
+			JSON_RPC          //!< JSON-RPC 2.0 - Content-Type application/json
+		};
 		//! Structure for an entry for specific method call.
 		struct method_entry {
 			std::string name;        //!< Method name
 			std::string signature;   //!< Method signature - ie encoded parameter and response
 			std::string help_text;   //!< Brief help text.
 		};
+		//! One call in a batch - see do_request_batch().
+		struct batch_call {
+			std::string method_name;                  //!< Method name
+			zc_rpc_data_item::rpc_list* params;       //!< Parameters for the method
+			zc_rpc_data_item* response;               //!< Receives the value returned, or the fault struct
+			bool ok;                                  //!< Receives true if the call succeeded
+		};
+		//! Method callback - callback(params, response) returns 0 if successful.
+		typedef std::function<int(zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response)> method_fn;
+
+		//! \brief Completion token passed to an asynchronous method.
+		
+		//! The method returns as soon as it has started its work and calls reply()
+		//! later, from any thread, with the result - the server carries on handling
+		//! other requests meanwhile. Copies of the token refer to the same call.
+		//! If every copy is destroyed without a reply the caller receives a fault.
+		class completion_token
+		{
+		public:
+			//! Send \p response - the fault struct if \p error is non-zero (generated if
+			//! \p response is not a struct). Only the first reply is sent.
+			void reply(int error, zc_rpc_data_item& response);
+
+		protected:
+			friend class zc_rpc_handler;
+			//! The call - defined with the handler
+			struct call_t;
+			//! Shared by the copies
+			std::shared_ptr<call_t> call_;
+		};
+		//! Asynchronous method callback - callback(params, token).
+		
+		//! The parameters are freed when the callback returns - copy any item that
+		//! must be kept for the reply.
+		typedef std::function<void(zc_rpc_data_item::rpc_list& params, completion_token token)> async_method_fn;
 
 		//! Constructor.
 		
@@ -62,10 +125,37 @@ class zc_url_handler;
 		//! \param response Receives response from the remote procedure call.
 		//! \return true if successful.
 		bool do_request(std::string method_name, zc_rpc_data_item::rpc_list* params, zc_rpc_data_item* response);
+		//! Start a request and return without waiting for the response.
+		
+		//! The request is sent on one of the client connections to the host given
+		//! to the constructor. Each connection is kept open between requests.
+		//! \param method_name Name of the method
+		//! \param params Parameters for the method - not needed once this returns.
+		//! \param response Receives response from the remote procedure call - it must
+		//! remain valid until the result is ready.
+		//! \return Becomes true if the request was successful.
+		std::future<bool> do_request_async(std::string method_name, zc_rpc_data_item::rpc_list* params, zc_rpc_data_item* response);
+		//! Make several calls in one request using system.multicall.
+		
+		//! The calls travel to the server in one HTTP request and are answered in one
+		//! response. Each call succeeds or fails separately.
+		//! \param calls The calls - their responses and results are filled in.
+		//! \return true if the batch was exchanged, even if some calls failed.
+		bool do_request_batch(std::vector<batch_call>& calls);
+		//! Set the number of client connections used for concurrent requests (default 1).
+		void client_connections(int count);
+		//! Set the encoding of client requests (default XML_RPC) - applies to requests made after this.
+		void client_encoding(rpc_encoding encoding);
+		//! Returns the encoding of client requests.
+		rpc_encoding client_encoding() const;
 		//! Receive the request from strean \p ss.
 		static int rcv_request(void* instance, std::stringstream& ss);
 		//! Run server
 		void run_server();
+		//! Set the number of listener threads for the server - call before run_server().
+		
+		//! See zc_socket_server::listeners.
+		void listeners(int count);
 		//! Close server
 		void close_server();
 		//! Returns true if the server is active.
@@ -74,78 +164,222 @@ class zc_url_handler;
 		
 		//! \param v Pointer to indicate callback instance.
 		//! \param method Method entry structire.
-		//! \param callback Local method to handle request.
+		//! \param callback Local method to handle request. The parameters are freed when
+		//! it returns - copy any item that must be kept.
 		void add_method(void* v, method_entry method, int(*callback)(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response));
+		//! Add a method for the server to handle - \p callback is any callable object.
+		
+		//! \param method Method entry structure.
+		//! \param callback Local method to handle request. The parameters are freed when
+		//! it returns - copy any item that must be kept.
+		void add_method(method_entry method, method_fn callback);
+		//! Add a method that replies later through a completion_token.
+		
+		//! Its responses are not cached, and it cannot be called within system.multicall.
+		//! \param method Method entry structure.
+		//! \param callback Starts the method - see async_method_fn.
+		void add_async_method(method_entry method, async_method_fn callback);
+		//! Add the method "system.serverMetrics" that returns the socket server counters.
+		void add_metrics_method();
+		//! Keep the encoded responses of method \p name and serve repeated calls from them.
+		
+		//! Only for a method whose response depends on nothing but its parameters and
+		//! slowly changing state: a response is kept for each different set of parameters,
+		//! and a failed call is not kept. system.listMethods and system.methodHelp are cached
+		//! from the start.
+		//! \param name The method name.
+		//! \param ttl How long a response is kept - zero for until invalidate_cache(), negative to stop caching.
+		//! \return false if there is no such method.
+		bool cache_responses(const std::string& name, std::chrono::milliseconds ttl = std::chrono::milliseconds(0));
+		//! Discard the cached responses of method \p name - call when the state it returns changes.
+		void invalidate_cache(const std::string& name);
 
 	protected:
 		//! Method definition structure
 		struct method_def {
+			std::string name;             //!< Method name
 			std::string signature;        //!< Method signature (coded form of parameters and response).
 			std::string help_text;        //!< Help text
-			void* v{ nullptr };                 //!< Instance pointer for callback
-			int(*callback)(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response) { nullptr };
-			                         //!< Method call - callback(params, response) 
+			method_fn callback;           //!< Method call - callback(params, response)
+			async_method_fn async_callback;   //!< Asynchronous method call - used instead of callback if set
+			uint32_t hash{ 0 };           //!< Hash of the name
+			std::chrono::milliseconds cache_ttl{ -1 };   //!< How long responses are cached - negative if not cached
+			uint64_t cache_version{ 0 };                 //!< Cached responses with a different version are stale
+		};
+		//! A cached response
+		struct cache_entry {
+			std::string key;                                  //!< Method name and encoded parameters
+			uint64_t version;                                 //!< cache_version of the method when stored
+			std::chrono::steady_clock::time_point expiry;     //!< When it expires if the method has a TTL
+			std::string value[2];                             //!< Encoded value for each rpc_encoding - empty if not yet stored
+		};
+
+		//! \brief Dispatch table from method name to definition.
+		
+		//! The names are hashed once when added; a lookup hashes the requested name
+		//! and probes an open-addressed index, so the cost does not depend on how
+		//! many methods are registered and no string is copied.
+		//! A definition stays where it is until clear(), even when its method is
+		//! replaced, so a callback may add or replace methods while it runs.
+		class method_table
+		{
+		public:
+			//! Add or replace a method.
+			void add(method_def&& def);
+			//! Returns the method called \p name, or nullptr if there is none.
+			const method_def* find(std::string_view name) const;
+			method_def* find(std::string_view name);       //!< \copydoc find
+			//! Remove all the methods.
+			void clear();
+			//! The methods in the order they were first added.
+			const std::vector<std::unique_ptr<method_def>>& methods() const { return methods_; }
+
+		protected:
+			//! Rebuild the index for the current methods.
+			void rehash();
+
+			//! The definitions
+			std::vector<std::unique_ptr<method_def>> methods_;
+			//! Replaced definitions - kept as their callbacks may still be running.
+			std::vector<std::unique_ptr<method_def>> retired_;
+			//! Open-addressed index - 1 + index into methods_, 0 for an empty slot.
+			std::vector<uint32_t> slots_;
 		};
 
 
-		//! Generate the RPC request XML
+		//! Link from completion tokens to the handler - cut when the server closes.
+		struct server_link {
+			std::mutex mutex;                 //!< Held while replying
+			zc_rpc_handler* handler;          //!< The handler - nullptr once the server has closed
+		};
+		//! Send the reply for an asynchronous \p call.
+		static void complete(completion_token::call_t& call, int error, zc_rpc_data_item& response);
+
+		//! A request waiting for a client connection
+		struct client_job {
+			std::string request_xml;          //!< The request
+			rpc_encoding encoding;            //!< The encoding of the request and response
+			zc_rpc_data_item* response;       //!< Receives the response
+			std::promise<bool> result;        //!< Set when the response has been decoded
+		};
+
+		//! Queue \p request_xml for a client connection - the decoded reply goes into \p response.
+		std::future<bool> post_request(std::string&& request_xml, rpc_encoding encoding, zc_rpc_data_item* response);
+		//! Start the client connection threads if they are not running.
+		void start_client();
+		//! Stop the client connection threads - outstanding requests fail.
+		void stop_client();
+		//! Client connection thread - posts requests from the queue through the URL handler.
+		void client_thread();
+
+		//! Generate the RPC request
 		
 		//! \param method_name Name of method.
 		//! \param params Parameters for the method.
-		//! \param request_xml Output stream to send the request out on.
+		//! \param encoding The encoding to use.
+		//! \param request_xml Receives the request - appended to the string.
 		//! \return true if successful.
-		bool generate_request(std::string method_name, zc_rpc_data_item::rpc_list* params, std::ostream& request_xml);
+		bool generate_request(std::string method_name, zc_rpc_data_item::rpc_list* params, rpc_encoding encoding,
+			std::string& request_xml);
 		//! Generate an RPC Response.
 		
 		//! \param fault true if responding with an error.
 		//! \param response The data item as method return.
-		//! \param response_xml Output stream to send the response out on.
-		bool generate_response(bool fault, zc_rpc_data_item* response, std::ostream& response_xml);
-		//! Decode the RPC Request XML
+		//! \param encoding The encoding to use.
+		//! \param id JSON-RPC request identifier (JSON text) - not used for XML-RPC.
+		//! \param response_xml Receives the response - appended to the string.
+		bool generate_response(bool fault, zc_rpc_data_item* response, rpc_encoding encoding, const std::string& id,
+			std::string& response_xml);
+		//! Decode the RPC Request
 		
-		//! \param request_xml Input stream provodong the request
+		//! \param request_xml The request.
+		//! \param encoding The encoding of the request.
 		//! \param method_name Receives the method name
 		//! \param params Receives the parameters for the request
+		//! \param id Receives the JSON-RPC request identifier (JSON text), empty for a notification.
+		//! \param arena If not nullptr, creates the parameters in this arena.
 		//! \return true if successful.
-		bool decode_request(std::istream& request_xml, std::string& method_name, zc_rpc_data_item::rpc_list* params);
-		//! Decode the RPC Response XML.
+		bool decode_request(std::string_view request_xml, rpc_encoding encoding, std::string& method_name,
+			zc_rpc_data_item::rpc_list* params, std::string& id, zc_rpc_arena* arena = nullptr);
+		//! Decode the RPC Response.
 		
-		//! \param response_xml Input stream providing the response
+		//! \param response_xml The response.
+		//! \param encoding The encoding of the response.
 		//! \param response Receives the response returned by the remote method.
 		//! \param fault Receives true if the response contains an error.
 		//! \return true if successful.
-		bool decode_response(std::istream& response_xml, zc_rpc_data_item* response, bool& fault);
-		//! Write XML for an individual data \p item to XML \p node
-		void write_item(zc_rpc_data_item& item, pugi::xml_node& node);
-		//! Gate RPC data item from \p item from XML \p node
-		void read_item(pugi::xml_node& node, zc_rpc_data_item& item);
+		bool decode_response(std::string_view response_xml, rpc_encoding encoding, zc_rpc_data_item* response, bool& fault);
 		//! Decode the request on the input stream \p ss, perform the action and send response.
 		int handle_request(std::stringstream& ss);
 		//! Reserved method: List the available methods.
 		static int list_methods(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response);
+		//! Reserved method: Make each call in the array of {methodName, params} structs.
+		static int multicall(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response);
 		//! Reseeved method: Send method help message.
 		static int method_help(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response);
+		//! Optional method: Return the socket server counters.
+		static int server_metrics(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response);
+
+		//! Look up the cached response for \p key - if there is one append the response to \p body and return true.
+		
+		//! \p version receives the method's cache version to pass to cache_response().
+		bool cached_response(const method_def& def, const std::string& key, rpc_encoding encoding, const std::string& id,
+			std::string& body, uint64_t& version);
+		//! Encode \p response and append the response to \p body - caching it for \p key unless
+		//! the cache \p version of method \p method_name has changed since the lookup.
+		void cache_response(const std::string& method_name, const std::string& key, uint64_t version,
+			zc_rpc_data_item& response, rpc_encoding encoding, const std::string& id, std::string& body);
 
-		//! Generate error \p response for \p code with \p message.
+		//! Generate error \p response - the {faultCode, faultString} struct - for \p code with \p message.
 		void generate_error(int code, std::string message, zc_rpc_data_item& response);
 
-		//! Remove header - returns true if successful and \p payload receives the request body.
-		bool strip_header(std::stringstream& message, std::stringstream& payload) const;
-		//! Add header with result \p code to the \p payload to generate  \p message.
-		bool add_header(http_code code, std::stringstream& payload, std::stringstream& message);
+		//! Check the HTTP header - returns true if it is a POST to our resource and
+		//! \p payload receives the request body (a view into \p message).
+		//! \p encoding receives the encoding given by the Content-Type field.
+		bool strip_header(std::string_view message, std::string_view& payload, rpc_encoding& encoding) const;
+		//! Generate the HTTP \p header with result \p code for a payload of \p len_payload bytes in \p encoding.
+		bool add_header(http_code code, size_t len_payload, std::string& header, rpc_encoding encoding = XML_RPC);
 
 		//! The resource name
 		std::string resource_;
 		//! The host name
 		std::string host_name_;
-		//! HTML server
-		zc_socket_server* server_;
+		//! HTML server - shared with the asynchronous replies being sent so that it outlives them
+		std::shared_ptr<zc_socket_server> server_;
 		//! Server port
 		int server_port_;
+		//! Number of listener threads for the server
+		int server_listeners_;
 		//! The method definitions
-		std::map<std::string, method_def> method_list_;
-		//! URL handler for client requests
-		zc_url_handler* url_handler_;
+		method_table method_list_;
+		//! URL handler for the client if the application has not created url_handler_
+		std::unique_ptr<zc_url_handler> own_url_handler_;
+		//! Client connection threads
+		std::vector<std::thread> client_threads_;
+		//! Number of client connections
+		int client_connections_;
+		//! Requests waiting for a connection
+		std::deque<client_job> client_jobs_;
+		//! Lock for client_jobs_, client_closing_, client_threads_ and client_connections_
+		std::mutex client_mutex_;
+		//! Signals a new request or closing
+		std::condition_variable client_cv_;
+		//! The client threads are to stop
+		bool client_closing_;
+		//! Encoding of client requests
+		std::atomic<rpc_encoding> client_encoding_;
+		//! Identifier for the next JSON-RPC client request
+		std::atomic<uint32_t> client_id_;
+		//! Cached responses - the most recently used first
+		std::list<cache_entry> cache_lru_;
+		//! Position in cache_lru_ of each response - keyed by method name and encoded parameters
+		std::unordered_map<std::string, std::list<cache_entry>::iterator> response_cache_;
+		//! Source of method cache versions
+		uint64_t cache_generation_;
+		//! Lock for the response cache and the methods' cache settings
+		std::mutex cache_mutex_;
+		//! Link for the completion tokens of the running server
+		std::shared_ptr<server_link> link_;
 
 	};
 
@@ -0,0 +1,82 @@
+/*
+	Copyright 2026, Philip Rose, GM3ZZA
+
+	This file is part of ZZACOMMON.
+
+	ZZACOMMON is free software: you can redistribute it and/or modify it under the
+	terms of the Lesser GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later version.
+
+	ZZACOMMON is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+	without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+	PURPOSE. See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along with ZZACOMMON.
+	If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#pragma once
+
+#include "zc_rpc_data_item.h"
+
+#include <cstddef>
+#include <string>
+#include <string_view>
+
+//! \file zc_rpc_json_codec.h
+//! JSON-RPC 2.0 encoding and decoding.
+
+//! \brief This class converts between zc_rpc_data_item and JSON-RPC 2.0 messages.
+//!
+//! It is the compact alternative to zc_rpc_codec: zc_rpc_handler uses it when a
+//! request arrives with Content-Type application/json, or for its own requests
+//! when the client encoding is set to JSON-RPC.
+//! Messages are written straight to the string, and read with the nlohmann::json
+//! SAX parser creating the items as it goes, so no json document is built.
+//! The value types map as follows: int and boolean to JSON integer and boolean,
+//! double to number, string and dateTime to string, base64 to a string of the
+//! base64 encoding, array to array and struct to object. A JSON integer beyond
+//! 32 bits is decoded as a double and null as an empty item.
+//! The XML-RPC fault struct {faultCode, faultString} is sent as the JSON-RPC
+//! error object {code, message} and decoded back into the same struct.
+class zc_rpc_json_codec
+{
+public:
+	//! Append a request for \p method_name with \p params to \p json.
+
+	//! \param id The request identifier as JSON text (eg "1") - empty for a notification.
+	static void write_request(const std::string& method_name, zc_rpc_data_item::rpc_list* params,
+		const std::string& id, std::string& json);
+	//! Append a response to \p json - \p response is the fault struct if \p fault is true.
+
+	//! \param id The identifier from the request as JSON text - empty for null.
+	static void write_response(bool fault, zc_rpc_data_item* response, const std::string& id, std::string& json);
+	//! Append a successful response to \p json whose result is already encoded in \p value.
+	static void write_encoded_response(std::string_view value, const std::string& id, std::string& json);
+	//! Append the JSON value for \p item to \p json.
+	static void write_value(zc_rpc_data_item& item, std::string& json);
+
+	//! Decode a request.
+
+	//! \param json Start of the message.
+	//! \param length Length of the message in bytes.
+	//! \param method_name Receives the method name.
+	//! \param params Receives the parameters - named parameters are passed as a single struct.
+	//! The caller owns the new items unless \p arena is given.
+	//! \param id Receives the request identifier as JSON text - empty for a notification.
+	//! \param arena If not nullptr the items are created in (and owned by) this arena.
+	//! \return true if successful.
+	static bool read_request(const char* json, size_t length, std::string& method_name, zc_rpc_data_item::rpc_list* params,
+		std::string& id, zc_rpc_arena* arena = nullptr);
+	//! Decode a response.
+
+	//! \param json Start of the message.
+	//! \param length Length of the message in bytes.
+	//! \param response Receives the returned value (or the fault struct).
+	//! \param fault Receives true if the response is an error.
+	//! \param arena If not nullptr the nested items are created in this arena, which
+	//! must then be the one that created \p response.
+	//! \return true if successful.
+	static bool read_response(const char* json, size_t length, zc_rpc_data_item* response, bool& fault,
+		zc_rpc_arena* arena = nullptr);
+};
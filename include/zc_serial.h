@@ -19,8 +19,13 @@
 #define __SERIAL__
 
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
 #include <set>
 #include <string>
+#include <vector>
 
 #include <boost/asio.hpp>
 
@@ -30,16 +35,38 @@
 	//! It provides a lightweight wrapper around boost::asio::serial_port to
 	//! provide a simple API for reading and writing to a serial port.
 	//! It also allows the user to query the available serial ports on the system.
+	//!
+	//! As well as the blocking calls it provides asynchronous reads and writes
+	//! whose handlers are called by the thread running the io_context. Several
+	//! ports can share one io_context, so a single thread can service them all.
+	//! The asynchronous functions must be called from that thread (eg from a
+	//! handler or a function passed to boost::asio::post) once it is running.
+	//! A zc_serial may be destroyed while its operations are in progress - the
+	//! handlers keep what they use until the io_context has finished with them.
 	class zc_serial
 	{
 	public:
+		//! Called when an asynchronous read finishes - handler(ok, line).
+		typedef std::function<void(bool ok, const std::string& line)> read_fn;
+		//! Called when an asynchronous write finishes - handler(ok).
+		typedef std::function<void(bool ok)> write_fn;
 	
-		//! Constructor for zc_serial.
+		//! Constructor for zc_serial with its own io_context.
 		//! \param port The name of the serial port to connect to.
 		//! \param baud_rate The baud rate for the serial connection.
 		zc_serial(const std::string& port, int baud_rate);
 
+		//! Constructor for zc_serial sharing \p io with other ports.
+		//! \param io The io_context that runs the asynchronous operations - it must outlive this.
+		//! \param port The name of the serial port to connect to.
+		//! \param baud_rate The baud rate for the serial connection.
+		zc_serial(boost::asio::io_context& io, const std::string& port, int baud_rate);
+
 		//! Destructor for zc_serial. It closes the serial connection.
+		
+		//! Any asynchronous operations in progress are cancelled and their handlers
+		//! are not called. It must be called from the thread running the io_context,
+		//! or while the io_context is not running.
 		~zc_serial();
 
 		//! Read a line of text from the serial port. 
@@ -58,11 +85,58 @@
 		//! \return true if the line was successfully written, false otherwise.
 		bool write_line(const std::string& line);
 
-		//! Check if the serial port is open and ready for communication.
-		bool is_connected() const {
-			return serial_port_ && serial_port_->is_open();
+		//! Read a line of text from the serial port without waiting for it.
+		
+		//! Only one read may be in progress at a time.
+		//! \param handler Called with the line, without the \p delimiter, when it arrives.
+		//! \param timeout Time to wait for the line - zero to wait for ever. When it runs
+		//! out all the operations in progress on the port are cancelled and fail.
+		//! \param delimiter The character that ends a line (eg ';' for many CAT protocols).
+		void async_read_line(read_fn handler, std::chrono::milliseconds timeout = std::chrono::milliseconds(0),
+			char delimiter = '\n');
+
+		//! Write \p data to the serial port without waiting for it to be sent.
+		
+		//! Writes are queued and sent in the order they were made.
+		//! \param data The data to send - it is copied.
+		//! \param handler If set, called when the data has been sent.
+		//! \param timeout Time allowed to send the data once it reaches the front of
+		//! the queue - zero for no limit. When it runs out all the operations in progress
+		//! on the port are cancelled and fail.
+		void async_write(const std::string& data, write_fn handler = nullptr,
+			std::chrono::milliseconds timeout = std::chrono::milliseconds(0));
+
+		//! Cancel the asynchronous read and write in progress - their handlers are called with false.
+		void cancel();
+
+		//! The io_context that runs the asynchronous operations.
+		boost::asio::io_context& io_context() {
+			return io_;
 		}
 
+		//! Check if the serial port is open and ready for communication.
+		bool is_connected() const;
+
+		//! Description of a serial port
+		struct port_info {
+			std::string name;                   //!< Name to open it by (eg /dev/ttyUSB0 or COM3)
+			bool available = false;             //!< This user can open it
+			uint16_t vid = 0;                   //!< USB vendor ID - 0 if it is not a USB device
+			uint16_t pid = 0;                   //!< USB product ID
+			std::string serial_number;          //!< USB serial number - if the device has one
+			std::string manufacturer;           //!< USB manufacturer string
+			std::string product;                //!< USB product string
+		};
+
+		//! Provides a description of each serial port, in order of name.
+		
+		//! On Linux the ports are found from /sys/class/tty without opening any of
+		//! them. The result is kept and only looked for again when a tty device is
+		//! added to or removed from /dev, so repeated calls are cheap.
+		//! Elsewhere each possible port name is tried.
+		//! \param all_ports Provide all ports even if they are not available for use.
+		static std::vector<port_info> port_details(bool all_ports);
+
 		//! Provides a set of all available ports
 		
 		//! \param num_ports the size of array \p ports.
@@ -76,7 +150,21 @@
 		static std::set<std::string> available_ports(bool all_ports);
 
 	private:
-		boost::asio::serial_port* serial_port_ = nullptr;
+		//! Open \p port at \p baud_rate - leaves the port closed if it cannot.
+		void open(const std::string& port, int baud_rate);
+		//! The port and what the asynchronous operations on it use.
+		struct port_state;
+		//! Send the write at the front of the queue.
+		static void start_write(const std::shared_ptr<port_state>& s);
+		//! Finish the write at the front of the queue and start the next.
+		static void finish_write(const std::shared_ptr<port_state>& s, bool ok);
+
+		//! The io_context if it is not shared.
+		std::unique_ptr<boost::asio::io_context> own_io_;
+		//! The io_context that runs the asynchronous operations.
+		boost::asio::io_context& io_;
+		//! Shared with the handlers of the operations in progress so that it outlives this.
+		std::shared_ptr<port_state> state_;
 
 	};
 
@@ -18,22 +18,28 @@
 #ifndef __zc_socket_server__
 #define __zc_socket_server__
 
+#include "zc_protocol_handler.h"
 #include "zc_utils.h"
 
 #include <atomic>
+#include <chrono>
+#include <cstdint>
 #include <istream>
+#include <map>
+#include <memory>
 #include <mutex>
 #include <queue>
 #include <sstream>
 #include <string>
 #include <thread>
+#include <vector>
 #ifdef _WIN32
 #include <WinSock2.h>
 #else
 #include <netinet/in.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
-#include <sys/socket.h>
 #define SOCKET int
 #define SOCKADDR_IN sockaddr_in
 #endif
@@ -48,30 +54,148 @@
 
 		//! Supported protocols
 		enum protocol_t {
-			HTTP,
-			UDP
+			HTTP,             //!< HTTP requests - framed by Content-Length
+			UDP,              //!< Datagrams - each one is a request
+			TCP_LINE,         //!< Newline-terminated text commands (e.g. rigctld, CAT)
+			TCP_LENGTH,       //!< Binary messages with a 32-bit big-endian length prefix
+			WEBSOCKET,        //!< WebSocket messages following an HTTP upgrade
+			TCP_CUSTOM        //!< TCP framed by a supplied zc_protocol_handler (or unframed)
+		};
+
+		//! Number of buckets in the request latency histogram.
+		static const int NUM_LATENCY_BUCKETS = 24;
+
+		//! Snapshot of the server-wide counters.
+		struct metrics_t {
+			double elapsed{ 0.0 };                //!< Seconds since the counters were reset
+			uint64_t bytes_in{ 0 };               //!< Bytes received
+			uint64_t bytes_out{ 0 };              //!< Bytes sent
+			uint64_t packets_in{ 0 };             //!< Messages received - framed requests or datagrams
+			uint64_t packets_out{ 0 };            //!< Responses sent
+			uint64_t send_errors{ 0 };            //!< Responses that failed or timed out
+			uint64_t accepts{ 0 };                //!< Connections accepted
+			uint64_t active_connections{ 0 };     //!< Connections currently open
+			uint64_t queue_depth{ 0 };            //!< Packets waiting for the main thread
+			uint64_t max_queue_depth{ 0 };        //!< Most packets waiting at once
+			uint64_t requests{ 0 };               //!< Packets handled by the callback
+			//! Request latency histogram - bucket n counts requests handled (from receipt to
+			//! the callback returning, or to the response being sent if it was deferred) in
+			//! less than 2^n microseconds; the last bucket counts the rest.
+			uint64_t latency[NUM_LATENCY_BUCKETS]{};
+
+			//! Returns connections accepted per second.
+			double accept_rate() const { return elapsed > 0.0 ? accepts / elapsed : 0.0; }
+			//! Returns an upper bound (in microseconds) for the latency of fraction \p p (0.0 to 1.0) of requests.
+			double latency_percentile(double p) const;
+		};
+
+		//! Snapshot of the counters for an open connection.
+		struct connection_metrics_t {
+			std::string peer;                     //!< Peer address:port
+			double age{ 0.0 };                    //!< Seconds since the connection was accepted
+			uint64_t bytes_in{ 0 };               //!< Bytes received
+			uint64_t bytes_out{ 0 };              //!< Bytes sent
+			uint64_t packets_in{ 0 };             //!< Messages received - framed requests
+			uint64_t packets_out{ 0 };            //!< Responses sent
 		};
 		//! Constructor
 		 
 		//! \param protocol Create serverfor this protocol.
-		//! \param address Network address for other end of socket.
-		//! \param port_num Port number for other end of socket.
+		//! \param address Local address: an IPv4 or IPv6 literal or a host name.
+		//! It selects the address family - an empty string is IPv4 and an IPv6 
+		//! address listens for both IPv6 and IPv4 (dual-stack). The service listens
+		//! on all interfaces unless bind_address(true) restricts it to \p address.
+		//! Multicast group addresses (IPv4 or IPv6) join the group on all interfaces.
+		//! \param port_num Port number to listen on.
 		zc_socket_server(protocol_t protocol, const std::string& address, int port_num);
 		//! Destructor.
 		~zc_socket_server();
 
 		//! Close the socket
 		
-		//! \param external Waits for interface to quiesce.
+		//! Waits for the listener threads to finish - except a listener closing the
+		//! server itself, which is detached.
+		//! \param external Ignored - it is kept so that existing callers still build.
 		void close_server(bool external);
 		//! Start running the server
 		void run_server();
 		//! Returns true if this server is listening
 		bool has_server() const;
-		//! Set callback to handle requests. 
+		//! Set the number of listener threads - call before run_server().
+		
+		//! When \p count is more than 1, each thread binds its own socket to the
+		//! same port with SO_REUSEPORT and the kernel spreads incoming connections
+		//! or datagrams across them. Where SO_REUSEPORT is unavailable (Windows), 
+		//! or for multicast groups, a single listener is used.
+		void listeners(int count);
+		//! Returns the number of listener threads.
+		int listeners() const;
+		//! Set whether unicast services bind their own address - call before run_server().
+		
+		//! By default a service listens on all interfaces of its address family, 
+		//! whatever address it was given. With \p bind true it only listens on that
+		//! address, e.g. "127.0.0.1" or "localhost" to refuse other hosts.
+		void bind_address(bool bind);
+		//! Returns true if unicast services bind their own address.
+		bool bind_address() const;
+		//! Returns a snapshot of the server counters.
+		metrics_t metrics() const;
+		//! Returns a snapshot of the counters for each open connection.
+		std::vector<connection_metrics_t> connection_metrics() const;
+		//! Reset the server counters (other than active connections and queue depth).
+		void reset_metrics();
+		//! Set callback to handle requests for the service given to the constructor.
 		void callback(void* instance, int(*do_request)(void*, std::stringstream&));
+		//! Serve another protocol on the same listener threads - call before run_server().
+		
+		//! \param protocol Protocol for the service.
+		//! \param address Local address to listen on - as for the constructor.
+		//! \param port_num Port number to listen on.
+		//! \param instance Passed to \p do_request.
+		//! \param do_request Called in the main thread for each message received.
+		//! \param handler Framing for the service: the server takes ownership and 
+		//! clones it for each connection. If nullptr the default for \p protocol is used.
+		//! \return Index of the service.
+		int add_service(protocol_t protocol, const std::string& address, int port_num, 
+			void* instance, int(*do_request)(void*, std::stringstream&), zc_protocol_handler* handler = nullptr);
+		//! Returns a new instance of the default framing for \p protocol - nullptr for UDP.
+		static zc_protocol_handler* default_handler(protocol_t protocol);
+		//! Returns the name of \p protocol.
+		static const char* protocol_name(protocol_t protocol);
 		//! Send response
+		
+		//! The remainder of \p response is read into a single buffer and sent.
+		//! Responses on framed connections (e.g. TCP_LENGTH or WEBSOCKET) are
+		//! preceded by the framing generated by the connection's protocol handler.
 		int send_response(std::istream& response);
+		//! Send response supplied as separate header and body buffers.
+		
+		//! Both buffers are passed to the socket as a gather list (writev/sendmsg or
+		//! WSASend) so neither is copied. Partial writes are resumed and, if the
+		//! socket would block, the call waits for it to become writable.
+		//! \param header Response header, e.g. HTTP status line and fields (may be nullptr).
+		//! \param len_header Length of \p header in bytes.
+		//! \param body Response body (may be nullptr).
+		//! \param len_body Length of \p body in bytes.
+		//! \return 0 if the whole response was sent, negative on error.
+		int send_response(const char* header, size_t len_header, const char* body, size_t len_body);
+		//! Send response supplied as separate \p header and \p body strings.
+		int send_response(const std::string& header, const std::string& body);
+		//! Where a deferred response goes - see defer_response().
+		struct reply_t;
+		//! Returns where the response to the message being handled goes.
+		
+		//! Call from the request callback when the response will be sent later, by
+		//! send_response_to() from any thread. Responses on a connection go in the order
+		//! they are sent, so a client must wait for each response before its next request.
+		//! \return nullptr if no message is being handled.
+		std::shared_ptr<reply_t> defer_response();
+		//! Send a deferred response - as send_response() but to \p to.
+		
+		//! \return 0 if the whole response was sent, negative on error or if the server
+		//! has closed since the response was deferred.
+		int send_response_to(const std::shared_ptr<reply_t>& to, const char* header, size_t len_header,
+			const char* body, size_t len_body);
 
 	protected:
 
@@ -82,56 +206,168 @@
 			BLOCK = 2         //!< Response would block.
 		};
 
-		//! Receive a datagram from UDP client
-		int rcv_packet();
-		//! Accept the client - returns client status.
-		client_status accept_client();
+		//! An accepted stream connection.
+		
+		//! Shared between the listener thread and any pending response so that the 
+		//! socket is only closed once both have finished with it.
+		struct connection_t {
+			SOCKET socket;                    //!< Connected socket
+			sockaddr_storage addr{};          //!< Peer address
+			std::mutex mu_send;               //!< Serialises responses on this connection
+			//! When the connection was accepted
+			std::chrono::steady_clock::time_point accepted{ std::chrono::steady_clock::now() };
+			std::atomic<uint64_t> bytes_in{ 0 };      //!< Bytes received
+			std::atomic<uint64_t> bytes_out{ 0 };     //!< Bytes sent
+			std::atomic<uint64_t> packets_in{ 0 };    //!< Messages received
+			std::atomic<uint64_t> packets_out{ 0 };   //!< Responses sent
+			//! Framing for this connection (nullptr passes each read as it arrives)
+			std::unique_ptr<zc_protocol_handler> handler;
+			//! Received data not yet framed - only used by the listener thread
+			std::string rx;
+			~connection_t();                  //!< Closes the socket
+		};
+
+		//! A protocol served on an address and port.
+		struct service_t {
+			protocol_t protocol{ HTTP };      //!< Protocol
+			std::string address;              //!< Local address
+			int port_num{ 0 };                //!< Port number
+			void* instance{ nullptr };        //!< Passed to \p do_request
+			//! Request handler
+			int (*do_request)(void* instance, std::stringstream& request){ nullptr };
+			//! Framing - cloned for each connection
+			std::unique_ptr<zc_protocol_handler> handler;
+			bool multicast{ false };          //!< Address is a multicast group
+		};
+
+		//! A listening (stream) or receiving (UDP) socket for one service.
+		struct listener_t {
+			SOCKET server;                    //!< Listening or datagram socket
+			service_t* service{ nullptr };    //!< Service on this socket
+			//! Connections accepted on this socket (stream protocols)
+			std::map<SOCKET, std::shared_ptr<connection_t> > connections;
+			//! Guards changes to \p connections against readers outside the listener thread
+			mutable std::mutex mu_connections;
+		};
+
+		//! A listener thread and the sockets - one per service - that it polls.
+		struct shard_t {
+			std::thread* thread{ nullptr };   //!< Thread servicing the sockets
+			std::vector<listener_t*> listeners;   //!< Sockets serviced
+		};
+
+		//! Where a packet came from - and where its response goes.
+		struct endpoint_t {
+			listener_t* listener{ nullptr };              //!< Receiving listener
+			std::shared_ptr<connection_t> connection;     //!< Stream connection
+			sockaddr_storage addr{};                      //!< Peer address (UDP)
+		};
+
+		//! Received data waiting to be handled in the main thread.
+		struct packet_t {
+			std::string data;                 //!< Received bytes
+			endpoint_t from;                  //!< Sender
+			std::chrono::steady_clock::time_point received;   //!< When the data arrived
+		};
+
+		//! Live server counters - see metrics_t.
+		struct counters_t {
+			std::chrono::steady_clock::time_point since{ std::chrono::steady_clock::now() };
+			std::atomic<uint64_t> bytes_in{ 0 };
+			std::atomic<uint64_t> bytes_out{ 0 };
+			std::atomic<uint64_t> packets_in{ 0 };
+			std::atomic<uint64_t> packets_out{ 0 };
+			std::atomic<uint64_t> send_errors{ 0 };
+			std::atomic<uint64_t> accepts{ 0 };
+			std::atomic<uint64_t> active_connections{ 0 };
+			std::atomic<uint64_t> max_queue_depth{ 0 };
+			std::atomic<uint64_t> requests{ 0 };
+			std::atomic<uint64_t> latency[NUM_LATENCY_BUCKETS]{};
+		};
+
+		//! Service the sockets of \p shard until the server closes.
+		int rcv_packet(shard_t* shard);
+		//! Accept a client on \p listener - returns client status.
+		client_status accept_client(listener_t* listener);
+		//! Read what is available from \p conn on \p listener - returns false if it has closed.
+		bool rcv_stream(listener_t* listener, const std::shared_ptr<connection_t>& conn);
+		//! Split received stream data into messages with the connection's protocol handler.
+		
+		//! \param from Connection (and listener) the data arrived on.
+		//! \param data Received data.
+		//! \param length Number of bytes at \p data.
+		//! \param used Receives the number of bytes consumed.
+		//! \return false if the connection should be closed.
+		bool frame_stream(const endpoint_t& from, const char* data, size_t length, size_t& used);
+		//! Read what datagrams are available on \p listener.
+		void rcv_datagrams(listener_t* listener);
+		//! Queue a received message for the main thread.
+		void push_packet(std::string&& data, const endpoint_t& from);
+		//! Send up to three buffers to \p to as one response - returns 0 if all sent.
+		int send_buffers(const endpoint_t& to, const char* prefix, size_t len_prefix,
+			const char* header, size_t len_header, const char* body, size_t len_body);
+		//! Add the time since \p received to the request latency histogram.
+		void record_latency(std::chrono::steady_clock::time_point received);
 		//! Error handler - \p phase indicates the peocess that errored.
-		void handle_error(const char* phase);
-		//! Send request - set by call-back
-		int (*do_request)(void* instance, std::stringstream& request);
+		
+		//! \param phase Description of the failed operation.
+		//! \param close Close the server after reporting the error.
+		void handle_error(const char* phase, bool close = true);
+		//! Wait up to \p timeout_ms for socket \p s to accept more data - returns true if writable.
+		bool wait_writable(SOCKET s, int timeout_ms);
 
-		//! Open socket and create server
+		//! Open sockets and create server
 		int create_server();
-		//! Print diagnostic data
-		void dump(std::string line);
+		//! Open, bind and (for stream protocols) listen on a single socket.
+		
+		//! \param service Service to open the socket for - its multicast flag is set.
+		//! \param share Set SO_REUSEPORT so that further listeners can bind the same port.
+		//! \return The socket or INVALID_SOCKET on failure.
+		SOCKET create_socket(service_t& service, bool share);
+		//! Returns "address:port" text for \p addr.
+		static std::string address_text(const sockaddr* addr);
+		//! Print diagnostic data - \p length bytes at \p data.
+		void dump(const char* data, size_t length);
 		//! Callback from server thread to handle packet.
 		static void cb_th_packet(void* v);
-		//! Start the server thread.
-		static void thread_run(zc_socket_server* that);
-
-		//! Server socket
-		SOCKET server_;
-		//! HTTP Client
-		SOCKET client_;
-		//! Current client address
-		SOCKADDR_IN client_addr_{};
+		//! Start the server thread for \p shard.
+		static void thread_run(zc_socket_server* that, shard_t* shard);
+
+		//! Services - the first is the one given to the constructor.
+		std::vector<service_t*> services_;
+		//! Listener threads and their sockets.
+		std::vector<shard_t*> shards_;
+		//! Number of listener threads requested.
+		int num_listeners_ = 1;
+		//! Unicast services bind their own address rather than all interfaces.
+		bool bind_address_ = false;
+		//! Endpoint of the packet currently being handled
+		endpoint_t current_;
+		//! When the packet currently being handled arrived
+		std::chrono::steady_clock::time_point current_received_;
+		//! The response to the packet currently being handled has been deferred
+		bool current_deferred_ = false;
 		//! Previous client address
 		std::string prev_addr_ = "";
 		//! Previous client port number
 		int prev_port_ = 0;
 		//! Host IP address e.g. 127.0.0.1
 		std::string host_id_ = "";
-		//! port number
-		int port_num_ = 0;
-		//! Server address
-		std::string address_= "";
-		//! protocol
-		protocol_t protocol_ = HTTP;
 		//! Socket is closing
 		std::atomic<bool> closing_ = false;
-		//! Socket has closed.
-		std::atomic<bool> closed_ = true;
-		//! Separate thread to handle socket transfers.
-		std::thread* th_socket_ = nullptr;
+		//! Number of listener threads still running.
+		std::atomic<int> running_ = 0;
 		//! Packet queue
-		std::queue<std::string> q_packet_;
+		std::queue<packet_t> q_packet_;
 		//! Lock to avoid pushing into the packet queue and pulling from it at the same time.
-		std::mutex mu_packet_;
-		//! Client request handler
-		void* instance_ = nullptr;
+		mutable std::mutex mu_packet_;
+		//! Server counters
+		counters_t counters_;
+		//! Incremented when the listeners are deleted - deferred responses from before are dropped.
+		uint64_t epoch_ = 0;
+		//! Lock for epoch_ and the listeners against deferred responses.
+		std::mutex mu_reply_;
 
 	};
 
 #endif
-
@@ -19,11 +19,23 @@
 #define __URL_HANDLER__
 
 #include <string>
+#include <string_view>
 #include<ostream>
 #include<istream>
+#include <cstdint>
 #include <cstdio>
+#include <ctime>
 #include <vector>
+#include <list>
 #include <mutex>
+#include <map>
+#include <set>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <thread>
 
 #include <curl/curl.h>
 
@@ -31,7 +43,20 @@
 
 
 
-	//! This class uses the libcurl API to read and post to URLs
+	//! \brief This class uses the libcurl API to read and post to URLs
+	//!
+	//! Transfers may run at the same time on several threads. Each takes an easy
+	//! handle from a pool and the handles share their DNS, TLS session and
+	//! connection caches, so repeated requests to a host reuse a warm connection.
+	//! The asynchronous transfers run in parallel on a single transfer thread
+	//! using the curl multi interface.
+	//! Responses are requested with any compression curl can decode, and the
+	//! bodies sent by post_url are compressed with gzip for hosts that accept them.
+	//! Each host has a policy that sets its timeouts, paces the transfers to it
+	//! and retries those that fail for transient reasons.
+	//! read_url can keep the responses in a local cache.
+	//! The time taken by each phase of the transfers, their sizes and their
+	//! failures are totalled for each host.
 	class zc_url_handler
 	{
 	public:
@@ -62,11 +87,37 @@
 		//! \param nmemb Number of data blocks.
 		//! \param userp Pointer to user object. In this case it's an input stream the data is read from.
 		static size_t cb_read(char* data, size_t size, size_t nmemb, void* userp);
+		//! Validators from an earlier download of a resource for a conditional GET.
+		struct url_validator {
+			std::string etag;              //!< ETag of the copy we have
+			std::string last_modified;     //!< Last-Modified date of the copy we have
+			bool not_modified = false;     //!< Set true if the server said our copy is up to date
+		};
+
 		//! Perform an HTTP GET operation.
 		
 		//! \param url Address of web resource.
 		//! \param data Data stream to send data to.
 		bool read_url(std::string url, std::ostream* data);
+		//! Perform an HTTP GET operation into memory.
+		
+		//! \param url Address of web resource.
+		//! \param data Receives the data - reserved from Content-Length so it is not
+		//! reallocated as the data arrives.
+		//! \param validator If not nullptr the data is only fetched if it has changed
+		//! since the download that set the validator, which is then updated.
+		//! \return true if successful - including when the data was not modified.
+		bool read_url(std::string url, std::string& data, url_validator* validator = nullptr);
+		//! Perform an HTTP GET operation straight into a file.
+		
+		//! The data is written to \p filename + ".part" and renamed once complete,
+		//! so \p filename is left as it was if the download fails or is not needed.
+		//! \param url Address of web resource.
+		//! \param filename Name of the file to create.
+		//! \param validator If not nullptr the data is only fetched if it has changed
+		//! since the download that set the validator, which is then updated.
+		//! \return true if successful - including when the data was not modified.
+		bool read_url_to_file(std::string url, std::string filename, url_validator* validator = nullptr);
 		//! Perform an HTTP POST operation.
 		 
 		//! \param url Address of web resource
@@ -74,6 +125,33 @@
 		//! \param req Data stream to send to URL
 		//! \param resp Data stream to receive any response.
 		bool post_url(std::string url, std::string resource, std::istream* req, std::ostream* resp);
+		//! Perform an HTTP POST operation sending the request straight from memory.
+		
+		//! \param url Address of web resource
+		//! \param resource Identifier of resource type
+		//! \param req The request - sent without copying it.
+		//! \param resp Data stream to receive any response.
+		bool post_url(std::string url, std::string resource, std::string_view req, std::ostream* resp);
+		//! Perform an HTTP POST operation from memory with a Content-Type, reporting the outcome.
+		
+		//! \param url Address of web resource
+		//! \param resource Identifier of resource type
+		//! \param content_type Sent as the Content-Type of the request.
+		//! \param req The request - sent without copying it.
+		//! \param resp Data stream to receive any response.
+		//! \param code Receives the HTTP status of the response - 0 if there was none.
+		//! \param error Receives the reason if the transfer failed.
+		//! \return true if a response was received - whatever its status.
+		bool post_url(std::string url, std::string resource, std::string content_type, std::string_view req,
+			std::ostream* resp, long& code, std::string& error);
+		//! Perform an HTTP POST operation sending the contents of a file.
+		
+		//! The file is mapped into memory and sent from there.
+		//! \param url Address of web resource
+		//! \param resource Identifier of resource type
+		//! \param filename Name of the file to send.
+		//! \param resp Data stream to receive any response.
+		bool post_file(std::string url, std::string resource, std::string filename, std::ostream* resp);
 		//! Performa an HTTP POST FORM operation.
 		 
 		//! \param url Address of web resource.
@@ -81,6 +159,13 @@
 		//! \param req Data stream to send to URL if \p fields is nullptr.
 		//! \param resp Data stream to receive any response.
 		bool post_form(std::string url, std::vector<field_pair> fields, std::istream* req, std::ostream* resp);
+		//! Performa an HTTP POST FORM operation with the data for the fields in memory.
+		 
+		//! \param url Address of web resource.
+		//! \param fields POST FORM parameter name/value pairs.
+		//! \param req Data sent, without copying it, for any field that has no value.
+		//! \param resp Data stream to receive any response.
+		bool post_form(std::string url, const std::vector<field_pair>& fields, std::string_view req, std::ostream* resp);
 		//! Send an e-mail
 		 
 		//! \param url Address of e-Mail server
@@ -97,6 +182,119 @@
 			std::vector<std::string> to_list, std::vector<std::string> cc_list, std::vector<std::string> bcc_list,
 			std::string subject, std::string payload, std::vector<std::string> attachments, std::vector<std::string> formats);
 
+		//! Compress the requests sent by post_url to \p host with gzip.
+		
+		//! There is no negotiation of request compression so this must only be enabled
+		//! for a host known to accept it. If the host replies 415 Unsupported Media Type
+		//! compression is disabled for it: post_url then sends the request again
+		//! uncompressed, and post_url_async fails so that the caller can do so.
+		//! \param host Host name as it appears in the URL.
+		//! \param enable true to compress, false to stop.
+		void compress_requests(const std::string& host, bool enable);
+
+		//! How the transfers to a host are timed, paced and retried.
+		struct host_policy {
+			std::chrono::milliseconds connect_timeout{ 10000 };  //!< Time allowed to connect
+			std::chrono::milliseconds timeout{ 30000 };          //!< Time allowed for each attempt
+			int max_retries = 0;                                 //!< Attempts made after the first fails
+			std::chrono::milliseconds retry_delay{ 500 };        //!< Delay before the first retry - doubled for each further one
+			std::chrono::milliseconds max_retry_delay{ 30000 };  //!< Longest delay before a retry
+			int max_concurrent = 0;                              //!< Most transfers to the host at once - 0 for no limit
+			double max_rate = 0.0;                               //!< Most transfers started per second - 0 for no limit
+			int burst = 1;                                       //!< Transfers that may start together within max_rate
+		};
+		//! Set the policy for \p host.
+		
+		//! A transfer is retried if the server said it was busy (429 or 503) - the body
+		//! of that reply is only passed to the caller after the last attempt - or if the
+		//! connection failed before anything was passed to the caller. A GET
+		//! is also retried after a timeout or a lost connection. The delay is the
+		//! backoff with random jitter, or longer if the server sent Retry-After.
+		//! \param host Host name as it appears in the URL - empty to set the default
+		//! for hosts without their own.
+		//! \param p The policy.
+		void policy(const std::string& host, const host_policy& p);
+		//! Returns the policy for \p host.
+		host_policy policy(const std::string& host);
+
+		//! Keep the responses to read_url in a local cache.
+		
+		//! The responses are held in memory, dropping the least recently used, and
+		//! on disk in "url_cache" under the working directory of file_holder_. When
+		//! the files exceed \p max_disk those written longest ago are deleted, down
+		//! to three quarters of it.
+		//! A cached response is returned without asking the server while its
+		//! Cache-Control max-age (or Expires) says it is fresh. After that it is
+		//! revalidated with its ETag and Last-Modified, and returned anyway if the
+		//! server cannot be reached. Responses marked no-store are not kept, and
+		//! a read_url with its own validator bypasses the cache.
+		//! \param enable true to use the cache, false to stop and empty the memory.
+		//! \param max_memory Most bytes of responses held in memory.
+		//! \param max_disk Most bytes of responses held on disk - 0 for no limit.
+		void cache_responses(bool enable, size_t max_memory = DEFAULT_CACHE_MEMORY,
+			uint64_t max_disk = DEFAULT_CACHE_DISK);
+		//! Empty the response cache in memory and on disk.
+		void clear_cache();
+
+		//! Time taken by each phase of a transfer - or their totals over several transfers.
+		struct transfer_timing {
+			std::chrono::microseconds dns{ 0 };         //!< Resolving the host name
+			std::chrono::microseconds connect{ 0 };     //!< Making the TCP connection
+			std::chrono::microseconds tls{ 0 };         //!< The TLS handshake
+			std::chrono::microseconds first_byte{ 0 };  //!< From sending the request to the first byte of the response
+			std::chrono::microseconds total{ 0 };       //!< The whole transfer
+		};
+		//! What has been transferred to and from a host.
+		
+		//! Each attempt counts as a transfer, so a transfer that is retried counts
+		//! several times. The phases are zero when a connection is reused.
+		struct host_metrics {
+			uint64_t transfers = 0;             //!< Attempts made
+			uint64_t retries = 0;               //!< Attempts that were tried again
+			uint64_t errors = 0;                //!< Attempts that failed without a response (eg timed out)
+			uint64_t http_errors = 0;           //!< Attempts that got a response code of 400 or more
+			uint64_t bytes_sent = 0;            //!< Request bodies sent
+			uint64_t bytes_received = 0;        //!< Response bodies received
+			transfer_timing time;               //!< Total time spent in each phase
+			transfer_timing slowest;            //!< The phases of the attempt that took longest
+		};
+		//! Returns the totals for \p host.
+		host_metrics metrics(const std::string& host);
+		//! Returns the totals for each host that has had a transfer.
+		std::map<std::string, host_metrics> metrics();
+		//! Set all the totals back to zero.
+		void reset_metrics();
+
+		//! Callback when an asynchronous transfer finishes - done(ok), called on the transfer thread.
+		typedef std::function<void(bool ok)> transfer_fn;
+		//! Start an HTTP GET operation and return without waiting for it to finish.
+
+		//! \param url Address of web resource.
+		//! \param data Data stream to send data to - it must remain valid until the transfer finishes.
+		//! \param done If set, called when the transfer finishes.
+		//! \return Becomes true if the transfer was successful.
+		std::future<bool> read_url_async(std::string url, std::ostream* data, transfer_fn done = nullptr);
+		//! Start an HTTP POST operation and return without waiting for it to finish.
+
+		//! \param url Address of web resource
+		//! \param resource Identifier of resource type
+		//! \param req Data stream to send to URL - it must remain valid until the transfer finishes.
+		//! \param resp Data stream to receive any response - ditto.
+		//! \param done If set, called when the transfer finishes.
+		//! \return Becomes true if the transfer was successful.
+		std::future<bool> post_url_async(std::string url, std::string resource, std::istream* req, std::ostream* resp,
+			transfer_fn done = nullptr);
+		//! Start an HTTP POST operation sending the request straight from memory.
+
+		//! \param url Address of web resource
+		//! \param resource Identifier of resource type
+		//! \param req The request - it must remain valid until the transfer finishes.
+		//! \param resp Data stream to receive any response - ditto.
+		//! \param done If set, called when the transfer finishes.
+		//! \return Becomes true if the transfer was successful.
+		std::future<bool> post_url_async(std::string url, std::string resource, std::string_view req, std::ostream* resp,
+			transfer_fn done = nullptr);
+
 	protected:
 		//! Output the associated data to the stream for debugging purposes.
 		
@@ -115,11 +313,262 @@
 		static int cb_debug(CURL* handle, curl_infotype type, char* data, size_t size, void* userp);
 
 
-		//! Current curl session
-		CURL * curl_;
+		//! Borrow an easy handle from the pool - a new one if the pool is empty.
+		
+		//! The handle is attached to the shared DNS, TLS session and connection caches.
+		//! \return The handle or nullptr if curl could not create one.
+		CURL* acquire_handle();
+		//! Reset the handle and return it to the pool - it keeps its connections for the next transfer.
+		void release_handle(CURL* curl);
+		//! Where the response of a transfer goes
+		
+		//! A response that will not be passed on is dropped as it arrives, so that the
+		//! caller has been given nothing and the transfer can be tried again.
+		struct response_sink {
+			CURL* curl = nullptr;                       //!< The handle doing the transfer
+			std::ostream* os = nullptr;                 //!< Receives the response
+			bool drop_busy = false;                     //!< Drop a busy reply (429 or 503) - the host's policy will try again
+			bool drop_refused = false;                  //!< Drop a 415 reply - the request was compressed
+		};
+		//! Set \p response up for \p curl under the policy \p p.
+		static void prepare_response(CURL* curl, const host_policy& p, response_sink& response);
+		//! Returns true if HTTP status \p code says the server is busy and has not acted on the request.
+		static bool busy_status(long code);
+		//! Libcurl callback to write the response to a response_sink.
+		static size_t cb_write_response(char* data, size_t size, size_t nmemb, void* userp);
+		//! Set the options on \p curl to GET \p url into \p response.os - see read_url.
+		
+		//! \param response Receives the response - nullptr if the caller sets its own write callback.
+		void prepare_get(CURL* curl, const std::string& url, response_sink* response, char* error_msg);
+		//! A request sent from a stream - it need not start at the beginning of the stream
+		struct stream_reader {
+			std::istream* is = nullptr;                 //!< The request stream
+			std::streampos start = 0;                   //!< Position of the start of the request
+		};
+		//! The parts of a POST that must remain valid until it finishes
+		struct post_state {
+			stream_reader req;                          //!< The request if it is sent from a stream
+			response_sink response;                     //!< Receives the response
+			std::string body;                           //!< The compressed request - empty if not compressed
+			std::string content_type;                   //!< Content-Type of the request - none sent if empty
+			struct curl_slist* headers = nullptr;       //!< Extra request headers - freed after the transfer
+		};
+		//! Set the options on \p curl to POST \p req (or \p data if \p req is nullptr) to \p url - see post_url.
+		
+		//! \param post Set up for the POST - the response goes to post.response.os.
+		//! \return true if the request is compressed.
+		bool prepare_post(CURL* curl, const std::string& url, const std::string& resource, std::istream* req,
+			std::string_view data, char* error_msg, post_state& post);
+		//! POST \p req (or \p data if \p req is nullptr) to \p url - see post_url.
+		
+		//! If \p code is not nullptr the HTTP status goes there, and the reason for a
+		//! failure goes into \p error rather than to the console.
+		bool do_post(const std::string& url, const std::string& resource, std::istream* req, std::string_view data,
+			std::ostream* resp, const std::string& content_type = "", long* code = nullptr, std::string* error = nullptr);
+		//! POST FORM the \p fields with \p req (or \p data if \p req is nullptr) - see post_form.
+		bool do_post_form(const std::string& url, const std::vector<field_pair>& fields, std::istream* req,
+			std::string_view data, std::ostream* resp);
+		//! Libcurl callback to read the request from a stream_reader.
+		static size_t cb_read_stream(char* data, size_t size, size_t nmemb, void* userp);
+		//! Libcurl callback to move the position of a stream_reader - relative to the start of the request.
+		static int cb_seek_stream(void* userp, curl_off_t offset, int origin);
+		//! Libcurl callback to read a form field from a view_reader.
+		static size_t cb_read_view(char* data, size_t size, size_t nmemb, void* userp);
+		//! Libcurl callback to move the position of a view_reader.
+		static int cb_seek_view(void* userp, curl_off_t offset, int origin);
+		//! Position in a form field sent from memory
+		struct view_reader {
+			std::string_view data;                      //!< The field data
+			size_t position = 0;                        //!< Amount already sent
+		};
+		//! Returns the host part of \p url.
+		static std::string url_host(const std::string& url);
+		//! Returns true if requests to the host of \p url are compressed.
+		bool compress_host(const std::string& url);
+
+		//! A download into memory or a file
+		struct download {
+			CURL* curl;                         //!< The handle doing the download
+			std::string* buffer;                //!< Receives the data for a download into memory
+			FILE* file;                         //!< Receives the data for a download into a file
+			bool sized;                         //!< The buffer has been reserved
+			std::string etag;                   //!< ETag header of the response
+			std::string last_modified;          //!< Last-Modified header of the response
+			std::string cache_control;          //!< Cache-Control header(s) of the response
+			std::string expires;                //!< Expires header of the response
+			long code = 0;                      //!< Response code - 0 if the server was not reached
+		};
+		//! Libcurl callback to write data received from curl into the buffer of a download.
+		static size_t cb_write_buffer(char* data, size_t size, size_t nmemb, void* userp);
+		//! Libcurl callback to write data received from curl into the file of a download.
+		static size_t cb_write_file(char* data, size_t size, size_t nmemb, void* userp);
+		//! Libcurl callback for each response header of a download - keeps the validators.
+		static size_t cb_header(char* data, size_t size, size_t nmemb, void* userp);
+		//! GET \p url into \p dl, conditional on \p validator if not nullptr.
+		bool read_download(const std::string& url, download& dl, url_validator* validator);
+
+		//! A response in the cache
+		struct cache_entry {
+			std::string url;                    //!< Address of the resource
+			std::string data;                   //!< The response
+			url_validator validator;            //!< ETag and Last-Modified to revalidate it
+			time_t expires = 0;                 //!< Fresh until this time
+		};
+		//! Append the response to \p url to \p data - from the cache if it is fresh or unchanged.
+		bool read_cached(const std::string& url, std::string& data);
+		//! Returns the entry for \p url from memory or disk, now the most recently used - nullptr if none.
+		
+		//! Must be called with cache_lock_ held.
+		cache_entry* cache_find(const std::string& url);
+		//! Keep \p entry in memory and on disk. Must be called with cache_lock_ held.
+		void cache_store(cache_entry&& entry);
+		//! Write \p entry to disk. Must be called with cache_lock_ held.
+		void cache_write(const cache_entry& entry);
+		//! Drop the least recently used entries from memory until within cache_max_memory_, keeping at least \p keep.
+		
+		//! Must be called with cache_lock_ held.
+		void cache_trim(size_t keep);
+		//! Delete the files written longest ago until the rest take no more than \p target bytes.
+		
+		//! Also sets cache_disk_ from the files found. Must be called with cache_lock_ held.
+		void cache_trim_disk(uint64_t target);
+		//! Remove the entry for \p url from memory and disk. Must be called with cache_lock_ held.
+		void cache_remove(const std::string& url);
+		//! Returns the name of the file on disk for \p url - empty if there is no cache directory.
+		std::string cache_filename(const std::string& url) const;
+		//! Returns the time the response in \p dl stays fresh, received at \p now - -1 if it must not be kept.
+		static time_t cache_expiry(const download& dl, time_t now);
+
+		//! The transfers to one host
+		struct host_state {
+			bool has_policy = false;            //!< The host has its own policy
+			host_policy policy;                 //!< The host's own policy
+			int active = 0;                     //!< Transfers in progress
+			double tokens = 0.0;                //!< Transfers that may start now under max_rate
+			std::chrono::steady_clock::time_point refilled;  //!< When tokens was brought up to date - zero before the first transfer
+			host_metrics metrics;               //!< What has been transferred
+		};
+		//! Start a transfer to \p host if its policy allows it now.
+		
+		//! \param when Receives the time to try again if not - time_point::max()
+		//! if it must wait for another transfer to finish.
+		bool try_admit(const std::string& host, std::chrono::steady_clock::time_point& when);
+		//! As try_admit but the caller holds hosts_lock_.
+		bool try_admit_locked(const std::string& host, std::chrono::steady_clock::time_point& when);
+		//! Wait until the policy of \p host allows a transfer to start.
+		void admit(const std::string& host);
+		//! A transfer to \p host has finished.
+		void leave(const std::string& host);
+		//! Add the attempt made by \p curl to the totals for \p host.
 		
-		//! Lock to ensure only 1 CURL operation at once
-		static std::recursive_mutex lock_;
+		//! \param result The result of the attempt.
+		//! \param retrying The transfer will be tried again.
+		void record(const std::string& host, CURL* curl, CURLcode result, bool retrying);
+		//! Returns the delay before retrying the transfer, or a negative one if it should not be retried.
+		
+		//! \param p The policy of the host.
+		//! \param attempt The number of attempts so far less one.
+		//! \param curl The handle that did the transfer.
+		//! \param result The result of the attempt.
+		//! \param idempotent The request may safely be repeated after it has been sent (eg GET).
+		static std::chrono::milliseconds retry_delay(const host_policy& p, int attempt, CURL* curl, CURLcode result,
+			bool idempotent);
+		//! Run the transfer on \p curl to \p url under its host's policy - admitting and retrying it.
+		
+		//! \param req The request stream to rewind to its start before a retry - nullptr if none.
+		//! \param idempotent The request may safely be repeated after it has been sent (eg GET).
+		//! \param response Where the response goes - nullptr if the caller sets its own write callback.
+		CURLcode perform(CURL* curl, const std::string& url, stream_reader* req, bool idempotent, response_sink* response);
+
+		//! An asynchronous transfer
+		struct transfer {
+			CURL* curl;                         //!< The handle from the pool
+			std::string host;                   //!< The host it goes to
+			host_policy policy;                 //!< The policy of the host
+			bool idempotent;                    //!< Can be repeated after it has been sent
+			int attempt = 0;                    //!< Number of attempts so far less one
+			std::chrono::steady_clock::time_point not_before;  //!< Not to be started before this
+			char error_msg[CURL_ERROR_SIZE];    //!< Receives the error message from curl
+			transfer_fn done;                   //!< Called when the transfer finishes
+			post_state post;                    //!< Request of a POST and the response
+			std::promise<bool> result;          //!< Set when the transfer finishes
+		};
+		//! Queue the transfer to \p url for the transfer thread, starting the thread if necessary.
+		
+		//! \param idempotent The request may safely be repeated after it has been sent (eg GET).
+		std::future<bool> start_transfer(transfer* t, const std::string& url, bool idempotent);
+		//! Release the handle of a finished transfer and report its result.
+		void finish_transfer(transfer* t, CURLcode result);
+		//! Transfer thread - drives all the asynchronous transfers with the multi handle.
+		void multi_thread();
+
+		//! Callback from libcurl to lock the shared data \p data.
+		static void cb_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userp);
+		//! Callback from libcurl to unlock the shared data \p data.
+		static void cb_unlock(CURL* handle, curl_lock_data data, void* userp);
+
+		//! Maximum number of idle handles kept in the pool.
+		static const size_t MAX_POOLED_HANDLES = 8;
+		//! Most idle connections kept in the shared cache - libcurl's default of 5 closes
+		//! connections that are still wanted once more transfers than that run at once.
+		static const long MAX_CACHED_CONNECTIONS = 64;
+		//! Smallest request worth compressing.
+		static const long MIN_COMPRESS_SIZE = 1024;
+		//! Size of the file buffer used by read_url_to_file.
+		static const size_t DOWNLOAD_BUFFER_SIZE = 1 << 20;
+		//! Default for the most bytes of responses held in memory by the cache.
+		static const size_t DEFAULT_CACHE_MEMORY = 4 << 20;
+		//! Default for the most bytes of responses held on disk by the cache.
+		static const uint64_t DEFAULT_CACHE_DISK = 64 << 20;
+
+		//! DNS, TLS session and connection caches shared by all the handles.
+		CURLSH* share_;
+		//! One lock per type of shared data, so transfers only contend when they touch the same cache.
+		std::mutex share_locks_[CURL_LOCK_DATA_LAST];
+		//! Idle easy handles.
+		std::vector<CURL*> pool_;
+		//! Lock on pool_.
+		std::mutex pool_lock_;
+		//! Hosts whose requests are compressed.
+		std::set<std::string> compress_hosts_;
+		//! Lock on compress_hosts_.
+		std::mutex compress_lock_;
+		//! The policy for hosts without their own.
+		host_policy default_policy_;
+		//! Hosts that have a policy or have had a transfer.
+		std::map<std::string, host_state> hosts_;
+		//! Lock on default_policy_ and hosts_ (including their metrics).
+		std::mutex hosts_lock_;
+		//! Signalled when a transfer leaves a host.
+		std::condition_variable hosts_cv_;
+		//! Runs the asynchronous transfers.
+		CURLM* multi_;
+		//! The transfer thread.
+		std::thread multi_thread_;
+		//! Lock on multi_pending_ and multi_closing_.
+		std::mutex multi_lock_;
+		//! Transfers waiting to be added to multi_.
+		std::vector<transfer*> multi_pending_;
+		//! Set to stop the transfer thread.
+		bool multi_closing_;
+		//! read_url uses the cache.
+		std::atomic<bool> cache_enabled_;
+		//! Most bytes of responses held in memory.
+		size_t cache_max_memory_;
+		//! Bytes of responses held in memory.
+		size_t cache_memory_;
+		//! Most bytes of responses held on disk - 0 for no limit.
+		uint64_t cache_max_disk_;
+		//! Bytes of responses held on disk.
+		uint64_t cache_disk_;
+		//! Responses in memory, most recently used first.
+		std::list<cache_entry> cache_lru_;
+		//! Position in cache_lru_ of each URL.
+		std::map<std::string, std::list<cache_entry>::iterator> cache_index_;
+		//! Where the responses are kept on disk - empty if only in memory.
+		std::string cache_directory_;
+		//! Lock on the cache.
+		std::mutex cache_lock_;
 	};
 
 
@@ -140,6 +140,20 @@ namespace zc {
 	unsigned char encode_base_64(unsigned char c);
 	//! Returns base64 encoding of string \p s.
 	std::string encode_base_64(const std::string& s);
+	//! Returns the length of the base64 encoding of \p length bytes, including padding.
+	size_t base_64_encoded_length(size_t length);
+	//! Returns the most bytes that \p length base64 characters can decode to.
+	size_t base_64_decoded_length(size_t length);
+	//! Append the base64 encoding of \p length bytes at \p data to \p out.
+	void encode_base_64(const char* data, size_t length, std::string& out);
+	//! Append the bytes decoded from \p length base64 characters at \p text to \p out.
+	
+	//! Whitespace, such as the line breaks in MIME encoding, is skipped and
+	//! decoding stops at the first padding character.
+	//! \return false if \p text contains any other character that is not base64.
+	bool decode_base_64(const char* text, size_t length, std::string& out);
+	//! Returns the 20-byte SHA-1 digest of \p data (e.g. for the WebSocket handshake).
+	std::string sha1(const std::string& data);
 	//! Returns \p data as hex encoded string.
 	std::string to_hex(const std::string& data);
 	//! Returns hex-encoded string \p data as string of 8-bit characters.
@@ -99,6 +99,9 @@ is derived from zc_graph_cartesian.
 This class provides a polar line graph and is derived from zc_graph_.
   - zc_graph_smith
 This class provides a Smith chart and is derived from zc_graph_.
+- zc_http_parser
+This class parses an HTTP header in place, returning views of the start line,
+header fields and body without copying them.
 - zc_icons.h
 This provides a set of icons that can be used in applications. The icons
 are resizeable and can have their fill colour changed.
@@ -110,24 +113,38 @@ groups according to the first letter (or more) of the option.
 This class and associated dialog zc_line_style_dialog allow an application to provide
 its user to select the drawing style, colour and thickness of lines. Drawing styles are 
 defined by FLTK such as FL_SOLID.
+- zc_protocol_handler
+This class and its implementations (HTTP, line, length-prefixed and WebSocket) split
+the byte stream on a zc_socket_server connection into messages and frame the responses.
 - zc_range.h
 This provides a set of methods to control a std::pair<double, double> representing the
 minimum and maximum values of a range. Methods include: union, intersection, etc.
+- zc_rpc_codec
+This class encodes and decodes XML-RPC messages directly to and from zc_rpc_data_item
+in a single pass, without building an XML document tree.
+- zc_rpc_data_item
+This class holds an XML-RPC value. The companion zc_rpc_arena allocates a whole tree of
+items from one memory pool and frees it in one go.
 - zc_rpc_handler
 This class provides a protocol handler for an XML-RPC inter-application interface.
 It converts between the XML passed over the interface and methods using the 
-data structure zc_rpc_data_item.
+data structure zc_rpc_data_item. As a client it keeps its connections to the server
+open and can make requests asynchronously.
+- zc_rpc_json_codec
+This class encodes and decodes JSON-RPC 2.0 messages, the compact alternative to XML-RPC
+that zc_rpc_handler selects by Content-Type.
 - zc_running_average
 This class provides a simple FIFO/Implementer to provide a running arithmetic mean
 over a fixed number of values.
 - zc_serial
 Thos class provides a lightweight wrapper around the boost::asio::serial_port library
-to provide simple read/write access to a serial port.
+to provide simple blocking or asynchronous read/write access to a serial port.
 - zc_settings
 This class provides a JSON based settings file.
 - zc_socket_server
 This class provides an OS-independent wrapper for handling data transfers over
-inter-application sockets.
+inter-application sockets. Several services (protocol, address and port) can share 
+the same listener threads.
 - zc_status
 This class encapsulates banner and is the main user interface for it.
 - zc_symbols.h
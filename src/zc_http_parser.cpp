@@ -0,0 +1,139 @@
+/*
+	Copyright 2026, Philip Rose, GM3ZZA
+
+	This file is part of ZZACOMMON.
+
+	ZZACOMMON is free software: you can redistribute it and/or modify it under the
+	terms of the Lesser GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later version.
+
+	ZZACOMMON is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+	without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+	PURPOSE. See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along with ZZACOMMON.
+	If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#include "zc_http_parser.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Returns the view without leading and trailing spaces and tabs
+static std::string_view trim(std::string_view text) {
+	size_t start = 0;
+	while (start < text.length() && (text[start] == ' ' || text[start] == '\t')) start++;
+	size_t stop = text.length();
+	while (stop > start && (text[stop - 1] == ' ' || text[stop - 1] == '\t')) stop--;
+	return text.substr(start, stop - start);
+}
+
+// Returns the ASCII lower case of the character
+static char lower(char c) {
+	return (c >= 'A' && c <= 'Z') ? (char)(c + ('a' - 'A')) : c;
+}
+
+// Case-insensitive comparison
+bool zc_http_parser::equal_nocase(std::string_view a, std::string_view b) {
+	if (a.length() != b.length()) return false;
+	for (size_t ix = 0; ix < a.length(); ix++) {
+		if (lower(a[ix]) != lower(b[ix])) return false;
+	}
+	return true;
+}
+
+// Parse the start line and header fields - a line ends in LF, with or without CR
+zc_http_parser::result_t zc_http_parser::parse(const char* data, size_t length) {
+	data_ = data;
+	length_ = length;
+	header_length_ = 0;
+	content_length_ = 0;
+	chunked_ = false;
+	num_fields_ = 0;
+	method_ = target_ = version_ = std::string_view();
+	const char* end = data + length;
+	const char* p = data;
+	bool start_line = true;
+	bool have_length = false;
+	while (true) {
+		const char* eol = (const char*)memchr(p, '\n', end - p);
+		if (eol == nullptr) return HTTP_INCOMPLETE;
+		std::string_view line(p, eol - p);
+		if (line.length() && line.back() == '\r') line.remove_suffix(1);
+		p = eol + 1;
+		if (start_line) {
+			// METHOD SP TARGET SP VERSION
+			size_t sp1 = line.find(' ');
+			size_t sp2 = sp1 == std::string_view::npos ? sp1 : line.find(' ', sp1 + 1);
+			if (sp2 == std::string_view::npos) return HTTP_ERROR;
+			method_ = line.substr(0, sp1);
+			target_ = line.substr(sp1 + 1, sp2 - sp1 - 1);
+			version_ = line.substr(sp2 + 1);
+			start_line = false;
+			continue;
+		}
+		if (line.empty()) break;
+		size_t colon = line.find(':');
+		if (colon == std::string_view::npos || colon == 0) return HTTP_ERROR;
+		if (num_fields_ == MAX_FIELDS) return HTTP_ERROR;
+		field_t& f = fields_[num_fields_++];
+		f.name = line.substr(0, colon);
+		f.value = trim(line.substr(colon + 1));
+		if (equal_nocase(f.name, "Content-Length")) {
+			if (f.value.empty()) return HTTP_ERROR;
+			size_t value = 0;
+			for (char c : f.value) {
+				if (c < '0' || c > '9' || value > (SIZE_MAX - 9) / 10) return HTTP_ERROR;
+				value = value * 10 + (c - '0');
+			}
+			// The same length may be repeated but two different lengths are ambiguous
+			if (have_length && value != content_length_) return HTTP_ERROR;
+			content_length_ = value;
+			have_length = true;
+		}
+		else if (equal_nocase(f.name, "Transfer-Encoding")) {
+			chunked_ = true;
+		}
+	}
+	header_length_ = p - data;
+	return HTTP_OK;
+}
+
+// Find the field
+std::string_view zc_http_parser::field(std::string_view name) const {
+	for (size_t ix = 0; ix < num_fields_; ix++) {
+		if (equal_nocase(fields_[ix].name, name)) return fields_[ix].value;
+	}
+	return std::string_view();
+}
+
+// Is the field present
+bool zc_http_parser::has_field(std::string_view name) const {
+	for (size_t ix = 0; ix < num_fields_; ix++) {
+		if (equal_nocase(fields_[ix].name, name)) return true;
+	}
+	return false;
+}
+
+// Is the token in the list of any field of that name
+bool zc_http_parser::field_has_token(std::string_view name, std::string_view token) const {
+	for (size_t ix = 0; ix < num_fields_; ix++) {
+		if (!equal_nocase(fields_[ix].name, name)) continue;
+		std::string_view list = fields_[ix].value;
+		while (list.length()) {
+			size_t comma = list.find(',');
+			if (equal_nocase(trim(list.substr(0, comma)), token)) return true;
+			if (comma == std::string_view::npos) break;
+			list.remove_prefix(comma + 1);
+		}
+	}
+	return false;
+}
+
+// The body - what has arrived of it
+std::string_view zc_http_parser::body() const {
+	if (header_length_ == 0) return std::string_view();
+	size_t available = length_ - header_length_;
+	return std::string_view(data_ + header_length_, content_length_ < available ? content_length_ : available);
+}
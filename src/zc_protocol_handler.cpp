@@ -0,0 +1,252 @@
+/*
+	Copyright 2026, Philip Rose, GM3ZZA
+
+	This file is part of ZZACOMMON.
+
+	ZZACOMMON is free software: you can redistribute it and/or modify it under the
+	terms of the Lesser GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later version.
+
+	ZZACOMMON is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+	without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+	PURPOSE. See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along with ZZACOMMON.
+	If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#include "zc_protocol_handler.h"
+
+#include "zc_http_parser.h"
+#include "zc_utils.h"
+
+#include <cstdint>
+#include <cstring>
+
+// Longest HTTP header or text line accepted before the peer is dropped
+const size_t MAX_HEADER = 65536;
+// Largest message body accepted
+const size_t MAX_MESSAGE = 16 * 1024 * 1024;
+// Appended to the client's key in the WebSocket handshake (RFC 6455 1.3)
+const char* WEBSOCKET_GUID = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+// HTTP - wait for the header and Content-Length bytes of body
+zc_protocol_handler::frame_t zc_http_protocol::frame(const char* data, size_t length, size_t& used, std::string& message, std::string& reply)
+{
+	used = 0;
+	zc_http_parser parser;
+	switch (parser.parse(data, length))
+	{
+	case zc_http_parser::HTTP_INCOMPLETE:
+		return length > MAX_HEADER ? FRAME_ERROR : FRAME_INCOMPLETE;
+	case zc_http_parser::HTTP_ERROR:
+		reply = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		return FRAME_ERROR;
+	default:
+		break;
+	}
+	if (parser.chunked())
+	{
+		// Chunked bodies are not supported - ask for a Content-Length
+		reply = "HTTP/1.1 411 Length Required\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		return FRAME_ERROR;
+	}
+	if (parser.content_length() > MAX_MESSAGE)
+	{
+		reply = "HTTP/1.1 413 Payload Too Large\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		return FRAME_ERROR;
+	}
+	if (!parser.complete()) return FRAME_INCOMPLETE;
+	used = parser.header_length() + parser.content_length();
+	message.assign(data, used);
+	return FRAME_MESSAGE;
+}
+
+// Line - wait for LF and drop it and any CR before it
+zc_protocol_handler::frame_t zc_line_protocol::frame(const char* data, size_t length, size_t& used, std::string& message, std::string& /*reply*/)
+{
+	used = 0;
+	const char* eol = (const char*)memchr(data, '\n', length);
+	if (eol == nullptr)
+	{
+		return length > MAX_HEADER ? FRAME_ERROR : FRAME_INCOMPLETE;
+	}
+	used = eol - data + 1;
+	size_t len_line = used - 1;
+	if (len_line && data[len_line - 1] == '\r') len_line--;
+	message.assign(data, len_line);
+	return FRAME_MESSAGE;
+}
+
+// Length-prefixed - 32-bit big-endian length then that many bytes
+zc_protocol_handler::frame_t zc_length_protocol::frame(const char* data, size_t length, size_t& used, std::string& message, std::string& /*reply*/)
+{
+	used = 0;
+	if (length < 4) return FRAME_INCOMPLETE;
+	const unsigned char* p = (const unsigned char*)data;
+	size_t len_message = ((size_t)p[0] << 24) | ((size_t)p[1] << 16) | ((size_t)p[2] << 8) | p[3];
+	if (len_message > MAX_MESSAGE) return FRAME_ERROR;
+	if (length < 4 + len_message) return FRAME_INCOMPLETE;
+	used = 4 + len_message;
+	message.assign(data + 4, len_message);
+	return FRAME_MESSAGE;
+}
+
+// Length-prefixed - the response has the same prefix
+void zc_length_protocol::encode(size_t length, std::string& header)
+{
+	header.resize(4);
+	header[0] = (char)((length >> 24) & 0xFF);
+	header[1] = (char)((length >> 16) & 0xFF);
+	header[2] = (char)((length >> 8) & 0xFF);
+	header[3] = (char)(length & 0xFF);
+}
+
+// WebSocket - handshake first then frames
+zc_protocol_handler::frame_t zc_websocket_protocol::frame(const char* data, size_t length, size_t& used, std::string& message, std::string& reply)
+{
+	used = 0;
+	if (!upgraded_) return handshake(data, length, used, reply);
+	// Fixed header and extended payload length
+	if (length < 2) return FRAME_INCOMPLETE;
+	const unsigned char* p = (const unsigned char*)data;
+	bool fin = p[0] & 0x80;
+	unsigned char opcode = p[0] & 0x0F;
+	bool masked = p[1] & 0x80;
+	uint64_t len_payload = p[1] & 0x7F;
+	size_t pos = 2;
+	if (len_payload == 126)
+	{
+		if (length < 4) return FRAME_INCOMPLETE;
+		len_payload = ((uint64_t)p[2] << 8) | p[3];
+		pos = 4;
+	}
+	else if (len_payload == 127)
+	{
+		if (length < 10) return FRAME_INCOMPLETE;
+		len_payload = 0;
+		for (int ix = 2; ix < 10; ix++) len_payload = (len_payload << 8) | p[ix];
+		pos = 10;
+	}
+	// Clients must mask their frames (RFC 6455 5.1)
+	if (!masked || len_payload > MAX_MESSAGE) return FRAME_ERROR;
+	// Control frames are short and never fragmented
+	if ((opcode & 0x08) && (!fin || len_payload > 125)) return FRAME_ERROR;
+	if (length < pos + 4 + len_payload) return FRAME_INCOMPLETE;
+	const unsigned char* mask = p + pos;
+	pos += 4;
+	std::string payload((size_t)len_payload, '\0');
+	for (size_t ix = 0; ix < payload.length(); ix++)
+	{
+		payload[ix] = (char)(p[pos + ix] ^ mask[ix % 4]);
+	}
+	used = pos + (size_t)len_payload;
+
+	switch (opcode)
+	{
+	case 0x0:
+		// Continuation
+		if (fragment_opcode_ == 0 || fragments_.length() + payload.length() > MAX_MESSAGE) return FRAME_ERROR;
+		fragments_ += payload;
+		if (!fin) return FRAME_CONTROL;
+		binary_ = fragment_opcode_ == 0x2;
+		message = std::move(fragments_);
+		fragments_.clear();
+		fragment_opcode_ = 0;
+		return FRAME_MESSAGE;
+	case 0x1:
+	case 0x2:
+		// Text or binary
+		if (fragment_opcode_ != 0) return FRAME_ERROR;
+		if (!fin)
+		{
+			fragment_opcode_ = opcode;
+			fragments_ = std::move(payload);
+			return FRAME_CONTROL;
+		}
+		binary_ = opcode == 0x2;
+		message = std::move(payload);
+		return FRAME_MESSAGE;
+	case 0x8:
+		// Close - echo the status code back
+		if (payload.length() > 2) payload.resize(2);
+		frame_header(0x8, payload.length(), reply);
+		reply += payload;
+		return FRAME_CLOSE;
+	case 0x9:
+		// Ping - answer with pong carrying the same data
+		frame_header(0xA, payload.length(), reply);
+		reply += payload;
+		return FRAME_CONTROL;
+	case 0xA:
+		// Unsolicited pong
+		return FRAME_CONTROL;
+	default:
+		return FRAME_ERROR;
+	}
+}
+
+// WebSocket - answer the HTTP upgrade request
+zc_protocol_handler::frame_t zc_websocket_protocol::handshake(const char* data, size_t length, size_t& used, std::string& reply)
+{
+	zc_http_parser parser;
+	zc_http_parser::result_t result = parser.parse(data, length);
+	if (result == zc_http_parser::HTTP_INCOMPLETE)
+	{
+		return length > MAX_HEADER ? FRAME_ERROR : FRAME_INCOMPLETE;
+	}
+	// An opening handshake must be a GET asking to upgrade to the WebSocket protocol (RFC 6455 4.2.1)
+	std::string_view key = parser.field("Sec-WebSocket-Key");
+	if (result == zc_http_parser::HTTP_ERROR || key.empty() || parser.method() != "GET" ||
+		!parser.field_has_token("Upgrade", "websocket") || !parser.field_has_token("Connection", "Upgrade"))
+	{
+		reply = "HTTP/1.1 400 Bad Request\r\nContent-Length: 0\r\nConnection: close\r\n\r\n";
+		return FRAME_ERROR;
+	}
+	if (parser.field("Sec-WebSocket-Version") != "13")
+	{
+		// Tell the client the version that is understood (RFC 6455 4.4)
+		reply = "HTTP/1.1 426 Upgrade Required\r\nSec-WebSocket-Version: 13\r\nContent-Length: 0\r\n"
+			"Connection: close\r\n\r\n";
+		return FRAME_ERROR;
+	}
+	used = parser.header_length();
+	std::string accept = zc::encode_base_64(zc::sha1(std::string(key) + WEBSOCKET_GUID));
+	reply = "HTTP/1.1 101 Switching Protocols\r\n"
+		"Upgrade: websocket\r\n"
+		"Connection: Upgrade\r\n"
+		"Sec-WebSocket-Accept: " + accept + "\r\n\r\n";
+	upgraded_ = true;
+	return FRAME_CONTROL;
+}
+
+// WebSocket - responses go in a single unmasked frame
+void zc_websocket_protocol::encode(size_t length, std::string& header)
+{
+	frame_header(binary_ ? 0x2 : 0x1, length, header);
+}
+
+// WebSocket - FIN bit, opcode and the shortest length encoding
+void zc_websocket_protocol::frame_header(unsigned char opcode, size_t length, std::string& header)
+{
+	header.clear();
+	header += (char)(0x80 | opcode);
+	if (length < 126)
+	{
+		header += (char)length;
+	}
+	else if (length < 65536)
+	{
+		header += (char)126;
+		header += (char)((length >> 8) & 0xFF);
+		header += (char)(length & 0xFF);
+	}
+	else
+	{
+		header += (char)127;
+		for (int shift = 56; shift >= 0; shift -= 8)
+		{
+			header += (char)(((uint64_t)length >> shift) & 0xFF);
+		}
+	}
+}
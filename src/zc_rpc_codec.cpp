@@ -0,0 +1,544 @@
+/*
+	Copyright 2026, Philip Rose, GM3ZZA
+
+	This file is part of ZZACOMMON.
+
+	ZZACOMMON is free software: you can redistribute it and/or modify it under the
+	terms of the Lesser GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later version.
+
+	ZZACOMMON is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+	without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+	PURPOSE. See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along with ZZACOMMON.
+	If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#include "zc_rpc_codec.h"
+
+#include "zc_utils.h"
+
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+// Returns true if the character is XML whitespace
+static bool is_space(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+// Returns true if the text is all whitespace
+static bool all_space(std::string_view text)
+{
+	for (char c : text) {
+		if (!is_space(c)) return false;
+	}
+	return true;
+}
+
+// Append the code point as UTF-8
+static void append_utf8(uint32_t cp, std::string& out)
+{
+	if (cp < 0x80) {
+		out += (char)cp;
+	}
+	else if (cp < 0x800) {
+		out += (char)(0xC0 | (cp >> 6));
+		out += (char)(0x80 | (cp & 0x3F));
+	}
+	else if (cp < 0x10000) {
+		out += (char)(0xE0 | (cp >> 12));
+		out += (char)(0x80 | ((cp >> 6) & 0x3F));
+		out += (char)(0x80 | (cp & 0x3F));
+	}
+	else {
+		out += (char)(0xF0 | (cp >> 18));
+		out += (char)(0x80 | ((cp >> 12) & 0x3F));
+		out += (char)(0x80 | ((cp >> 6) & 0x3F));
+		out += (char)(0x80 | (cp & 0x3F));
+	}
+}
+
+// Append the character data, replacing entity references - returns false if a character reference is malformed
+static bool unescape(const char* start, const char* end, std::string& out)
+{
+	const char* p = start;
+	while (p < end) {
+		const char* amp = (const char*)memchr(p, '&', end - p);
+		if (amp == nullptr) {
+			out.append(p, end - p);
+			return true;
+		}
+		out.append(p, amp - p);
+		const char* semi = (const char*)memchr(amp, ';', end - amp);
+		if (semi == nullptr) {
+			// Not a reference - keep it as it is
+			out.append(amp, end - amp);
+			return true;
+		}
+		std::string_view ref(amp + 1, semi - amp - 1);
+		if (ref == "lt") out += '<';
+		else if (ref == "gt") out += '>';
+		else if (ref == "amp") out += '&';
+		else if (ref == "quot") out += '"';
+		else if (ref == "apos") out += '\'';
+		else if (ref.length() && ref[0] == '#') {
+			// &#nnn; or &#xhhh; - the digits must fill the reference and name a character
+			int base = 10;
+			ref.remove_prefix(1);
+			if (ref.length() && (ref[0] == 'x' || ref[0] == 'X')) {
+				base = 16;
+				ref.remove_prefix(1);
+			}
+			uint32_t cp = 0;
+			std::from_chars_result result = std::from_chars(ref.data(), ref.data() + ref.length(), cp, base);
+			if (ref.empty() || result.ec != std::errc() || result.ptr != ref.data() + ref.length() ||
+				cp == 0 || cp > 0x10FFFF || (cp >= 0xD800 && cp <= 0xDFFF)) {
+				return false;
+			}
+			append_utf8(cp, out);
+		}
+		else {
+			// Unknown entity - keep it as it is
+			out.append(amp, semi - amp + 1);
+		}
+		p = semi + 1;
+	}
+	return true;
+}
+
+// Escape markup characters
+void zc_rpc_codec::write_text(const char* text, size_t length, std::string& xml)
+{
+	const char* start = text;
+	const char* end = text + length;
+	for (const char* p = text; p < end; p++) {
+		const char* entity;
+		switch (*p) {
+		case '<':
+			entity = "&lt;";
+			break;
+		case '>':
+			entity = "&gt;";
+			break;
+		case '&':
+			entity = "&amp;";
+			break;
+		default:
+			continue;
+		}
+		xml.append(start, p - start);
+		xml += entity;
+		start = p + 1;
+	}
+	xml.append(start, end - start);
+}
+
+// <value>...</value>
+void zc_rpc_codec::write_value(zc_rpc_data_item& item, std::string& xml)
+{
+	xml += "<value>";
+	switch (item.type()) {
+	case XRT_BOOLEAN:
+		xml += item.get_int() ? "<boolean>1</boolean>" : "<boolean>0</boolean>";
+		break;
+	case XRT_INT:
+		xml += "<int>";
+		xml += std::to_string(item.get_int());
+		xml += "</int>";
+		break;
+	case XRT_DOUBLE: {
+		char number[32];
+		snprintf(number, sizeof(number), "%.17g", item.get_double());
+		xml += "<double>";
+		xml += number;
+		xml += "</double>";
+		break;
+	}
+	case XRT_STRING:
+	case XRT_DEFAULT: {
+		const std::string& s = item.get_string();
+		xml += "<string>";
+		write_text(s.data(), s.length(), xml);
+		xml += "</string>";
+		break;
+	}
+	case XRT_DATETIME: {
+		const std::string& s = item.get_string();
+		xml += "<dateTime.iso8601>";
+		write_text(s.data(), s.length(), xml);
+		xml += "</dateTime.iso8601>";
+		break;
+	}
+	case XRT_BYTES: {
+		// Base64 has no characters to escape - encode straight into the message
+		const std::string& s = item.get_string();
+		xml += "<base64>";
+		zc::encode_base_64(s.data(), s.length(), xml);
+		xml += "</base64>";
+		break;
+	}
+	case XRT_ARRAY:
+		xml += "<array><data>";
+		for (auto datum : *item.get_array()) {
+			write_value(*datum, xml);
+		}
+		xml += "</data></array>";
+		break;
+	case XRT_STRUCT:
+		xml += "<struct>";
+		for (auto& member : *item.get_struct()) {
+			xml += "<member><name>";
+			write_text(member.first.data(), member.first.length(), xml);
+			xml += "</name>";
+			write_value(*member.second, xml);
+			xml += "</member>";
+		}
+		xml += "</struct>";
+		break;
+	default:
+		break;
+	}
+	xml += "</value>";
+}
+
+// <methodCall>
+void zc_rpc_codec::write_request(const std::string& method_name, zc_rpc_data_item::rpc_list* params, std::string& xml)
+{
+	xml += "<?xml version=\"1.0\"?>\n<methodCall><methodName>";
+	write_text(method_name.data(), method_name.length(), xml);
+	xml += "</methodName><params>";
+	if (params) {
+		for (auto param : *params) {
+			xml += "<param>";
+			write_value(*param, xml);
+			xml += "</param>";
+		}
+	}
+	xml += "</params></methodCall>\n";
+}
+
+// <methodResponse>
+void zc_rpc_codec::write_response(bool fault, zc_rpc_data_item* response, std::string& xml)
+{
+	xml += "<?xml version=\"1.0\"?>\n<methodResponse>";
+	if (fault) {
+		xml += "<fault>";
+		write_value(*response, xml);
+		xml += "</fault>";
+	}
+	else {
+		xml += "<params><param>";
+		write_value(*response, xml);
+		xml += "</param></params>";
+	}
+	xml += "</methodResponse>\n";
+}
+
+// <methodResponse> with the value already encoded
+void zc_rpc_codec::write_encoded_response(std::string_view value, std::string& xml)
+{
+	xml += "<?xml version=\"1.0\"?>\n<methodResponse><params><param>";
+	xml += value;
+	xml += "</param></params></methodResponse>\n";
+}
+
+// Decode <methodCall>
+bool zc_rpc_codec::read_request(const char* xml, size_t length, std::string& method_name, zc_rpc_data_item::rpc_list* params,
+	zc_rpc_arena* arena)
+{
+	reader r(xml, length, arena);
+	if (!r.expect_start("methodCall") || !r.expect_start("methodName") ||
+		!r.read_text("methodName", method_name)) return false;
+	token_t t = r.next_tag();
+	if (t == T_START && r.name() == "params") {
+		while ((t = r.next_tag()) == T_START && r.name() == "param") {
+			if (!r.expect_start("value")) return false;
+			zc_rpc_data_item* item = arena ? arena->new_item() : new zc_rpc_data_item;
+			params->push_back(item);
+			if (!r.read_value(*item) || !r.expect_end("param")) return false;
+		}
+		if (t != T_END || r.name() != "params") return false;
+		t = r.next_tag();
+	}
+	else if (t == T_EMPTY && r.name() == "params") {
+		t = r.next_tag();
+	}
+	return t == T_END && r.name() == "methodCall";
+}
+
+// Decode <methodResponse>
+bool zc_rpc_codec::read_response(const char* xml, size_t length, zc_rpc_data_item* response, bool& fault,
+	zc_rpc_arena* arena)
+{
+	reader r(xml, length, arena);
+	if (!r.expect_start("methodResponse")) return false;
+	if (r.next_tag() != T_START) return false;
+	if (r.name() == "params") {
+		fault = false;
+		if (!r.expect_start("param") || !r.expect_start("value") || !r.read_value(*response) ||
+			!r.expect_end("param") || !r.expect_end("params")) return false;
+	}
+	else if (r.name() == "fault") {
+		fault = true;
+		if (!r.expect_start("value") || !r.read_value(*response) || !r.expect_end("fault")) return false;
+	}
+	else {
+		return false;
+	}
+	return r.expect_end("methodResponse");
+}
+
+// Reader constructor
+zc_rpc_codec::reader::reader(const char* xml, size_t length, zc_rpc_arena* arena) :
+	p_(xml),
+	end_(xml + length),
+	arena_(arena),
+	depth_(0)
+{
+}
+
+// New item
+zc_rpc_data_item* zc_rpc_codec::reader::new_item()
+{
+	return arena_ ? arena_->new_item() : new zc_rpc_data_item;
+}
+
+// New array
+zc_rpc_data_item::rpc_array* zc_rpc_codec::reader::new_array()
+{
+	return arena_ ? arena_->new_array() : new zc_rpc_data_item::rpc_array;
+}
+
+// New struct
+zc_rpc_data_item::rpc_struct* zc_rpc_codec::reader::new_struct()
+{
+	return arena_ ? arena_->new_struct() : new zc_rpc_data_item::rpc_struct;
+}
+
+// Returns the next token
+zc_rpc_codec::token_t zc_rpc_codec::reader::next()
+{
+	while (p_ < end_) {
+		if (*p_ != '<') {
+			// Character data up to the next markup
+			const char* lt = (const char*)memchr(p_, '<', end_ - p_);
+			const char* stop = lt ? lt : end_;
+			if (memchr(p_, '&', stop - p_)) {
+				buffer_.clear();
+				if (!unescape(p_, stop, buffer_)) return T_ERROR;
+				text_ = buffer_;
+			}
+			else {
+				text_ = std::string_view(p_, stop - p_);
+			}
+			p_ = stop;
+			return T_TEXT;
+		}
+		size_t left = end_ - p_;
+		if (left < 2) return T_ERROR;
+		if (p_[1] == '?') {
+			// XML declaration or processing instruction
+			const char* q = p_ + 2;
+			while (q + 1 < end_ && !(q[0] == '?' && q[1] == '>')) q++;
+			if (q + 1 >= end_) return T_ERROR;
+			p_ = q + 2;
+			continue;
+		}
+		if (p_[1] == '!' && left >= 4 && strncmp(p_, "<!--", 4) == 0) {
+			// Comment
+			const char* q = p_ + 4;
+			while (q + 2 < end_ && !(q[0] == '-' && q[1] == '-' && q[2] == '>')) q++;
+			if (q + 2 >= end_) return T_ERROR;
+			p_ = q + 3;
+			continue;
+		}
+		if (p_[1] == '!' && left >= 9 && strncmp(p_, "<![CDATA[", 9) == 0) {
+			// Character data taken literally
+			const char* q = p_ + 9;
+			while (q + 2 < end_ && !(q[0] == ']' && q[1] == ']' && q[2] == '>')) q++;
+			if (q + 2 >= end_) return T_ERROR;
+			text_ = std::string_view(p_ + 9, q - p_ - 9);
+			p_ = q + 3;
+			return T_TEXT;
+		}
+		const char* gt = (const char*)memchr(p_, '>', left);
+		if (gt == nullptr) return T_ERROR;
+		bool end_tag = p_[1] == '/';
+		const char* start = p_ + (end_tag ? 2 : 1);
+		const char* stop = start;
+		while (stop < gt && !is_space(*stop) && *stop != '/') stop++;
+		name_ = std::string_view(start, stop - start);
+		bool empty = !end_tag && gt[-1] == '/';
+		p_ = gt + 1;
+		if (name_.empty()) return T_ERROR;
+		return end_tag ? T_END : (empty ? T_EMPTY : T_START);
+	}
+	return T_EOF;
+}
+
+// Returns the next token that is not ignorable whitespace
+zc_rpc_codec::token_t zc_rpc_codec::reader::next_tag()
+{
+	token_t t;
+	while ((t = next()) == T_TEXT && all_space(text_));
+	return t;
+}
+
+// Expect <name>
+bool zc_rpc_codec::reader::expect_start(std::string_view name)
+{
+	return next_tag() == T_START && name_ == name;
+}
+
+// Expect </name>
+bool zc_rpc_codec::reader::expect_end(std::string_view name)
+{
+	return next_tag() == T_END && name_ == name;
+}
+
+// Character data up to </name>
+bool zc_rpc_codec::reader::read_text(std::string_view name, std::string& text)
+{
+	text.clear();
+	token_t t;
+	while ((t = next()) == T_TEXT) text += text_;
+	return t == T_END && name_ == name;
+}
+
+// Decode the contents of <value> up to and including </value>
+bool zc_rpc_codec::reader::read_value(zc_rpc_data_item& item)
+{
+	token_t t = next();
+	if (t == T_TEXT) {
+		// Either an untyped string or whitespace before the type element
+		std::string leading(text_);
+		while ((t = next()) == T_TEXT) leading += text_;
+		if (t == T_END && name_ == "value") {
+			item.set(leading, XRT_STRING);
+			return true;
+		}
+		if (!all_space(leading)) return false;
+	}
+	else if (t == T_END && name_ == "value") {
+		// <value></value> - an empty string
+		item.set("", XRT_STRING);
+		return true;
+	}
+	if (t == T_EMPTY) {
+		// <string/>, <base64/>, <nil/> etc.
+		if (name_ == "string") item.set("", XRT_STRING);
+		else if (name_ == "base64") item.set("", XRT_BYTES);
+		else if (name_ == "array") item.set(new_array());
+		else if (name_ == "struct") item.set(new_struct());
+		return expect_end("value");
+	}
+	if (t != T_START) return false;
+
+	if (name_ == "array" || name_ == "struct") {
+		// Each level recurses - so limit the nesting rather than run out of stack
+		if (depth_ >= MAX_DEPTH) return false;
+	}
+	if (name_ == "array") {
+		// The item owns the array from the start so that it is tidied on error
+		zc_rpc_data_item::rpc_array* array = new_array();
+		item.set(array);
+		t = next_tag();
+		if (t == T_START && name_ == "data") {
+			while ((t = next_tag()) == T_START && name_ == "value") {
+				zc_rpc_data_item* datum = new_item();
+				array->push_back(datum);
+				depth_++;
+				bool ok = read_value(*datum);
+				depth_--;
+				if (!ok) return false;
+			}
+			if (t != T_END || name_ != "data") return false;
+		}
+		else if (t != T_EMPTY || name_ != "data") {
+			return false;
+		}
+		return expect_end("array") && expect_end("value");
+	}
+	if (name_ == "struct") {
+		zc_rpc_data_item::rpc_struct* str = new_struct();
+		item.set(str);
+		std::string key;
+		while ((t = next_tag()) == T_START && name_ == "member") {
+			if (!expect_start("name") || !read_text("name", key) || !expect_start("value")) return false;
+			zc_rpc_data_item*& datum = (*str)[key];
+			// A repeated name replaces the earlier member (the arena tidies its own)
+			if (!arena_) delete datum;
+			datum = new_item();
+			depth_++;
+			bool ok = read_value(*datum);
+			depth_--;
+			if (!ok || !expect_end("member")) return false;
+		}
+		if (t != T_END || name_ != "struct") return false;
+		return expect_end("value");
+	}
+
+	// Scalar types - the type view points into the message so it outlives the end tag
+	std::string_view type = name_;
+	if (type == "base64") {
+		// Decode straight from the message unless the text is in pieces (eg CDATA)
+		std::string_view encoded;
+		std::string pieces;
+		token_t t = next();
+		if (t == T_TEXT) {
+			// Replaced entities are in buffer_, which the next token may reuse
+			if (text_.data() == buffer_.data()) {
+				pieces = text_;
+				encoded = pieces;
+			}
+			else {
+				encoded = text_;
+			}
+			t = next();
+			if (t == T_TEXT) {
+				if (encoded.data() != pieces.data()) pieces = encoded;
+				for (; t == T_TEXT; t = next()) pieces += text_;
+				encoded = pieces;
+			}
+		}
+		if (t != T_END || name_ != type) return false;
+		std::string bytes;
+		if (!zc::decode_base_64(encoded.data(), encoded.length(), bytes)) return false;
+		item.set(std::move(bytes), XRT_BYTES);
+		return expect_end("value");
+	}
+	std::string text;
+	if (!read_text(type, text)) return false;
+	if (type == "int" || type == "i4" || type == "i8") {
+		// XML-RPC integers are 32 bits - larger values (eg i8) are kept as double
+		long long value = strtoll(text.c_str(), nullptr, 10);
+		if (value >= std::numeric_limits<int32_t>::min() && value <= std::numeric_limits<int32_t>::max()) {
+			item.set((int32_t)value, XRT_INT);
+		}
+		else {
+			item.set((double)value);
+		}
+	}
+	else if (type == "boolean") {
+		item.set(text == "1" || text == "true" ? 1 : 0, XRT_BOOLEAN);
+	}
+	else if (type == "double") {
+		item.set(strtod(text.c_str(), nullptr));
+	}
+	else if (type == "string") {
+		item.set(text, XRT_STRING);
+	}
+	else if (type == "dateTime.iso8601") {
+		item.set(text, XRT_DATETIME);
+	}
+	else {
+		return false;
+	}
+	return expect_end("value");
+}
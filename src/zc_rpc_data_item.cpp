@@ -21,101 +21,174 @@
 #include <cmath>
 #include <cstdint>
 #include <cstdio>
-#include <stdexcept>
+#include <cstdlib>
+#include <memory>
+#include <new>
 #include <string>
 
 // Constructor - sets default values
 zc_rpc_data_item::zc_rpc_data_item()
 : type_(XRT_EMPTY)
-, i_(0)
-, s_("")
-, d_(nan(""))
-, array_(nullptr)
-, struct_(nullptr)
+, arena_(nullptr)
+{
+}
+
+// Copy constructor - the copy is on the heap
+zc_rpc_data_item::zc_rpc_data_item(const zc_rpc_data_item& other)
+: type_(XRT_EMPTY)
+, arena_(nullptr)
+{
+	copy(other);
+}
 
+// Move constructor - the new item is on the heap so only take the value if other's is too
+zc_rpc_data_item::zc_rpc_data_item(zc_rpc_data_item&& other)
+: type_(XRT_EMPTY)
+, arena_(nullptr)
 {
+	*this = std::move(other);
+}
+
+// Copy assignment
+zc_rpc_data_item& zc_rpc_data_item::operator=(const zc_rpc_data_item& other) {
+	if (this != &other) {
+		clear();
+		copy(other);
+	}
+	return *this;
+}
+
+// Move assignment
+zc_rpc_data_item& zc_rpc_data_item::operator=(zc_rpc_data_item&& other) {
+	if (this == &other) return *this;
+	clear();
+	if (arena_ == other.arena_) {
+		// Same owner - take the value as it is
+		type_ = other.type_;
+		value_ = std::move(other.value_);
+		other.value_ = std::monostate();
+		other.type_ = XRT_EMPTY;
+	}
+	else {
+		// The arrays and structs belong to a different owner
+		copy(other);
+	}
+	return *this;
+}
+
+// Deep copy - arrays and structs are created alongside this item
+void zc_rpc_data_item::copy(const zc_rpc_data_item& other) {
+	type_ = other.type_;
+	switch (type_) {
+	case XRT_ARRAY: {
+		const rpc_array* from = std::get<rpc_array*>(other.value_);
+		rpc_array* to = arena_ ? arena_->new_array() : new rpc_array;
+		to->reserve(from->size());
+		for (auto datum : *from) {
+			zc_rpc_data_item* item = arena_ ? arena_->new_item() : new zc_rpc_data_item;
+			item->copy(*datum);
+			to->push_back(item);
+		}
+		value_ = to;
+		break;
+	}
+	case XRT_STRUCT: {
+		const rpc_struct* from = std::get<rpc_struct*>(other.value_);
+		rpc_struct* to = arena_ ? arena_->new_struct() : new rpc_struct;
+		for (auto& member : *from) {
+			zc_rpc_data_item* item = arena_ ? arena_->new_item() : new zc_rpc_data_item;
+			item->copy(*member.second);
+			to->emplace_hint(to->end(), member.first, item);
+		}
+		value_ = to;
+		break;
+	}
+	default:
+		value_ = other.value_;
+		break;
+	}
+}
+
+// Release the value - arena memory is left for the arena to free
+void zc_rpc_data_item::clear() {
+	if (rpc_array** ap = std::get_if<rpc_array*>(&value_)) {
+		if (arena_) {
+			std::destroy_at(*ap);
+		}
+		else {
+			// For each element of the array - destroy it
+			for (auto datum : **ap) {
+				delete datum;
+			}
+			delete *ap;
+		}
+	}
+	else if (rpc_struct** mp = std::get_if<rpc_struct*>(&value_)) {
+		if (arena_) {
+			std::destroy_at(*mp);
+		}
+		else {
+			// For each element in a structure - destroy it
+			for (auto& member : **mp) {
+				delete member.second;
+			}
+			delete *mp;
+		}
+	}
+	value_ = std::monostate();
+	type_ = XRT_EMPTY;
 }
 
 // Set the data to integer value (for either integer or Boolean RPC item
 void zc_rpc_data_item::set(int32_t i, rpc_data_t type) {
 	if (type == XRT_INT || type == XRT_BOOLEAN) {
+		clear();
 		type_ = type;
-		i_ = i;
+		value_ = i;
 	}
 }
 
 // Set the data to a string type
 void zc_rpc_data_item::set(std::string s, rpc_data_t type) {
-	if (type == XRT_BYTES || type == XRT_DATETIME || type == XRT_STRING) {
+	// XRT_DEFAULT: some servers send bad RPC with integers and doubles supplied 
+	// as default type which is string - they are converted when read
+	if (type == XRT_BYTES || type == XRT_DATETIME || type == XRT_STRING || type == XRT_DEFAULT) {
+		clear();
 		type_ = type;
-		s_ = s;
-	}
-	else if (type == XRT_DEFAULT) {
-		// Some servers send bad RPC with integers and doubles supplied as default 
-		// type which is string
-		type_ = type;
-		s_ = s;
-		// Try it as integer
-		try {
-			i_ = std::stoi(s_.c_str());
-		}
-		catch (std::invalid_argument&) {
-			i_ = 0;
-		}
-		// Try it as double
-		try {
-			d_ = std::stod(s_.c_str());
-		}
-		catch (std::invalid_argument&) {
-			d_ = nan("");
-		}
+		value_ = std::move(s);
 	}
 }
 
 // Set a double
 void zc_rpc_data_item::set(double d) {
+	clear();
 	type_ = XRT_DOUBLE;
-	d_ = d;
+	value_ = d;
 }
 
 // Set an array
 void zc_rpc_data_item::set(zc_rpc_data_item::rpc_array* ap) {
+	// Already ours
+	if (type_ == XRT_ARRAY && std::get<rpc_array*>(value_) == ap) return;
+	clear();
 	type_ = XRT_ARRAY;
-	array_ = ap;
+	value_ = ap;
 }
 
 // Set a struct
 void zc_rpc_data_item::set(zc_rpc_data_item::rpc_struct* mp) {
+	// Already ours
+	if (type_ == XRT_STRUCT && std::get<rpc_struct*>(value_) == mp) return;
+	clear();
 	type_ = XRT_STRUCT;
-	struct_ = mp;
+	value_ = mp;
 }
 
 // Destructor
 zc_rpc_data_item::~zc_rpc_data_item()
 {
 	// Destroy compound types
-	switch (type_) {
-	case XRT_ARRAY:
-		// For each element of the array
-		for (auto it = array_->begin(); it != array_->end(); it++) {
-			// destroy it
-			delete *it;
-		}
-		array_->clear();
-		delete array_;
-		break;
-	case XRT_STRUCT:
-		// For each element in a structure
-		for (auto it = struct_->begin(); it != struct_->end(); it++) {
-			// destroy it
-			delete it->second;
-		}
-		struct_->clear();
-		delete struct_;
-		break;
-	default:
-		break;
-	}
+	clear();
 }
 
 // Return the data type
@@ -126,7 +199,7 @@ rpc_data_t zc_rpc_data_item::type() const {
 // Get the integer
 bool zc_rpc_data_item::get(int32_t& i) const {
 	if (type_ == XRT_INT || type_ == XRT_BOOLEAN || type_ == XRT_DEFAULT) {
-		i = i_;
+		i = get_int();
 		return true;
 	}
 	else {
@@ -136,14 +209,21 @@ bool zc_rpc_data_item::get(int32_t& i) const {
 }
 
 // Get the integer
-int zc_rpc_data_item::get_int() const {
-	return i_;
+int32_t zc_rpc_data_item::get_int() const {
+	if (const int32_t* i = std::get_if<int32_t>(&value_)) {
+		return *i;
+	}
+	if (type_ == XRT_DEFAULT) {
+		// Try it as integer
+		return (int32_t)strtol(std::get<std::string>(value_).c_str(), nullptr, 10);
+	}
+	return 0;
 }
 
 // Get the string
 bool zc_rpc_data_item::get(std::string& s) const {
 	if (type_ == XRT_STRING || type_ == XRT_BYTES || type_ == XRT_DATETIME) {
-		s = s_;
+		s = std::get<std::string>(value_);
 		return true;
 	}
 	else {
@@ -152,15 +232,19 @@ bool zc_rpc_data_item::get(std::string& s) const {
 	}
 }
 
-// return string
-std::string zc_rpc_data_item::get_string() {
-	return s_;
+// return string - a reference so large values (eg base64) are not copied
+const std::string& zc_rpc_data_item::get_string() const {
+	static const std::string empty;
+	if (const std::string* s = std::get_if<std::string>(&value_)) {
+		return *s;
+	}
+	return empty;
 }
 
 // Get the double
 bool zc_rpc_data_item::get(double& d) const {
 	if (type_ == XRT_DOUBLE || type_ == XRT_DEFAULT) {
-		d = d_;
+		d = get_double();
 		return true;
 	}
 	else {
@@ -171,13 +255,23 @@ bool zc_rpc_data_item::get(double& d) const {
 
 // Return the double
 double zc_rpc_data_item::get_double() const {
-	return d_;
+	if (const double* d = std::get_if<double>(&value_)) {
+		return *d;
+	}
+	if (type_ == XRT_DEFAULT) {
+		// Try it as double
+		const char* text = std::get<std::string>(value_).c_str();
+		char* end;
+		double d = strtod(text, &end);
+		if (end != text) return d;
+	}
+	return nan("");
 }
 
 // Get the array
 bool zc_rpc_data_item::get(rpc_array*& ap) {
 	if (type_ == XRT_ARRAY) {
-		ap = array_;
+		ap = std::get<rpc_array*>(value_);
 		return true;
 	}
 	else {
@@ -188,13 +282,14 @@ bool zc_rpc_data_item::get(rpc_array*& ap) {
 
 // Returns the array
 zc_rpc_data_item::rpc_array* zc_rpc_data_item::get_array() {
-	return array_;
+	rpc_array** ap = std::get_if<rpc_array*>(&value_);
+	return ap ? *ap : nullptr;
 }
 
 // Get the structure
 bool zc_rpc_data_item::get(rpc_struct*& mp) {
 	if (type_ == XRT_STRUCT) {
-		mp = struct_;
+		mp = std::get<rpc_struct*>(value_);
 		return true;
 	}
 	else {
@@ -205,7 +300,8 @@ bool zc_rpc_data_item::get(rpc_struct*& mp) {
 
 // Returns the struct
 zc_rpc_data_item::rpc_struct* zc_rpc_data_item::get_struct() {
-	return struct_;
+	rpc_struct** mp = std::get_if<rpc_struct*>(&value_);
+	return mp ? *mp : nullptr;
 }
 
 // Convert the item to text for display
@@ -215,39 +311,39 @@ std::string zc_rpc_data_item::print_item() {
 	switch (type_) {
 	case XRT_BOOLEAN:
 		// Display 0 or 1
-		snprintf(temp, 1024, "Boolean: %1d\n", i_);
+		snprintf(temp, 1024, "Boolean: %1d\n", get_int());
 		result = temp;
 		break;
 	case XRT_INT:
 		// Integer
-		snprintf(temp, 1024, "Int: %d\n", i_);
+		snprintf(temp, 1024, "Int: %d\n", get_int());
 		result = temp;
 		break;
 	case XRT_DOUBLE:
 		// Double
-		snprintf(temp, 1024, "Double: %f\n", d_);
+		snprintf(temp, 1024, "Double: %f\n", get_double());
 		result = temp;
 		break;
 	case XRT_STRING:
 		// String
-		snprintf(temp, 1024, "String: %s\n", s_.c_str());
+		snprintf(temp, 1024, "String: %s\n", std::get<std::string>(value_).c_str());
 		result = temp;
 		break;
 	case XRT_DATETIME:
 		// Date/Time as string
-		snprintf(temp, 1024, "Date/Time: %s\n", s_.c_str());
+		snprintf(temp, 1024, "Date/Time: %s\n", std::get<std::string>(value_).c_str());
 		result = temp;
 		break;
 	case XRT_BYTES:
 		// Base64 encoding as string
-		snprintf(temp, 1024, "Base64: %s\n", zc::encode_base_64(s_).c_str());
+		snprintf(temp, 1024, "Base64: %s\n", zc::encode_base_64(std::get<std::string>(value_)).c_str());
 		result = temp;
 		break;
 	case XRT_ARRAY:
 		// Array
 		result = "rpc_array:\n";
 		// For each item in the array - append it text
-		for (auto it = array_->begin(); it != array_->end(); it++) {
+		for (auto it = get_array()->begin(); it != get_array()->end(); it++) {
 			result += (*it)->print_item();
 		}
 		break;
@@ -255,7 +351,7 @@ std::string zc_rpc_data_item::print_item() {
 		// Structure
 		result = "rpc_struct:\n";
 		// For each element in the structure - appends its nae and text
-		for (auto it = struct_->begin(); it != struct_->end(); it++) {
+		for (auto it = get_struct()->begin(); it != get_struct()->end(); it++) {
 			std::string key = it->first;
 			zc_rpc_data_item* item = it->second;
 			snprintf(temp, 1024, "Name: %s\nValue: ", key.c_str());
@@ -268,3 +364,46 @@ std::string zc_rpc_data_item::print_item() {
 	}
 	return result;
 }
+
+// Arena constructor
+zc_rpc_arena::zc_rpc_arena(size_t block_size)
+: resource_(block_size)
+{
+}
+
+// Arena destructor
+zc_rpc_arena::~zc_rpc_arena()
+{
+	release();
+}
+
+// Allocate and construct an item
+zc_rpc_data_item* zc_rpc_arena::new_item() {
+	void* p = resource_.allocate(sizeof(zc_rpc_data_item), alignof(zc_rpc_data_item));
+	zc_rpc_data_item* item = new (p) zc_rpc_data_item;
+	item->arena_ = this;
+	items_.push_back(item);
+	return item;
+}
+
+// Allocate and construct an array - its elements also come from the arena
+zc_rpc_data_item::rpc_array* zc_rpc_arena::new_array() {
+	void* p = resource_.allocate(sizeof(zc_rpc_data_item::rpc_array), alignof(zc_rpc_data_item::rpc_array));
+	return new (p) zc_rpc_data_item::rpc_array(&resource_);
+}
+
+// Allocate and construct a struct - its members also come from the arena
+zc_rpc_data_item::rpc_struct* zc_rpc_arena::new_struct() {
+	void* p = resource_.allocate(sizeof(zc_rpc_data_item::rpc_struct), alignof(zc_rpc_data_item::rpc_struct));
+	return new (p) zc_rpc_data_item::rpc_struct(&resource_);
+}
+
+// Destroy every item (each destroys its own array or struct) then free the memory in one go
+void zc_rpc_arena::release() {
+	for (auto item : items_) {
+		std::destroy_at(item);
+	}
+	// Keep the list's capacity for the next message
+	items_.clear();
+	resource_.release();
+}
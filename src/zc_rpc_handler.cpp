@@ -17,6 +17,9 @@
 */
 #include "zc_rpc_handler.h"
 
+#include "zc_http_parser.h"
+#include "zc_rpc_codec.h"
+#include "zc_rpc_json_codec.h"
 #include "zc_socket_server.h"
 #include "zc_url_handler.h"
 
@@ -25,21 +28,72 @@
 #include "zc_status.h"
 #include "zc_utils.h"
 
-#include "pugixml.hpp"
-
+#include <algorithm>
+#include <cstdarg>
+#include <cstring>
 #include <sstream>
 #include <iostream>
-#include <map>
 #include <string>
 #include <zc_rpc_data_item.h>
 #include <cstdint>
 #include <vector>
 
+#include <FL/Fl.H>
+
 extern debug_flag DEBUG_XMLRPC;
 extern std::string APP_NAME;
 extern std::string APP_VERSION;
 zc_rpc_handler* rpc_handler_ = nullptr;
 
+//! The most responses kept in the response cache
+const size_t MAX_CACHED_RESPONSES = 1024;
+
+// An asynchronous call waiting for its reply
+struct zc_rpc_handler::completion_token::call_t {
+	std::shared_ptr<server_link> link;                         //!< The handler
+	std::shared_ptr<zc_socket_server::reply_t> reply_to;       //!< Where the response goes
+	rpc_encoding encoding;                                     //!< Encoding of the request
+	std::string id;                                            //!< JSON-RPC request identifier
+	std::string method_name;                                   //!< The method
+	bool notification;                                         //!< No response is expected
+	std::atomic<bool> replied{ false };                        //!< The reply has been sent
+
+	// The method has let go of every token - reply with a fault if it did not reply
+	~call_t() {
+		if (!replied) {
+			zc_rpc_data_item response;
+			complete(*this, FAULT_INTERNAL_ERROR, response);
+		}
+	}
+};
+
+//! A status report from a client thread
+struct client_report {
+	status_t status;           //!< Severity
+	std::string message;       //!< The report
+};
+
+// Main thread - show the report from a client thread
+static void cb_client_report(void* v) {
+	client_report* report = (client_report*)v;
+	status_->misc_status(report->status, "%s", report->message.c_str());
+	delete report;
+}
+
+// Pass the report to the main thread - status_ must not be used from the client threads
+static void client_status(status_t status, const char* label, ...) {
+	char message[256];
+	va_list args;
+	va_start(args, label);
+	vsnprintf(message, sizeof(message), label, args);
+	va_end(args);
+	client_report* report = new client_report{ status, message };
+	if (Fl::awake(cb_client_report, report) != 0) {
+		// The queue is full - drop the report
+		delete report;
+	}
+}
+
 // Constructor
 zc_rpc_handler::zc_rpc_handler(std::string address, int port_number, std::string resource_name)
 {
@@ -47,26 +101,43 @@ zc_rpc_handler::zc_rpc_handler(std::string address, int port_number, std::string
 	server_port_ = port_number;
 	resource_ = resource_name;
 	server_ = nullptr;
+	server_listeners_ = 1;
+	client_connections_ = 1;
+	client_closing_ = false;
+	client_encoding_ = XML_RPC;
+	client_id_ = 1;
+	cache_generation_ = 0;
+	link_ = std::make_shared<server_link>();
+	link_->handler = this;
 	method_list_.clear();
 	add_method(this, { "system.listMethods", "s:s", "List of methods available" }, list_methods);
 	add_method(this, { "system.methodHelp", "s:s", "Help text for method" }, method_help);
+	add_method(this, { "system.multicall", "A:A", "Make several calls in one request" }, multicall);
+	// These only change when a method is added
+	cache_responses("system.listMethods");
+	cache_responses("system.methodHelp");
 }
 
 // Destructor
 zc_rpc_handler::~zc_rpc_handler()
 {
 	close_server();
-	for (auto ix = method_list_.begin(); ix != method_list_.end(); ix++) {
-	}
+	stop_client();
 	method_list_.clear();
 }
 
 // Close the RPC server
 void zc_rpc_handler::close_server() {
+	// Replies still to come are dropped
+	{
+		std::lock_guard<std::mutex> lock(link_->mutex);
+		link_->handler = nullptr;
+	}
+	link_ = std::make_shared<server_link>();
+	link_->handler = this;
 	if (server_) {
 		server_->close_server(true);
-		delete server_;
-		server_ = nullptr;
+		server_.reset();
 	}
 }
 
@@ -76,258 +147,260 @@ bool zc_rpc_handler::do_request(
 	zc_rpc_data_item::rpc_list* params,
 	zc_rpc_data_item* response
 ) {
-	// The stream for sending the request
-	std::stringstream put_request;
-	// The stream for receiving the response
-	std::stringstream put_response;
-	// Generate XML for the request
-	generate_request(method_name, params, put_request);
+	return do_request_async(method_name, params, response).get();
+}
+
+// Queue the request for a client connection
+std::future<bool> zc_rpc_handler::do_request_async(
+	std::string method_name,
+	zc_rpc_data_item::rpc_list* params,
+	zc_rpc_data_item* response
+) {
+	// Generate XML (or JSON) for the request
+	rpc_encoding encoding = client_encoding_;
+	std::string request_xml;
+	generate_request(method_name, params, encoding, request_xml);
 	// Debug display
 	if (zc_app::debug(DEBUG_XMLRPC)) {
 		std::string text = "My request: " + method_name + "\n";
-		for (auto& p : *params) {
-			text += p->print_item();
+		if (params) {
+			for (auto& p : *params) {
+				text += p->print_item();
+			}
 		}
 		printf("%s", text.c_str());
 	}
-	// Post the request and get the response
-	if (url_handler_->post_url(host_name_, resource_, &put_request, &put_response)) {
-		// Successful - process response
-		put_response.seekg(0, std::ios::beg);
-		bool rpc_fault;
-		decode_response(put_response, response, rpc_fault);
-		if (zc_app::debug(DEBUG_XMLRPC)) {
-			std::string text = "Their response:\n" + response->print_item();
-			printf("%s", text.c_str());
+	return post_request(std::move(request_xml), encoding, response);
+}
+
+// Queue the request for a client connection
+std::future<bool> zc_rpc_handler::post_request(std::string&& request_xml, rpc_encoding encoding, zc_rpc_data_item* response) {
+	client_job job;
+	job.request_xml = std::move(request_xml);
+	job.encoding = encoding;
+	job.response = response;
+	std::future<bool> result = job.result.get_future();
+	start_client();
+	client_mutex_.lock();
+	client_jobs_.push_back(std::move(job));
+	client_mutex_.unlock();
+	client_cv_.notify_one();
+	return result;
+}
+
+// Send the calls as one system.multicall
+bool zc_rpc_handler::do_request_batch(std::vector<batch_call>& calls) {
+	for (auto& call : calls) {
+		call.ok = false;
+	}
+	if (calls.empty()) return true;
+	// The parameter is an array of {methodName, params} structs. They are made in an
+	// arena, whose arrays do not own their elements, so they can refer to the callers'
+	// parameters rather than copy them.
+	rpc_encoding encoding = client_encoding_;
+	zc_rpc_arena arena;
+	zc_rpc_data_item::rpc_array* call_array = arena.new_array();
+	call_array->reserve(calls.size());
+	for (auto& call : calls) {
+		zc_rpc_data_item* name = arena.new_item();
+		name->set(call.method_name, XRT_STRING);
+		zc_rpc_data_item::rpc_array* call_params = arena.new_array();
+		if (call.params) {
+			call_params->assign(call.params->begin(), call.params->end());
 		}
-		if (rpc_fault) {
-			return false;
+		zc_rpc_data_item* params = arena.new_item();
+		params->set(call_params);
+		zc_rpc_data_item::rpc_struct* members = arena.new_struct();
+		(*members)["methodName"] = name;
+		(*members)["params"] = params;
+		zc_rpc_data_item* item = arena.new_item();
+		item->set(members);
+		call_array->push_back(item);
+	}
+	zc_rpc_data_item* call_list = arena.new_item();
+	call_list->set(call_array);
+	zc_rpc_data_item::rpc_list multicall_params = { call_list };
+	std::string xml;
+	generate_request("system.multicall", &multicall_params, encoding, xml);
+	if (zc_app::debug(DEBUG_XMLRPC)) {
+		printf("My request: system.multicall of %zu calls\n", calls.size());
+	}
+	zc_rpc_data_item response;
+	if (!post_request(std::move(xml), encoding, &response).get()) {
+		return false;
+	}
+	// Each result is a one-element array holding the value, or a fault struct
+	zc_rpc_data_item::rpc_array* results = response.get_array();
+	if (results == nullptr || results->size() != calls.size()) {
+		client_status(ST_ERROR, "RPC: Invalid system.multicall response");
+		return false;
+	}
+	for (size_t ix = 0; ix < calls.size(); ix++) {
+		zc_rpc_data_item* result = (*results)[ix];
+		zc_rpc_data_item::rpc_array* value = result->get_array();
+		if (value && value->size() == 1) {
+			*calls[ix].response = std::move(*value->front());
+			calls[ix].ok = true;
 		}
 		else {
-			return true;
+			*calls[ix].response = std::move(*result);
 		}
 	}
-	else {
-		return false;
-	}
+	return true;
 }
 
-// Generate XML for the request onto the selected output stream
-bool zc_rpc_handler::generate_request(
-	std::string method_name,
-	zc_rpc_data_item::rpc_list* params,
-	std::ostream& request_xml
-) {
-	// Generate the document
-	pugi::xml_document doc;
-	// Add the declaraion
-	auto n_decl = doc.append_child(pugi::node_declaration);
-	n_decl.append_attribute("version") = "1.0";
-
-	// Top level node
-	pugi::xml_node n_call = doc.append_child("methodCall");
-
-	// Method name
-	n_call.append_child("methodName").text().set(method_name);
-
-	// Parameters
-	pugi::xml_node n_params = n_call.append_child("params");
-	for (auto param : *params) {
-		pugi::xml_node n_param = n_params.append_child("param");
-		write_item(*param, n_param);
+// Set the number of client connections - takes effect when the client next starts
+void zc_rpc_handler::client_connections(int count) {
+	std::lock_guard<std::mutex> lock(client_mutex_);
+	client_connections_ = count < 1 ? 1 : count;
+	if (client_threads_.size() && (int)client_threads_.size() < client_connections_) {
+		// Already running - add connections
+		while ((int)client_threads_.size() < client_connections_) {
+			client_threads_.emplace_back(&zc_rpc_handler::client_thread, this);
+		}
 	}
-
-	// WRite XML to output stream
-	doc.save(request_xml, " ");
-
-	return true;
 }
 
-// Generate an RPC Respose
-bool zc_rpc_handler::generate_response(
-	bool rpc_fault,
-	zc_rpc_data_item* response,
-	std::ostream& response_xml) {
-	// Generate the document
-	pugi::xml_document doc;
-	// Add the declaraion
-	auto n_decl = doc.append_child(pugi::node_declaration);
-	n_decl.append_attribute("version") = "1.0";
+// Set the encoding of client requests
+void zc_rpc_handler::client_encoding(rpc_encoding encoding) {
+	client_encoding_ = encoding;
+}
 
-	// Add the response
-	pugi::xml_node n_resp = doc.append_child("methodResponse");
+// Returns the encoding of client requests
+zc_rpc_handler::rpc_encoding zc_rpc_handler::client_encoding() const {
+	return client_encoding_;
+}
 
-	// <params> or <fault>
-	if (rpc_fault) {
-		pugi::xml_node n_fault = n_resp.append_child("fault");
-		write_item(*response, n_fault);
+// Start the client connection threads
+void zc_rpc_handler::start_client() {
+	std::lock_guard<std::mutex> lock(client_mutex_);
+	if (client_threads_.size()) return;
+	// Use the application's URL handler so that its host policies apply
+	if (url_handler_ == nullptr && own_url_handler_ == nullptr) {
+		own_url_handler_ = std::make_unique<zc_url_handler>();
 	}
-	else {
-		// Parameters
-		pugi::xml_node n_params = n_resp.append_child("params");
-		pugi::xml_node n_param = n_params.append_child("param");
-		write_item(*response, n_param);
+	client_closing_ = false;
+	for (int ix = 0; ix < client_connections_; ix++) {
+		client_threads_.emplace_back(&zc_rpc_handler::client_thread, this);
 	}
-	// Write the response to the output stream
-	doc.save(response_xml, " ");
-
-	return true;
 }
 
-// Create XML for an individual item
-void zc_rpc_handler::write_item(zc_rpc_data_item& item, pugi::xml_node& node) {
-	rpc_data_t element_type = item.type();
-	std::string text;
-	pugi::xml_node n_value = node.append_child("value");
+// Stop the client connection threads
+void zc_rpc_handler::stop_client() {
+	client_mutex_.lock();
+	if (client_threads_.empty()) {
+		client_mutex_.unlock();
+		return;
+	}
+	client_closing_ = true;
+	client_mutex_.unlock();
+	client_cv_.notify_all();
+	for (auto& t : client_threads_) {
+		t.join();
+	}
+	client_threads_.clear();
+	// Fail anything not sent
+	for (auto& job : client_jobs_) {
+		job.result.set_value(false);
+	}
+	client_jobs_.clear();
+}
 
-	switch (element_type) {
-	case XRT_BOOLEAN:
-		n_value.append_child("boolean").text().set(item.get_int() == 1);
-		break;
-	case XRT_INT:
-		n_value.append_child("int").text().set(item.get_int());
-		break;
-	case XRT_DOUBLE:
-		n_value.append_child("double").text().set(item.get_double());
-		break;
-	case XRT_STRING:
-		n_value.append_child("string").text().set(item.get_string());
-		break;
-	case XRT_DATETIME:
-		n_value.append_child("dateTime.iso8601").text().set(item.get_string());
-		break;
-	case XRT_BYTES:
-		n_value.append_child("base64").text().set(zc::encode_base_64(item.get_string()));
-		break;
-	case XRT_ARRAY: {
-		pugi::xml_node n_array = n_value.append_child("array");
-		pugi::xml_node n_data = n_array.append_child("data");
-		for (auto datum : *item.get_array()) {
-			write_item(*datum, n_data);
+// Client connection thread - posts the requests from the queue through the URL handler,
+// whose shared cache keeps the connection open between them
+void zc_rpc_handler::client_thread() {
+	zc_url_handler* handler = url_handler_ ? url_handler_ : own_url_handler_.get();
+	std::ostringstream response_xml;
+	std::string error;
+	while (true) {
+		std::unique_lock<std::mutex> lock(client_mutex_);
+		client_cv_.wait(lock, [this] { return client_closing_ || !client_jobs_.empty(); });
+		if (client_closing_) break;
+		client_job job = std::move(client_jobs_.front());
+		client_jobs_.pop_front();
+		lock.unlock();
+		// Post the request and get the response
+		response_xml.str("");
+		long code = 0;
+		bool ok = false;
+		if (!handler->post_url(host_name_, resource_, job.encoding == JSON_RPC ? "application/json" : "text/xml",
+			job.request_xml, &response_xml, code, error)) {
+			client_status(ST_ERROR, "RPC: Request to %s failed: %s", host_name_.c_str(), error.c_str());
 		}
-		break;
-	}
-	case XRT_STRUCT: {
-		pugi::xml_node n_struct = n_value.append_child("struct");
-		for (auto member : *item.get_struct()) {
-			pugi::xml_node n_member = n_struct.append_child("member");
-			n_member.append_child("name").text().set(member.first);
-			write_item(*member.second, n_member);
+		else if (code != 200) {
+			client_status(ST_ERROR, "RPC: Request to %s returned HTTP %ld", host_name_.c_str(), code);
 		}
-		break;
-	}
-	default:
-		break;
+		else {
+			// Successful - process response
+			bool rpc_fault = false;
+			if (decode_response(response_xml.str(), job.encoding, job.response, rpc_fault)) {
+				if (zc_app::debug(DEBUG_XMLRPC)) {
+					std::string text = "Their response:\n" + job.response->print_item();
+					printf("%s", text.c_str());
+				}
+				ok = !rpc_fault;
+			}
+		}
+		job.result.set_value(ok);
 	}
-	return;
 }
 
-// Decode the response on the input stream
-bool zc_rpc_handler::decode_response(std::istream& response_xml, zc_rpc_data_item* response, bool& rpc_fault) {
-
-	pugi::xml_document doc;
-	doc.load(response_xml);
-
-	pugi::xml_node n_resp = doc.document_element();
-
-	if (strcmp(n_resp.name(), "methodResponse") != 0) {
-		status_->misc_status(ST_ERROR, "RPC: Not a valid response");
-		return false;
+// Generate XML (or JSON) for the request
+bool zc_rpc_handler::generate_request(
+	std::string method_name,
+	zc_rpc_data_item::rpc_list* params,
+	rpc_encoding encoding,
+	std::string& request_xml
+) {
+	if (encoding == JSON_RPC) {
+		zc_rpc_json_codec::write_request(method_name, params, std::to_string(client_id_++), request_xml);
 	}
-	pugi::xml_node n_child = n_resp.first_child();
-	if (strcmp(n_child.name(), "params")) {
-		pugi::xml_node n_param = n_child.child("param");
-		read_item(n_param, *response);
-		rpc_fault = false;
+	else {
+		zc_rpc_codec::write_request(method_name, params, request_xml);
 	}
-	else if (strcmp(n_child.name(), "fault")) {
-		read_item(n_child, *response);
-		rpc_fault = true;
+	return true;
+}
+
+// Generate an RPC Respose
+bool zc_rpc_handler::generate_response(
+	bool rpc_fault,
+	zc_rpc_data_item* response,
+	rpc_encoding encoding,
+	const std::string& id,
+	std::string& response_xml) {
+	if (encoding == JSON_RPC) {
+		zc_rpc_json_codec::write_response(rpc_fault, response, id, response_xml);
 	}
 	else {
-		status_->misc_status(ST_ERROR, "RPC: Not a valid response");
-		return false;
+		zc_rpc_codec::write_response(rpc_fault, response, response_xml);
 	}
 	return true;
 }
 
-// Decode the RPC Request XML on the input stream
-bool zc_rpc_handler::decode_request(std::istream& request_xml, std::string& method_name, zc_rpc_data_item::rpc_list* params) {
-	// parse the request
-	pugi::xml_document doc;
-	doc.load(request_xml);
-	// Check it's a request
-	pugi::xml_node n_req = doc.document_element();
-	if (strcmp(n_req.name(), "methodCall") != 0) {
-		status_->misc_status(ST_ERROR, "RPC: Not a valid request");
+// Decode the response XML (or JSON)
+bool zc_rpc_handler::decode_response(std::string_view response_xml, rpc_encoding encoding, zc_rpc_data_item* response,
+	bool& rpc_fault) {
+	bool ok = encoding == JSON_RPC ?
+		zc_rpc_json_codec::read_response(response_xml.data(), response_xml.length(), response, rpc_fault) :
+		zc_rpc_codec::read_response(response_xml.data(), response_xml.length(), response, rpc_fault);
+	if (!ok) {
+		client_status(ST_ERROR, "RPC: Not a valid response");
 		return false;
 	}
-	// Get method call
-	method_name = n_req.child("methodName").text().as_string();
-	// Get params
-	pugi::xml_node n_params = n_req.child("params");
-	for (auto n_param : n_params) {
-		if (strcmp(n_param.name(), "param") != 0) {
-			status_->misc_status(ST_ERROR, "RPC: Not a valid request");
-			return false;
-		}
-		zc_rpc_data_item* item = new zc_rpc_data_item;
-		read_item(n_param, *item);
-		params->push_back(item);
-	}
 	return true;
 }
 
-void zc_rpc_handler::read_item(pugi::xml_node& node, zc_rpc_data_item& item) {
-	pugi::xml_node n_value = node.child("value");
-	pugi::xml_node n_item = n_value.first_child();
-	const char* type = n_item.name();
-	if (strcmp(type, "array") == 0) {
-		zc_rpc_data_item::rpc_array* array = new zc_rpc_data_item::rpc_array;
-		pugi::xml_node n_data = n_item.child("data");
-		for (auto n_datum : n_data.children()) {
-			zc_rpc_data_item* datum = new zc_rpc_data_item;
-			read_item(n_datum, *datum);
-			array->push_back(datum);
-		}
-		item.set(array);
-	}
-	else if (strcmp(type, "base64") == 0) {
-		std::string s = zc::decode_base_64(n_item.text().as_string());
-		item.set(s, XRT_STRING);
-	}
-	else if (strcmp(type, "boolean") == 0) {
-		bool b = n_item.text().as_bool();
-		item.set(b);
-	}
-	else if (strcmp(type, "dateTime.iso8601") == 0) {
-		std::string s = n_item.text().as_string();
-		item.set(s, XRT_DATETIME);
-	}
-	else if (strcmp(type, "double") == 0) {
-		double d = n_item.text().as_double();
-		item.set(d);
-	}
-	else if (strcmp(type, "int") == 0 || strcmp(type, "i4") == 0) {
-		uint32_t i = n_item.text().as_int();
-		item.set(i);
-	}
-	else if (strcmp(type, "string") == 0 || strlen(type) == 0) {
-		std::string s = n_item.text().as_string();
-		item.set(s, XRT_STRING);
-	}
-	else if (strcmp(type, "struct") == 0) {
-		zc_rpc_data_item::rpc_struct* str = new zc_rpc_data_item::rpc_struct;
-		for (auto member : n_item.children()) {
-			if (strcmp(member.name(), "member") == 0) {
-				std::string name = member.text().as_string();
-				zc_rpc_data_item* datum = new zc_rpc_data_item;
-				read_item(member, *datum);
-				(*str)[name] = datum;
-			}
-		}
-		item.set(str);
+// Decode the RPC Request XML (or JSON)
+bool zc_rpc_handler::decode_request(std::string_view request_xml, rpc_encoding encoding, std::string& method_name,
+	zc_rpc_data_item::rpc_list* params, std::string& id, zc_rpc_arena* arena) {
+	bool ok = encoding == JSON_RPC ?
+		zc_rpc_json_codec::read_request(request_xml.data(), request_xml.length(), method_name, params, id, arena) :
+		zc_rpc_codec::read_request(request_xml.data(), request_xml.length(), method_name, params, arena);
+	if (!ok) {
+		status_->misc_status(ST_ERROR, "RPC: Not a valid request");
+		return false;
 	}
+	return true;
 }
 
 // Run the HTTP server
@@ -336,12 +409,21 @@ void zc_rpc_handler::run_server() {
 		server_->run_server();
 	}
 	else {
-		server_ = new zc_socket_server(zc_socket_server::HTTP, host_name_, server_port_);
+		server_ = std::make_shared<zc_socket_server>(zc_socket_server::HTTP, host_name_, server_port_);
+		server_->listeners(server_listeners_);
 		server_->callback(this, rcv_request);
 		server_->run_server();
 	}
 }
 
+// Set the number of listener threads
+void zc_rpc_handler::listeners(int count) {
+	server_listeners_ = count;
+	if (server_) {
+		server_->listeners(count);
+	}
+}
+
 // Static callback - calls the one in this class
 int zc_rpc_handler::rcv_request(void* instance, std::stringstream& ss) { 
 	return ((zc_rpc_handler*)instance)->handle_request(ss);
@@ -349,13 +431,18 @@ int zc_rpc_handler::rcv_request(void* instance, std::stringstream& ss) {
 
 // Handle request - decode it, action it and send response
 int zc_rpc_handler::handle_request(std::stringstream& ss) {
-	std::stringstream payload;
-	if (strip_header(ss, payload)) {
+	const std::string message = ss.str();
+	std::string_view payload;
+	rpc_encoding encoding;
+	if (strip_header(message, payload, encoding)) {
 		// Decode request
 		std::string method_name = "";
+		std::string id;
+		// The decoded parameters belong to this call and are freed together
+		zc_rpc_arena arena;
 		zc_rpc_data_item::rpc_list params;
 		zc_rpc_data_item response;
-		decode_request(payload, method_name, &params);
+		bool decoded = decode_request(payload, encoding, method_name, &params, id, &arena);
 		// Debug display
 		if (zc_app::debug(DEBUG_XMLRPC)) {
 			std::string text = "Their request: " + method_name + "\n";
@@ -365,76 +452,128 @@ int zc_rpc_handler::handle_request(std::stringstream& ss) {
 			printf("%s", text.c_str());
 		}
 
-		int error;
+		int error = 0;
+		std::string body;
+		// Key for the response cache - empty if the method is not cached
+		std::string cache_key;
+		uint64_t cache_version = 0;
+		bool cached = false;
+		// The method will reply later
+		bool deferred = false;
 		// Does method exist
-		if (method_list_.find(method_name) == method_list_.end()) {
+		const method_def* meth = decoded ? method_list_.find(method_name) : nullptr;
+		if (!decoded) {
+			generate_error(FAULT_PARSE_ERROR, "Request not well formed", response);
+			error = 1;
+		}
+		else if (meth == nullptr) {
 			status_->misc_status(ST_ERROR, "RPC: Unknown method %s", 
 			    method_name.c_str());
+			generate_error(FAULT_UNKNOWN_METHOD, "Unknown method " + method_name, response);
 			error = 1;
 		}
+		else if (meth->async_callback) {
+			// Start it - the token sends the response
+			completion_token token;
+			token.call_ = std::make_shared<completion_token::call_t>();
+			token.call_->link = link_;
+			token.call_->encoding = encoding;
+			token.call_->id = id;
+			token.call_->method_name = method_name;
+			token.call_->notification = encoding == JSON_RPC && id.empty();
+			// A notification is answered now - so nothing waits for its reply
+			if (!token.call_->notification) {
+				token.call_->reply_to = server_->defer_response();
+			}
+			meth->async_callback(params, token);
+			deferred = true;
+		}
 		else {
-			// It does, so do it
-			auto& meth = method_list_.at(method_name);
-			error = meth.callback(meth.v, params, response);
+			if (meth->cache_ttl.count() >= 0) {
+				// The same parameters get the same response while it is in the cache
+				cache_key = method_name;
+				cache_key += '\0';
+				for (auto p : params) {
+					zc_rpc_codec::write_value(*p, cache_key);
+				}
+				cached = cached_response(*meth, cache_key, encoding, id, body, cache_version);
+			}
+			if (!cached) {
+				// It does, so do it
+				error = meth->callback(params, response);
+				if (error && response.type() != XRT_STRUCT) {
+					generate_error(error, "Method " + method_name + " failed", response);
+				}
+			}
 		}
-		if (error > 0) return false;
-		// Convert to XML
-		std::stringstream xml;
-		generate_response(error, &response, xml);
-		if (zc_app::debug(DEBUG_XMLRPC)) {
-			std::string text = "My response:\n" + response.print_item();
-			printf("%s", text.c_str());
+		params.clear();
+		arena.release();
+		// A JSON-RPC notification (no id) gets no response
+		if (encoding == JSON_RPC && decoded && id.empty()) {
+			std::string header;
+			add_header(NO_CONTENT, 0, header, encoding);
+			return server_->send_response(header.data(), header.length(), nullptr, 0);
+		}
+		if (deferred) {
+			return 0;
+		}
+		// Convert to XML (or JSON) - a failed method returns a fault
+		if (cached) {
+			if (zc_app::debug(DEBUG_XMLRPC)) {
+				printf("My response: cached\n");
+			}
 		}
-		// Add header
-		std::stringstream resp;
-		add_header(OK, xml, resp);
-		// Send to server
-		return server_->send_response(resp);
+		else {
+			if (error == 0 && cache_key.length()) {
+				cache_response(method_name, cache_key, cache_version, response, encoding, id, body);
+			}
+			else {
+				generate_response(error != 0, &response, encoding, id, body);
+			}
+			if (zc_app::debug(DEBUG_XMLRPC)) {
+				std::string text = "My response:\n" + response.print_item();
+				printf("%s", text.c_str());
+			}
+		}
+		// Add header and send header and body to server as separate buffers
+		std::string header;
+		add_header(OK, body.length(), header, encoding);
+		return server_->send_response(header, body);
 	}
 	else {
 		// Not a post or not to the RPC server supported - send "bad request" back to client
-		std::stringstream error_response;
-		std::stringstream dummy;
-		dummy.str("");
-		add_header(BAD_REQUEST, dummy, error_response);
-		return server_->send_response(error_response);
-	}
-}
-
-// Check and parse HTML header - returns start of payload
-bool zc_rpc_handler::strip_header(std::stringstream& message, std::stringstream& payload) const {
-	message.seekg(0, std::ios::beg);
-	std::streampos start = message.tellg();
-	std::string line;
-	// First line - e.g. POST <resource>....
-	getline(message, line);
-	std::vector<std::string> words;
-	zc::split_line(line, words, ' ');
-	if (words[0] != "POST" || words[1] != resource_) {
+		std::string header;
+		add_header(BAD_REQUEST, 0, header);
+		return server_->send_response(header.data(), header.length(), nullptr, 0);
+	}
+}
+
+// Check and parse HTML header - payload receives the body as a view into message
+bool zc_rpc_handler::strip_header(std::string_view message, std::string_view& payload, rpc_encoding& encoding) const {
+	zc_http_parser parser;
+	if (parser.parse(message.data(), message.length()) != zc_http_parser::HTTP_OK ||
+		parser.method() != "POST" || parser.target() != resource_) {
 		return false;
 	}
+	payload = parser.body();
+	// application/json (with or without parameters) selects JSON-RPC - anything else is XML-RPC
+	const std::string_view json_type = "application/json";
+	std::string_view content_type = parser.field("Content-Type");
+	if (content_type.length() >= json_type.length() &&
+		zc_http_parser::equal_nocase(content_type.substr(0, json_type.length()), json_type) &&
+		(content_type.length() == json_type.length() || content_type[json_type.length()] == ';' ||
+			content_type[json_type.length()] == ' ')) {
+		encoding = JSON_RPC;
+	}
 	else {
-		// Find the payload length
-		while (zc::to_upper(words[0]) != "CONTENT-LENGTH:") {
-			getline(message, line);
-			zc::split_line(line, words, ' ');
-		}
-		// Now go on to the payload indicated by an empty line
-		while (line != "" && line != "\r") {
-			getline(message, line);
-		}
-		// Now copy payload to output stream
-		std::streampos pos_pl = message.tellg();
-		std::string s = message.str();
-		payload.str(s.substr((size_t)(pos_pl - start)));
-		return true;
+		encoding = XML_RPC;
 	}
+	return true;
 }
 
-// Add the apropriate header
-bool zc_rpc_handler::add_header(http_code code, std::stringstream& payload, std::stringstream& resp) {
-	std::string pl = payload.str();
-	int len_pl = pl.length();
+// Add the apropriate header - the payload is sent separately
+bool zc_rpc_handler::add_header(http_code code, size_t len_pl, std::string& header, rpc_encoding encoding) {
+	std::stringstream resp;
 	switch (code) {
 	case OK:
 		//  HTTP/1.1 200 OK
@@ -446,10 +585,15 @@ bool zc_rpc_handler::add_header(http_code code, std::stringstream& payload, std:
 		resp << "HTTP/1.1 " << code << " OK\r\n";
 		resp << "Date: " << zc::now(false, "%a %d %b %Y %X GMT") << "\r\n";
 		resp << "Server: " << APP_NAME << ". " << APP_VERSION << "\r\n";
-		resp << "Content-Type: text/xml\r\n";
+		resp << "Content-Type: " << (encoding == JSON_RPC ? "application/json" : "text/xml") << "\r\n";
 		resp << "Content-Length: " << len_pl << "\r\n";
 		resp << "\r\n";
-		resp << pl << "\r\n";
+		break;
+	case NO_CONTENT:
+		resp << "HTTP/1.1 " << code << " No Content\r\n";
+		resp << "Date: " << zc::now(false, "%a %d %b %Y %X GMT") << "\r\n";
+		resp << "Server: " << APP_NAME << ". " << APP_VERSION << "\r\n";
+		resp << "\r\n";
 		break;
 	case BAD_REQUEST:
 		resp << "HTTP/1.1 " << code << " BAD REQUEST\r\n";
@@ -459,55 +603,396 @@ bool zc_rpc_handler::add_header(http_code code, std::stringstream& payload, std:
 		resp << "\r\n";
 		break;
 	}
+	header = resp.str();
 	return true;
 }
 
 // Add server method
 void zc_rpc_handler::add_method(void* v, method_entry method, int(*callback)(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response)) {
-	method_list_[method.name] = { method.signature, method.help_text, v, callback };
+	add_method(std::move(method), [v, callback](zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response) {
+		return callback(v, params, response);
+	});
+}
+
+// Add server method - any callable
+void zc_rpc_handler::add_method(method_entry method, method_fn callback) {
+	method_def def;
+	def.name = std::move(method.name);
+	def.signature = std::move(method.signature);
+	def.help_text = std::move(method.help_text);
+	def.callback = std::move(callback);
+	method_list_.add(std::move(def));
+	// The method list and help have changed
+	invalidate_cache("system.listMethods");
+	invalidate_cache("system.methodHelp");
+}
+
+// Add server method that replies later
+void zc_rpc_handler::add_async_method(method_entry method, async_method_fn callback) {
+	method_def def;
+	def.name = std::move(method.name);
+	def.signature = std::move(method.signature);
+	def.help_text = std::move(method.help_text);
+	def.async_callback = std::move(callback);
+	method_list_.add(std::move(def));
+	// The method list and help have changed
+	invalidate_cache("system.listMethods");
+	invalidate_cache("system.methodHelp");
+}
+
+// Reply to the asynchronous call - only the first reply is sent
+void zc_rpc_handler::completion_token::reply(int error, zc_rpc_data_item& response) {
+	if (call_ && !call_->replied.exchange(true)) {
+		complete(*call_, error, response);
+	}
+}
+
+// Encode and send the response to an asynchronous call
+void zc_rpc_handler::complete(completion_token::call_t& call, int error, zc_rpc_data_item& response) {
+	call.replied = true;
+	std::string header;
+	std::string body;
+	std::shared_ptr<zc_socket_server> server;
+	{
+		std::lock_guard<std::mutex> lock(call.link->mutex);
+		zc_rpc_handler* that = call.link->handler;
+		// The server has closed, or the request was a notification (already answered)
+		if (that == nullptr || call.notification || !call.reply_to || !that->server_) return;
+		if (error && response.type() != XRT_STRUCT) {
+			that->generate_error(error, "Method " + call.method_name + " failed", response);
+		}
+		that->generate_response(error != 0, &response, call.encoding, call.id, body);
+		if (zc_app::debug(DEBUG_XMLRPC)) {
+			std::string text = "My deferred response:\n" + response.print_item();
+			printf("%s", text.c_str());
+		}
+		that->add_header(OK, body.length(), header, call.encoding);
+		server = that->server_;
+	}
+	// Send without the lock so that closing the server does not wait for a slow client
+	server->send_response_to(call.reply_to, header.data(), header.length(), body.data(), body.length());
+}
+
+// Cache the responses of a method
+bool zc_rpc_handler::cache_responses(const std::string& name, std::chrono::milliseconds ttl) {
+	std::lock_guard<std::mutex> lock(cache_mutex_);
+	method_def* def = method_list_.find(name);
+	if (def == nullptr) return false;
+	def->cache_ttl = ttl;
+	def->cache_version = ++cache_generation_;
+	return true;
+}
+
+// Discard the cached responses of a method - a new version makes them stale
+void zc_rpc_handler::invalidate_cache(const std::string& name) {
+	std::lock_guard<std::mutex> lock(cache_mutex_);
+	method_def* def = method_list_.find(name);
+	if (def) {
+		def->cache_version = ++cache_generation_;
+	}
+}
+
+// Look up a cached response
+bool zc_rpc_handler::cached_response(const method_def& def, const std::string& key, rpc_encoding encoding,
+	const std::string& id, std::string& body, uint64_t& version) {
+	std::lock_guard<std::mutex> lock(cache_mutex_);
+	version = def.cache_version;
+	auto it = response_cache_.find(key);
+	if (it == response_cache_.end()) return false;
+	cache_entry& entry = *it->second;
+	if (entry.version != def.cache_version ||
+		(def.cache_ttl.count() > 0 && std::chrono::steady_clock::now() >= entry.expiry)) {
+		// Stale
+		cache_lru_.erase(it->second);
+		response_cache_.erase(it);
+		return false;
+	}
+	// Most recently used
+	cache_lru_.splice(cache_lru_.begin(), cache_lru_, it->second);
+	const std::string& value = entry.value[encoding];
+	if (value.empty()) return false;
+	if (encoding == JSON_RPC) {
+		zc_rpc_json_codec::write_encoded_response(value, id, body);
+	}
+	else {
+		zc_rpc_codec::write_encoded_response(value, body);
+	}
+	return true;
+}
+
+// Encode the response value once, keep it and wrap it as the response
+void zc_rpc_handler::cache_response(const std::string& method_name, const std::string& key, uint64_t version,
+	zc_rpc_data_item& response, rpc_encoding encoding, const std::string& id, std::string& body) {
+	std::string value;
+	if (encoding == JSON_RPC) {
+		zc_rpc_json_codec::write_value(response, value);
+		zc_rpc_json_codec::write_encoded_response(value, id, body);
+	}
+	else {
+		zc_rpc_codec::write_value(response, value);
+		zc_rpc_codec::write_encoded_response(value, body);
+	}
+	std::lock_guard<std::mutex> lock(cache_mutex_);
+	// Look the method up again as the callback may have changed the table.
+	// If it was invalidated while the method ran do not keep the response
+	const method_def* def = method_list_.find(method_name);
+	if (def == nullptr || version != def->cache_version) return;
+	auto it = response_cache_.find(key);
+	if (it == response_cache_.end()) {
+		// Bound the memory used - drop the least recently used response
+		if (cache_lru_.size() >= MAX_CACHED_RESPONSES) {
+			response_cache_.erase(cache_lru_.back().key);
+			cache_lru_.pop_back();
+		}
+		cache_lru_.emplace_front();
+		it = response_cache_.emplace(key, cache_lru_.begin()).first;
+	}
+	else {
+		cache_lru_.splice(cache_lru_.begin(), cache_lru_, it->second);
+	}
+	cache_entry& entry = *it->second;
+	if ((entry.value[0].empty() && entry.value[1].empty()) || entry.version != version) {
+		// New or stale - start afresh
+		entry = cache_entry{};
+		entry.key = key;
+		entry.version = version;
+		entry.expiry = std::chrono::steady_clock::now() + def->cache_ttl;
+	}
+	entry.value[encoding] = std::move(value);
+}
+
+// FNV-1a hash of the method name
+static uint32_t hash_name(std::string_view name) {
+	uint32_t hash = 2166136261u;
+	for (char c : name) {
+		hash ^= (uint8_t)c;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+// Add or replace a method in the dispatch table
+void zc_rpc_handler::method_table::add(method_def&& def) {
+	def.hash = hash_name(def.name);
+	for (auto& existing : methods_) {
+		if (existing->hash == def.hash && existing->name == def.name) {
+			// The index points at the position, so only the definition changes
+			retired_.push_back(std::move(existing));
+			existing.reset(new method_def(std::move(def)));
+			return;
+		}
+	}
+	methods_.emplace_back(new method_def(std::move(def)));
+	// Keep the index no more than half full
+	if (methods_.size() * 2 > slots_.size()) {
+		rehash();
+	}
+	else {
+		size_t mask = slots_.size() - 1;
+		size_t ix = methods_.back()->hash & mask;
+		while (slots_[ix]) ix = (ix + 1) & mask;
+		slots_[ix] = (uint32_t)methods_.size();
+	}
+}
+
+// Rebuild the index - a power of two at least twice the number of methods
+void zc_rpc_handler::method_table::rehash() {
+	size_t size = 16;
+	while (size < methods_.size() * 2) size *= 2;
+	slots_.assign(size, 0);
+	size_t mask = size - 1;
+	for (size_t m = 0; m < methods_.size(); m++) {
+		size_t ix = methods_[m]->hash & mask;
+		while (slots_[ix]) ix = (ix + 1) & mask;
+		slots_[ix] = (uint32_t)(m + 1);
+	}
+}
+
+// Find the method - linear probe from the hashed slot
+const zc_rpc_handler::method_def* zc_rpc_handler::method_table::find(std::string_view name) const {
+	if (slots_.empty()) return nullptr;
+	uint32_t hash = hash_name(name);
+	size_t mask = slots_.size() - 1;
+	for (size_t ix = hash & mask; slots_[ix]; ix = (ix + 1) & mask) {
+		const method_def* def = methods_[slots_[ix] - 1].get();
+		if (def->hash == hash && def->name == name) return def;
+	}
+	return nullptr;
+}
+
+// Find the method to change it
+zc_rpc_handler::method_def* zc_rpc_handler::method_table::find(std::string_view name) {
+	return const_cast<method_def*>(static_cast<const method_table*>(this)->find(name));
+}
+
+// Remove all methods
+void zc_rpc_handler::method_table::clear() {
+	methods_.clear();
+	retired_.clear();
+	slots_.clear();
+}
+
+// Add the optional method to report server counters
+void zc_rpc_handler::add_metrics_method() {
+	add_method(this, { "system.serverMetrics", "S:", "Socket server throughput, load and latency counters" }, server_metrics);
 }
 
 // system.listMethods
 int zc_rpc_handler::list_methods(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response) {
 	zc_rpc_handler* that = (zc_rpc_handler*)v;
+	// In alphabetical order
+	std::vector<std::string> names;
+	for (auto& def : that->method_list_.methods()) {
+		names.push_back(def->name);
+	}
+	std::sort(names.begin(), names.end());
 	zc_rpc_data_item::rpc_array* array = new zc_rpc_data_item::rpc_array;
-	for (auto it = that->method_list_.begin(); it != that->method_list_.end(); it++) {
+	for (auto& method_name : names) {
 		zc_rpc_data_item* name = new zc_rpc_data_item;
-		name->set(it->first, XRT_STRING);
+		name->set(method_name, XRT_STRING);
 		array->push_back(name);
 	}
 	response.set(array);
 	return 0;
 }
 
+// system.multicall - params[0] is an array of {methodName, params} structs. Each
+// result is a one-element array holding the value or a {faultCode, faultString} struct
+int zc_rpc_handler::multicall(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response) {
+	zc_rpc_handler* that = (zc_rpc_handler*)v;
+	zc_rpc_data_item::rpc_array* calls = params.size() == 1 ? params.front()->get_array() : nullptr;
+	if (calls == nullptr) {
+		that->generate_error(FAULT_INVALID_PARAMS, "system.multicall expects an array of calls", response);
+		return 1;
+	}
+	zc_rpc_data_item::rpc_array* results = new zc_rpc_data_item::rpc_array;
+	results->reserve(calls->size());
+	response.set(results);
+	for (auto call : *calls) {
+		zc_rpc_data_item* result = new zc_rpc_data_item;
+		results->push_back(result);
+		// Find the method name and parameters
+		zc_rpc_data_item::rpc_struct* str = call->get_struct();
+		zc_rpc_data_item* name = nullptr;
+		zc_rpc_data_item::rpc_array* call_params = nullptr;
+		if (str) {
+			auto it = str->find("methodName");
+			if (it != str->end() && it->second->type() == XRT_STRING) name = it->second;
+			it = str->find("params");
+			if (it != str->end()) call_params = it->second->get_array();
+		}
+		if (name == nullptr || call_params == nullptr) {
+			that->generate_error(FAULT_INVALID_PARAMS, "Call must be a struct with methodName and params", *result);
+			continue;
+		}
+		std::string method_name = name->get_string();
+		if (method_name == "system.multicall") {
+			that->generate_error(FAULT_INVALID_PARAMS, "Recursive system.multicall not allowed", *result);
+			continue;
+		}
+		const method_def* meth = that->method_list_.find(method_name);
+		if (meth == nullptr) {
+			that->generate_error(FAULT_UNKNOWN_METHOD, "Unknown method " + method_name, *result);
+			continue;
+		}
+		if (meth->async_callback) {
+			that->generate_error(FAULT_INVALID_PARAMS, "Asynchronous method " + method_name + " not allowed in system.multicall", *result);
+			continue;
+		}
+		// The call's parameters still belong to the request
+		zc_rpc_data_item::rpc_list call_list(call_params->begin(), call_params->end());
+		zc_rpc_data_item* value = new zc_rpc_data_item;
+		int error = meth->callback(call_list, *value);
+		if (error) {
+			if (value->type() == XRT_STRUCT) {
+				*result = std::move(*value);
+			}
+			else {
+				that->generate_error(error, "Method " + method_name + " failed", *result);
+			}
+			delete value;
+		}
+		else {
+			zc_rpc_data_item::rpc_array* wrapper = new zc_rpc_data_item::rpc_array;
+			wrapper->push_back(value);
+			result->set(wrapper);
+		}
+	}
+	return 0;
+}
+
 // system.MethodHelp
 int zc_rpc_handler::method_help(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response) {
 	zc_rpc_handler* that = (zc_rpc_handler*)v;
 	if (params.size() == 1) {
 		zc_rpc_data_item* item_0 = params.front();
 		if (item_0->type() == XRT_STRING) {
-			std::string method_name = item_0->get_string();
-			if (that->method_list_.find(method_name) != that->method_list_.end()) {
-				std::string help_text = that->method_list_.at(method_name).help_text;
-				response.set(help_text, XRT_STRING);
+			const method_def* def = that->method_list_.find(item_0->get_string());
+			if (def) {
+				response.set(def->help_text, XRT_STRING);
 				return 0;
 			}
     	}
-		that->generate_error(-1, "Unknown method name", response);
+		that->generate_error(FAULT_UNKNOWN_METHOD, "Unknown method name", response);
 		return 1;
 	}
-	that->generate_error(-2, "Invalid number of paarmeters", response);
+	that->generate_error(FAULT_INVALID_PARAMS, "Invalid number of paarmeters", response);
 	return 1;
 }
 
+// system.serverMetrics - counters as doubles as they can exceed the range of i4
+int zc_rpc_handler::server_metrics(void* v, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response) {
+	zc_rpc_handler* that = (zc_rpc_handler*)v;
+	if (!that->server_) {
+		that->generate_error(-1, "No server running", response);
+		return 1;
+	}
+	zc_socket_server::metrics_t m = that->server_->metrics();
+	zc_rpc_data_item::rpc_struct* str = new zc_rpc_data_item::rpc_struct;
+	auto add_value = [str](const char* name, double value) {
+		zc_rpc_data_item* item = new zc_rpc_data_item;
+		item->set(value);
+		(*str)[name] = item;
+	};
+	add_value("elapsed", m.elapsed);
+	add_value("bytesIn", (double)m.bytes_in);
+	add_value("bytesOut", (double)m.bytes_out);
+	add_value("packetsIn", (double)m.packets_in);
+	add_value("packetsOut", (double)m.packets_out);
+	add_value("sendErrors", (double)m.send_errors);
+	add_value("accepts", (double)m.accepts);
+	add_value("acceptRate", m.accept_rate());
+	add_value("activeConnections", (double)m.active_connections);
+	add_value("queueDepth", (double)m.queue_depth);
+	add_value("maxQueueDepth", (double)m.max_queue_depth);
+	add_value("requests", (double)m.requests);
+	add_value("latencyP50", m.latency_percentile(0.5));
+	add_value("latencyP99", m.latency_percentile(0.99));
+	// Histogram - bucket n counts requests taking less than 2^n microseconds
+	zc_rpc_data_item::rpc_array* histogram = new zc_rpc_data_item::rpc_array;
+	for (int ix = 0; ix < zc_socket_server::NUM_LATENCY_BUCKETS; ix++) {
+		zc_rpc_data_item* bucket = new zc_rpc_data_item;
+		bucket->set((double)m.latency[ix]);
+		histogram->push_back(bucket);
+	}
+	zc_rpc_data_item* item = new zc_rpc_data_item;
+	item->set(histogram);
+	(*str)["latency"] = item;
+	response.set(str);
+	return 0;
+}
+
 // Generate an error item for RPC response
 void zc_rpc_handler::generate_error(int code, std::string message, zc_rpc_data_item & response) {
-	zc_rpc_data_item error_code;
-	error_code.set(-2, XRT_INT);
-	zc_rpc_data_item error_msg;
-	error_msg.set("Incorrect number of parameters", XRT_STRING);
-	zc_rpc_data_item::rpc_struct fault_resp = { { "code", &error_code }, { "message", &error_msg } };
-	response.set(&fault_resp);
+	// The response owns (and will delete) the members
+	zc_rpc_data_item* error_code = new zc_rpc_data_item;
+	error_code->set(code, XRT_INT);
+	zc_rpc_data_item* error_msg = new zc_rpc_data_item;
+	error_msg->set(message, XRT_STRING);
+	zc_rpc_data_item::rpc_struct* fault_resp = new zc_rpc_data_item::rpc_struct;
+	(*fault_resp)["faultCode"] = error_code;
+	(*fault_resp)["faultString"] = error_msg;
+	response.set(fault_resp);
 }
 
 // Returns the state of the server
@@ -0,0 +1,353 @@
+/*
+	Copyright 2026, Philip Rose, GM3ZZA
+
+	This file is part of ZZACOMMON.
+
+	ZZACOMMON is free software: you can redistribute it and/or modify it under the
+	terms of the Lesser GNU General Public License as published by the Free Software
+	Foundation, either version 3 of the License, or (at your option) any later version.
+
+	ZZACOMMON is distributed in the hope that it will be useful, but WITHOUT ANY WARRANTY;
+	without even the implied warranty of MERCHANTABILITY or FITNESS FOR A PARTICULAR
+	PURPOSE. See the GNU General Public License for more details.
+
+	You should have received a copy of the GNU General Public License along with ZZACOMMON.
+	If not, see <https://www.gnu.org/licenses/>.
+
+*/
+#include "zc_rpc_json_codec.h"
+
+#include "zc_utils.h"
+
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <vector>
+
+#include <nlohmann/json.hpp>
+
+using json = nlohmann::json;
+
+//! JSON-RPC error code used when a fault struct has no faultCode ("server error").
+const int DEFAULT_ERROR_CODE = -32000;
+
+//! \brief SAX handler that builds the zc_rpc_data_item tree as nlohmann::json parses.
+//!
+//! This avoids building a json document and then converting it. All the items
+//! are created in the arena.
+class item_builder : public nlohmann::json_sax<json>
+{
+public:
+	item_builder(zc_rpc_arena& arena) : arena_(arena), root_(arena.new_item()) {}
+
+	//! The top-level value.
+	zc_rpc_data_item* root() const { return root_; }
+
+	bool null() override { return next_item() != nullptr; }
+	bool boolean(bool val) override { next_item()->set(val ? 1 : 0, XRT_BOOLEAN); return true; }
+	bool number_integer(number_integer_t val) override {
+		// XML-RPC integers are 32 bits - larger values travel as double
+		if (val >= std::numeric_limits<int32_t>::min() && val <= std::numeric_limits<int32_t>::max()) {
+			next_item()->set((int32_t)val, XRT_INT);
+		}
+		else {
+			next_item()->set((double)val);
+		}
+		return true;
+	}
+	bool number_unsigned(number_unsigned_t val) override {
+		if (val <= (number_unsigned_t)std::numeric_limits<int32_t>::max()) {
+			next_item()->set((int32_t)val, XRT_INT);
+		}
+		else {
+			next_item()->set((double)val);
+		}
+		return true;
+	}
+	bool number_float(number_float_t val, const string_t&) override { next_item()->set(val); return true; }
+	bool string(string_t& val) override { next_item()->set(std::move(val), XRT_STRING); return true; }
+	bool binary(binary_t&) override { return false; }
+	bool start_object(std::size_t) override {
+		zc_rpc_data_item* item = next_item();
+		item->set(arena_.new_struct());
+		stack_.push_back(item);
+		return true;
+	}
+	bool key(string_t& val) override { key_ = std::move(val); return true; }
+	bool end_object() override { stack_.pop_back(); return true; }
+	bool start_array(std::size_t) override {
+		zc_rpc_data_item* item = next_item();
+		item->set(arena_.new_array());
+		stack_.push_back(item);
+		return true;
+	}
+	bool end_array() override { stack_.pop_back(); return true; }
+	bool parse_error(std::size_t, const std::string&, const nlohmann::detail::exception&) override { return false; }
+
+protected:
+	//! Returns the item for the next value - the root or a new member of the open array or struct.
+	zc_rpc_data_item* next_item() {
+		if (stack_.empty()) return root_;
+		zc_rpc_data_item* item = arena_.new_item();
+		zc_rpc_data_item* container = stack_.back();
+		if (container->type() == XRT_ARRAY) {
+			container->get_array()->push_back(item);
+		}
+		else {
+			(*container->get_struct())[key_] = item;
+		}
+		return item;
+	}
+
+	zc_rpc_arena& arena_;                       //!< Where the items are created
+	zc_rpc_data_item* root_;                    //!< The top-level value
+	std::vector<zc_rpc_data_item*> stack_;      //!< The open arrays and structs
+	std::string key_;                           //!< Name of the next struct member
+};
+
+// Parse the message into arena - returns the top-level struct or nullptr if it is not a valid JSON object
+static zc_rpc_data_item::rpc_struct* parse_message(const char* text, size_t length, zc_rpc_arena& arena)
+{
+	item_builder builder(arena);
+	if (!json::sax_parse(text, text + length, &builder)) return nullptr;
+	return builder.root()->get_struct();
+}
+
+// Returns the member called name, or nullptr
+static zc_rpc_data_item* member(zc_rpc_data_item::rpc_struct* str, const char* name)
+{
+	auto it = str->find(name);
+	return it == str->end() ? nullptr : it->second;
+}
+
+// Give the item from the work arena to target - copying it onto the heap if there is no arena
+static zc_rpc_data_item* adopt(zc_rpc_data_item* item, zc_rpc_arena* arena)
+{
+	return arena ? item : new zc_rpc_data_item(*item);
+}
+
+// Append string s as a JSON string
+static void write_string(const std::string& s, std::string& text)
+{
+	static const char hex[] = "0123456789abcdef";
+	text += '"';
+	size_t start = 0;
+	for (size_t ix = 0; ix < s.length(); ix++) {
+		unsigned char c = (unsigned char)s[ix];
+		if (c >= 0x20 && c != '"' && c != '\\') continue;
+		text.append(s, start, ix - start);
+		switch (c) {
+		case '"': text += "\\\""; break;
+		case '\\': text += "\\\\"; break;
+		case '\n': text += "\\n"; break;
+		case '\r': text += "\\r"; break;
+		case '\t': text += "\\t"; break;
+		default:
+			text += "\\u00";
+			text += hex[c >> 4];
+			text += hex[c & 0xF];
+			break;
+		}
+		start = ix + 1;
+	}
+	text.append(s, start, std::string::npos);
+	text += '"';
+}
+
+// {"jsonrpc":"2.0","method":...,"params":[...],"id":...}
+void zc_rpc_json_codec::write_request(const std::string& method_name, zc_rpc_data_item::rpc_list* params,
+	const std::string& id, std::string& text)
+{
+	text += "{\"jsonrpc\":\"2.0\",\"method\":";
+	write_string(method_name, text);
+	text += ",\"params\":[";
+	if (params) {
+		bool first = true;
+		for (auto param : *params) {
+			if (!first) text += ',';
+			write_value(*param, text);
+			first = false;
+		}
+	}
+	text += ']';
+	if (id.length()) {
+		text += ",\"id\":";
+		text += id;
+	}
+	text += "}\n";
+}
+
+// {"jsonrpc":"2.0","result":...,"id":...} or {"jsonrpc":"2.0","error":{"code":...,"message":...},"id":...}
+void zc_rpc_json_codec::write_response(bool fault, zc_rpc_data_item* response, const std::string& id, std::string& text)
+{
+	text += "{\"jsonrpc\":\"2.0\",";
+	if (fault) {
+		int code = DEFAULT_ERROR_CODE;
+		std::string message;
+		zc_rpc_data_item::rpc_struct* str = response->get_struct();
+		if (str) {
+			zc_rpc_data_item* item = member(str, "faultCode");
+			if (item) code = item->get_int();
+			item = member(str, "faultString");
+			if (item) message = item->get_string();
+		}
+		text += "\"error\":{\"code\":";
+		text += std::to_string(code);
+		text += ",\"message\":";
+		write_string(message, text);
+		text += '}';
+	}
+	else {
+		text += "\"result\":";
+		write_value(*response, text);
+	}
+	text += ",\"id\":";
+	text += id.length() ? id : "null";
+	text += "}\n";
+}
+
+// {"jsonrpc":"2.0","result":...,"id":...} with the result already encoded
+void zc_rpc_json_codec::write_encoded_response(std::string_view value, const std::string& id, std::string& text)
+{
+	text += "{\"jsonrpc\":\"2.0\",\"result\":";
+	text += value;
+	text += ",\"id\":";
+	text += id.length() ? id : "null";
+	text += "}\n";
+}
+
+// JSON value
+void zc_rpc_json_codec::write_value(zc_rpc_data_item& item, std::string& text)
+{
+	switch (item.type()) {
+	case XRT_INT: {
+		char buffer[16];
+		auto result = std::to_chars(buffer, buffer + sizeof(buffer), item.get_int());
+		text.append(buffer, result.ptr);
+		break;
+	}
+	case XRT_BOOLEAN:
+		text += item.get_int() ? "true" : "false";
+		break;
+	case XRT_DOUBLE: {
+		double d = item.get_double();
+		if (!std::isfinite(d)) {
+			// JSON has no infinity or NaN
+			text += "null";
+			break;
+		}
+		// Enough digits to read back the same value - and always look like a float
+		char buffer[32];
+		int len = snprintf(buffer, sizeof(buffer), "%.17g", d);
+		text.append(buffer, len);
+		if (strpbrk(buffer, ".e") == nullptr) text += ".0";
+		break;
+	}
+	case XRT_STRING:
+	case XRT_DEFAULT:
+	case XRT_DATETIME:
+		write_string(item.get_string(), text);
+		break;
+	case XRT_BYTES: {
+		// JSON strings must be text - binary goes as base64, which needs no escaping
+		const std::string& s = item.get_string();
+		text += '"';
+		zc::encode_base_64(s.data(), s.length(), text);
+		text += '"';
+		break;
+	}
+	case XRT_ARRAY: {
+		text += '[';
+		bool first = true;
+		for (auto datum : *item.get_array()) {
+			if (!first) text += ',';
+			write_value(*datum, text);
+			first = false;
+		}
+		text += ']';
+		break;
+	}
+	case XRT_STRUCT: {
+		text += '{';
+		bool first = true;
+		for (auto& member : *item.get_struct()) {
+			if (!first) text += ',';
+			write_string(member.first, text);
+			text += ':';
+			write_value(*member.second, text);
+			first = false;
+		}
+		text += '}';
+		break;
+	}
+	default:
+		text += "null";
+		break;
+	}
+}
+
+// Decode a request
+bool zc_rpc_json_codec::read_request(const char* text, size_t length, std::string& method_name,
+	zc_rpc_data_item::rpc_list* params, std::string& id, zc_rpc_arena* arena)
+{
+	zc_rpc_arena work;
+	zc_rpc_data_item::rpc_struct* message = parse_message(text, length, arena ? *arena : work);
+	if (!message) return false;
+	zc_rpc_data_item* version = member(message, "jsonrpc");
+	zc_rpc_data_item* method = member(message, "method");
+	if (!version || version->type() != XRT_STRING || version->get_string() != "2.0" ||
+		!method || method->type() != XRT_STRING) return false;
+	method_name = method->get_string();
+	zc_rpc_data_item* ident = member(message, "id");
+	id.clear();
+	if (ident) write_value(*ident, id);
+	zc_rpc_data_item* values = member(message, "params");
+	if (values == nullptr) return true;
+	if (values->type() == XRT_ARRAY) {
+		for (auto value : *values->get_array()) {
+			params->push_back(adopt(value, arena));
+		}
+		return true;
+	}
+	else if (values->type() == XRT_STRUCT) {
+		// Named parameters
+		params->push_back(adopt(values, arena));
+		return true;
+	}
+	return false;
+}
+
+// Decode a response
+bool zc_rpc_json_codec::read_response(const char* text, size_t length, zc_rpc_data_item* response, bool& fault,
+	zc_rpc_arena* arena)
+{
+	zc_rpc_arena work;
+	zc_rpc_data_item::rpc_struct* message = parse_message(text, length, arena ? *arena : work);
+	if (!message) return false;
+	zc_rpc_data_item* error = member(message, "error");
+	if (error && error->type() != XRT_EMPTY) {
+		// Return the error as the XML-RPC fault struct
+		fault = true;
+		zc_rpc_data_item::rpc_struct* str = error->get_struct();
+		if (!str) return false;
+		zc_rpc_data_item* code = member(str, "code");
+		zc_rpc_data_item* reason = member(str, "message");
+		zc_rpc_data_item::rpc_struct* fault_str = arena ? arena->new_struct() : new zc_rpc_data_item::rpc_struct;
+		response->set(fault_str);
+		zc_rpc_data_item* fault_code = arena ? arena->new_item() : new zc_rpc_data_item;
+		(*fault_str)["faultCode"] = fault_code;
+		fault_code->set(code && code->type() == XRT_INT ? code->get_int() : DEFAULT_ERROR_CODE, XRT_INT);
+		zc_rpc_data_item* fault_string = arena ? arena->new_item() : new zc_rpc_data_item;
+		(*fault_str)["faultString"] = fault_string;
+		fault_string->set(reason && reason->type() == XRT_STRING ? reason->get_string() : std::string(), XRT_STRING);
+		return true;
+	}
+	zc_rpc_data_item* result = member(message, "result");
+	if (result == nullptr) return false;
+	fault = false;
+	*response = std::move(*result);
+	return true;
+}
@@ -17,48 +17,114 @@
 */
 #include "zc_serial.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
 #include <set>
 #include <string>
+#include <vector>
+
+#ifdef __linux__
+#include <filesystem>
+#include <fstream>
+#include <sys/inotify.h>
+#include <unistd.h>
+#endif
 
 //! Include boost asio for cross-platform serial port access.
 #include <boost/asio.hpp>
 
-// Constructor for zc_serial.
-zc_serial::zc_serial(const std::string& port, int baud_rate) {
-	try {
-		boost::asio::io_service io;
-		serial_port_ = new boost::asio::serial_port(io, port);
-		serial_port_->set_option(boost::asio::serial_port_base::baud_rate(baud_rate));
+// The port and what the asynchronous operations on it use
+struct zc_serial::port_state
+{
+	//! A queued asynchronous write
+	struct pending_write {
+		std::string data;                                   //!< The data to send
+		write_fn handler;                                   //!< Called when it has been sent
+		std::chrono::milliseconds timeout;                  //!< Time allowed to send it
+	};
+
+	port_state(boost::asio::io_context& io)
+		: serial_port(io)
+		, read_timer(io)
+		, write_timer(io)
+	{
 	}
-	catch (boost::system::system_error& e) {
-		if (serial_port_) {
-			delete serial_port_;
-			serial_port_ = nullptr;
-		}
+
+	//! Cancel the read and write in progress.
+	void cancel() {
+		boost::system::error_code ec;
+		serial_port.cancel(ec);
 	}
+
+	boost::asio::serial_port serial_port;       //!< The port
+	std::string read_buffer;                    //!< Data received after the end of the last line
+	boost::asio::steady_timer read_timer;       //!< Times out the read in progress
+	boost::asio::steady_timer write_timer;      //!< Times out the write in progress
+	unsigned int read_count = 0;                //!< Counts the reads - so a late timeout does not cancel the next one
+	unsigned int write_count = 0;               //!< Counts the writes - so a late timeout does not cancel the next one
+	std::deque<pending_write> writes;           //!< Writes waiting to be sent - the front one is being sent
+	bool closed = false;                        //!< The zc_serial has been destroyed - handlers are not called
+};
+
+// Constructor for zc_serial.
+zc_serial::zc_serial(const std::string& port, int baud_rate)
+	: own_io_(new boost::asio::io_context)
+	, io_(*own_io_)
+	, state_(std::make_shared<port_state>(io_))
+{
+	open(port, baud_rate);
+}
+
+// Constructor for zc_serial using a shared io_context.
+zc_serial::zc_serial(boost::asio::io_context& io, const std::string& port, int baud_rate)
+	: io_(io)
+	, state_(std::make_shared<port_state>(io_))
+{
+	open(port, baud_rate);
 }
 
 // Destructor for zc_serial. It closes the serial connection.
 zc_serial::~zc_serial() {
-	if (serial_port_) {
-		try {
-			serial_port_->close();
-		}
-		catch (boost::system::system_error& e) {
-			// Ignore errors on close.
-		}
-		delete serial_port_;
+	// The handlers still to run keep the state but do not call back
+	state_->closed = true;
+	state_->read_timer.cancel();
+	state_->write_timer.cancel();
+	// Ignore errors on close.
+	boost::system::error_code ec;
+	state_->serial_port.close(ec);
+}
+
+// Open the port and set its baud rate.
+void zc_serial::open(const std::string& port, int baud_rate) {
+	try {
+		state_->serial_port.open(port);
+		state_->serial_port.set_option(boost::asio::serial_port_base::baud_rate(baud_rate));
+	}
+	catch (boost::system::system_error& e) {
+		boost::system::error_code ec;
+		state_->serial_port.close(ec);
 	}
 }
 
+// Check if the serial port is open.
+bool zc_serial::is_connected() const {
+	return state_->serial_port.is_open();
+}
+
 // Read a line of text from the serial port.
 bool zc_serial::read_line(std::string& line) {
-	if (!serial_port_ || !serial_port_->is_open()) {
+	if (!state_->serial_port.is_open()) {
 		return false;
 	}
 	try {
-		boost::asio::read_until(*serial_port_, boost::asio::dynamic_buffer(line), "\n");
+		// Anything read after the end of the line is kept for the next read
+		size_t length = boost::asio::read_until(state_->serial_port, boost::asio::dynamic_buffer(state_->read_buffer), "\n");
+		line.append(state_->read_buffer, 0, length);
+		state_->read_buffer.erase(0, length);
 		return true;
 	}
 	catch (boost::system::system_error& e) {
@@ -68,12 +134,18 @@ bool zc_serial::read_line(std::string& line) {
 
 // Read whatever data is currently available on the serial port without blocking.
 bool zc_serial::read_any(std::string& data) {
-	if (!serial_port_ || !serial_port_->is_open()) {
+	if (!state_->serial_port.is_open()) {
 		return false;
 	}
+	if (state_->read_buffer.length()) {
+		// Left over from reading a line
+		data += state_->read_buffer;
+		state_->read_buffer.clear();
+		return true;
+	}
 	try {
 		char buf[1024];
-		size_t bytes_read = serial_port_->read_some(boost::asio::buffer(buf));
+		size_t bytes_read = state_->serial_port.read_some(boost::asio::buffer(buf));
 		if (bytes_read > 0) {
 			data.append(buf, bytes_read);
 			return true;
@@ -89,11 +161,11 @@ bool zc_serial::read_any(std::string& data) {
 
 // Write a line of text to the serial port.
 bool zc_serial::write_line(const std::string& line) {
-	if (!serial_port_ || !serial_port_->is_open()) {
+	if (!state_->serial_port.is_open()) {
 		return false;
 	}
 	try {
-		boost::asio::write(*serial_port_, boost::asio::buffer(line + "\n"));
+		boost::asio::write(state_->serial_port, boost::asio::buffer(line + "\n"));
 		return true;
 	}
 	catch (boost::system::system_error& e) {
@@ -101,69 +173,243 @@ bool zc_serial::write_line(const std::string& line) {
 	}
 }
 
-// Find all existing COM ports - upto COM255
-// Returns true if the string array was large enough for all ports.
-bool zc_serial::available_ports(int num_ports, std::string* ports, bool all_ports, int& actual_ports) {
-	actual_ports = 0;
-	const unsigned int MAX_TTY = 255;
+// Start reading a line - the handler is called when it arrives, fails or times out.
+void zc_serial::async_read_line(read_fn handler, std::chrono::milliseconds timeout, char delimiter) {
+	// The handlers hold the state so that it outlives this
+	std::shared_ptr<port_state> s = state_;
+	if (!s->serial_port.is_open()) {
+		boost::asio::post(io_, [s, handler]() {
+			if (!s->closed) handler(false, std::string());
+		});
+		return;
+	}
+	unsigned int count = ++s->read_count;
+	if (timeout.count() > 0) {
+		s->read_timer.expires_after(timeout);
+		s->read_timer.async_wait([s, count](const boost::system::error_code& ec) {
+			// Only if this read is still in progress
+			if (!ec && count == s->read_count) s->cancel();
+		});
+	}
+	boost::asio::async_read_until(s->serial_port, boost::asio::dynamic_buffer(s->read_buffer), delimiter,
+		[s, handler](const boost::system::error_code& ec, size_t length) {
+			if (s->closed) return;
+			// Stop the timer cancelling the next read
+			++s->read_count;
+			s->read_timer.cancel();
+			if (ec) {
+				handler(false, std::string());
+				return;
+			}
+			// Anything read after the end of the line is kept for the next read
+			std::string line = s->read_buffer.substr(0, length - 1);
+			s->read_buffer.erase(0, length);
+			handler(true, line);
+		});
+}
 
-	// Try and open each port to see if it exists and is available for use.
-	for (unsigned int i = 0; i < MAX_TTY; i++) {
-		std::string port_name;
-		// Windows uses COM1, COM2, etc. Linux uses /dev/ttyS0, /dev/ttyUSB0, etc.
+// Queue the data to be written - start writing it if nothing else is.
+void zc_serial::async_write(const std::string& data, write_fn handler, std::chrono::milliseconds timeout) {
+	state_->writes.push_back({ data, handler, timeout });
+	if (state_->writes.size() == 1) {
+		start_write(state_);
+	}
+}
+
+// Send the write at the front of the queue.
+void zc_serial::start_write(const std::shared_ptr<port_state>& s) {
+	if (!s->serial_port.is_open()) {
+		boost::asio::post(s->write_timer.get_executor(), [s]() { finish_write(s, false); });
+		return;
+	}
+	port_state::pending_write& write = s->writes.front();
+	unsigned int count = ++s->write_count;
+	if (write.timeout.count() > 0) {
+		s->write_timer.expires_after(write.timeout);
+		s->write_timer.async_wait([s, count](const boost::system::error_code& ec) {
+			// Only if this write is still in progress
+			if (!ec && count == s->write_count) s->cancel();
+		});
+	}
+	boost::asio::async_write(s->serial_port, boost::asio::buffer(write.data),
+		[s](const boost::system::error_code& ec, size_t) {
+			finish_write(s, !ec);
+		});
+}
+
+// Tell the caller the write has finished and start the next one.
+void zc_serial::finish_write(const std::shared_ptr<port_state>& s, bool ok) {
+	if (s->closed) return;
+	// Stop the timer cancelling the next write
+	++s->write_count;
+	s->write_timer.cancel();
+	port_state::pending_write write = std::move(s->writes.front());
+	s->writes.pop_front();
+	if (s->writes.size()) {
+		start_write(s);
+	}
+	if (write.handler) {
+		write.handler(ok);
+	}
+}
+
+// Cancel the read and write in progress.
+void zc_serial::cancel() {
+	state_->cancel();
+}
+
+#ifdef __linux__
+// Read the first line of a sysfs attribute - empty if there is none
+static std::string sysfs_attribute(const std::filesystem::path& dir, const char* name) {
+	std::ifstream is(dir / name);
+	std::string value;
+	std::getline(is, value);
+	return value;
+}
+
+// Find the serial ports from sysfs - the ttys that have a device behind them
+static void scan_ports(std::vector<zc_serial::port_info>& ports) {
+	std::error_code ec;
+	for (auto& entry : std::filesystem::directory_iterator("/sys/class/tty", ec)) {
+		// Virtual consoles and pseudo-terminals have no device
+		std::filesystem::path device = std::filesystem::canonical(entry.path() / "device", ec);
+		if (ec) continue;
+		// The 8250 driver registers ports that have no UART - their type is unknown (0)
+		if (sysfs_attribute(entry.path(), "type") == "0") continue;
+		zc_serial::port_info info;
+		info.name = "/dev/" + entry.path().filename().string();
+		info.available = access(info.name.c_str(), R_OK | W_OK) == 0;
+		// The USB device is the nearest parent with a vendor ID - the port is on one of its interfaces
+		std::filesystem::path dir = device;
+		for (int level = 0; level < 4 && dir.has_relative_path(); level++, dir = dir.parent_path()) {
+			std::string vid = sysfs_attribute(dir, "idVendor");
+			if (vid.length()) {
+				info.vid = (uint16_t)strtoul(vid.c_str(), nullptr, 16);
+				info.pid = (uint16_t)strtoul(sysfs_attribute(dir, "idProduct").c_str(), nullptr, 16);
+				info.serial_number = sysfs_attribute(dir, "serial");
+				info.manufacturer = sysfs_attribute(dir, "manufacturer");
+				info.product = sysfs_attribute(dir, "product");
+				break;
+			}
+		}
+		ports.push_back(info);
+	}
+}
+
+// Returns true if a tty may have been added to or removed from /dev since the last call
+static bool ports_changed() {
+	// Watch /dev - sysfs does not report changes
+	static int fd = -1;
+	static bool watching = false;
+	if (!watching) {
+		fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (fd >= 0 && inotify_add_watch(fd, "/dev", IN_CREATE | IN_DELETE | IN_ATTRIB | IN_MOVED_FROM | IN_MOVED_TO) < 0) {
+			close(fd);
+			fd = -1;
+		}
+		watching = true;
+		return true;
+	}
+	// Without the watch we cannot tell
+	if (fd < 0) return true;
+	bool changed = false;
+	alignas(struct inotify_event) char buffer[4096];
+	ssize_t length;
+	while ((length = read(fd, buffer, sizeof(buffer))) > 0) {
+		for (char* ptr = buffer; ptr < buffer + length; ) {
+			struct inotify_event* event = (struct inotify_event*)ptr;
+			if ((event->mask & IN_Q_OVERFLOW) || (event->len && strncmp(event->name, "tty", 3) == 0)) {
+				changed = true;
+			}
+			ptr += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	return changed;
+}
+#else
+// Find all existing COM ports - upto COM255 - by trying to open each of them
+static void scan_ports(std::vector<zc_serial::port_info>& ports) {
+	const unsigned int MAX_TTY = 255;
+	// Windows uses COM1, COM2, etc. Others use /dev/ttyS0, /dev/ttyUSB0, etc.
 #ifdef _WIN32
-		std::set<std::string> port_prefixes = { "COM" };
+	const std::vector<std::string> port_prefixes = { "COM" };
 #else
-		std::set<std::string> port_prefixes = { "/dev/ttyS", "/dev/ttyUSB", "/dev/ttyACM" };
+	const std::vector<std::string> port_prefixes = { "/dev/ttyS", "/dev/ttyUSB", "/dev/ttyACM" };
 #endif
+	boost::asio::io_context io;
+	for (unsigned int i = 0; i < MAX_TTY; i++) {
 		for (auto& prefix : port_prefixes) {
-			port_name = prefix + std::to_string(i);
+			zc_serial::port_info info;
+			info.name = prefix + std::to_string(i);
 			try {
-				boost::asio::io_service io;
-				boost::asio::serial_port serial(io, port_name);
+				boost::asio::serial_port serial(io, info.name);
 				// If we got here, the port exists and is available for use.
-				if (actual_ports < num_ports) {
-					ports[actual_ports] = port_name;
-				}
-				actual_ports++;
+				info.available = true;
+				ports.push_back(info);
 			}
 			catch (boost::system::system_error& e) {
 				// If the error is "file not found", the port doesn't exist. If it's "access denied", the port exists but is in use.
-				if (e.code() == boost::system::errc::no_such_file_or_directory) {
-					// Port doesn't exist - do nothing.
-				}
-				else if (e.code() == boost::system::errc::permission_denied && all_ports) {
-					// Port exists but is in use - include it if we're including all ports.
-					if (actual_ports < num_ports) {
-						ports[actual_ports] = port_name;
-					}
-					actual_ports++;
+				if (e.code() == boost::system::errc::permission_denied) {
+					ports.push_back(info);
 				}
 			}
 		}
 	}
+}
 
-	return (actual_ports <= num_ports);
+// There is no notice of ports being added or removed, so look every time
+static bool ports_changed() {
+	return true;
+}
+#endif
 
+// Order port names by prefix and then number, so that COM10 comes after COM9
+static bool port_order(const zc_serial::port_info& lhs, const zc_serial::port_info& rhs) {
+	size_t lhs_digits = lhs.name.find_last_not_of("0123456789") + 1;
+	size_t rhs_digits = rhs.name.find_last_not_of("0123456789") + 1;
+	int compare = lhs.name.compare(0, lhs_digits, rhs.name, 0, rhs_digits);
+	if (compare != 0) return compare < 0;
+	if (lhs.name.length() - lhs_digits != rhs.name.length() - rhs_digits) {
+		return lhs.name.length() - lhs_digits < rhs.name.length() - rhs_digits;
+	}
+	return lhs.name < rhs.name;
+}
+
+// Describe the ports - from the last scan unless they may have changed
+std::vector<zc_serial::port_info> zc_serial::port_details(bool all_ports) {
+	static std::mutex lock;
+	static std::vector<port_info> ports;
+	std::vector<port_info> result;
+	std::lock_guard<std::mutex> guard(lock);
+	if (ports_changed()) {
+		ports.clear();
+		scan_ports(ports);
+		std::sort(ports.begin(), ports.end(), port_order);
+	}
+	for (auto& port : ports) {
+		if (all_ports || port.available) {
+			result.push_back(port);
+		}
+	}
+	return result;
+}
+
+// Copy the port names into the array.
+// Returns true if the string array was large enough for all ports.
+bool zc_serial::available_ports(int num_ports, std::string* ports, bool all_ports, int& actual_ports) {
+	std::vector<port_info> details = port_details(all_ports);
+	actual_ports = (int)details.size();
+	for (int i = 0; i < actual_ports && i < num_ports; i++) {
+		ports[i] = details[i].name;
+	}
+	return (actual_ports <= num_ports);
 }
 
 // As available_ports but returns a set of strings instead of an array.
 std::set<std::string> zc_serial::available_ports(bool all_ports) {
 	std::set<std::string> ports;
-	int actual_ports = 0;
-	// First call available_ports to get the number of ports, then call it again with an array of the correct size to get the port names.
-	available_ports(0, nullptr, all_ports, actual_ports);
-	if (actual_ports > 0) {
-		std::string* port_array = new std::string[actual_ports];
-		if (available_ports(actual_ports, port_array, all_ports, actual_ports)) {
-			for (int i = 0; i < actual_ports; i++) {
-				ports.insert(port_array[i]);
-			}
-		}
-		delete[] port_array;
+	for (auto& port : port_details(all_ports)) {
+		ports.insert(port.name);
 	}
 	return ports;
 }
-
-
-
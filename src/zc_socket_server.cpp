@@ -26,8 +26,11 @@
 #ifdef _WIN32
 #include <WS2tcpip.h>
 #else
+#include <errno.h>
 #include <fcntl.h>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -43,35 +46,168 @@
 #include <cstdio>
 #include <thread>
 #include <istream>
+#include <iterator>
 
 #ifdef _WIN32
 #define LEN_SOCKET_ADDR int
+#define POLLFD WSAPOLLFD
+#define POLL WSAPoll
 #else
-#define LEN_SOCKET_ADDR unsigned int
+#define LEN_SOCKET_ADDR socklen_t
+#define POLLFD pollfd
+#define POLL poll
 #endif
 
 extern debug_flag DEBUG_THREADS;
 extern debug_flag DEBUG_SOCKET;
 
+// Maximum time to wait for a blocked socket to accept more response data (ms)
+const int SEND_TIMEOUT = 5000;
+// Maximum time a listener waits for activity before checking for close (ms)
+const int POLL_INTERVAL = 100;
+// Size of receive buffer
+const int MAX_SOCKET = 10240;
+
+// Returns true if the last socket operation failed only because it would block
+static bool would_block()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEWOULDBLOCK;
+#else
+	return errno == EAGAIN || errno == EWOULDBLOCK;
+#endif
+}
+
+// Returns true if the last socket operation was interrupted and should be retried
+static bool interrupted()
+{
+#ifdef _WIN32
+	return WSAGetLastError() == WSAEINTR;
+#else
+	return errno == EINTR;
+#endif
+}
+
+// Put the socket into non-blocking mode
+static bool set_nonblocking(SOCKET s)
+{
+#ifdef _WIN32
+	unsigned long nonblocking = 1;
+	return ioctlsocket(s, FIONBIO, &nonblocking) == 0;
+#else
+	int flags = fcntl(s, F_GETFL, 0);
+	return flags >= 0 && fcntl(s, F_SETFL, flags | O_NONBLOCK) == 0;
+#endif
+}
+
+// Close the socket
+static void close_socket(SOCKET s)
+{
+#ifdef _WIN32
+	closesocket(s);
+#else
+	shutdown(s, 2);
+	close(s);
+#endif
+}
+
+// Length of the address held in the storage
+static LEN_SOCKET_ADDR address_length(const sockaddr_storage& addr)
+{
+	return addr.ss_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+}
+
+// Returns true if the address is a multicast group (224.0.0.0/4 or ff00::/8)
+static bool multicast_address(const sockaddr* addr)
+{
+	if (addr->sa_family == AF_INET6)
+	{
+		return ((const sockaddr_in6*)addr)->sin6_addr.s6_addr[0] == 0xFF;
+	}
+	else
+	{
+		return (ntohl(((const sockaddr_in*)addr)->sin_addr.s_addr) & 0xF0000000) == 0xE0000000;
+	}
+}
+
+// Returns true if the address is the IPv6 wildcard "::"
+static bool ipv6_any(const sockaddr* addr)
+{
+	if (addr->sa_family != AF_INET6) return false;
+	const unsigned char* b = ((const sockaddr_in6*)addr)->sin6_addr.s6_addr;
+	for (int ix = 0; ix < 16; ix++)
+	{
+		if (b[ix]) return false;
+	}
+	return true;
+}
+
+// Connection closes its socket once neither the listener nor a response needs it
+zc_socket_server::connection_t::~connection_t()
+{
+	close_socket(socket);
+}
+
 // Constructor
 zc_socket_server::zc_socket_server(protocol_t protocol, const std::string& address, int port_num) : 
-	server_(INVALID_SOCKET),
-	client_(INVALID_SOCKET),
-    protocol_(protocol),
-    port_num_(port_num),
-    th_socket_(nullptr),
-	prev_port_(0),
-	do_request(nullptr)
+	prev_port_(0)
+{
+	add_service(protocol, address, port_num, nullptr, nullptr);
+}
+
+// Add a service to be served by the listener threads
+int zc_socket_server::add_service(protocol_t protocol, const std::string& address, int port_num,
+	void* instance, int(*do_request)(void*, std::stringstream&), zc_protocol_handler* handler)
+{
+	service_t* service = new service_t;
+	service->protocol = protocol;
+	service->address = address.length() ? address : "0.0.0.0";
+	service->port_num = port_num;
+	service->instance = instance;
+	service->do_request = do_request;
+	service->handler.reset(handler ? handler : default_handler(protocol));
+	services_.push_back(service);
+	return (int)services_.size() - 1;
+}
+
+// Returns the built-in framing for the protocol
+zc_protocol_handler* zc_socket_server::default_handler(protocol_t protocol)
 {
-	if (address.length())
+	switch (protocol)
 	{
-		address_ = address;
+	case HTTP:
+		return new zc_http_protocol;
+	case TCP_LINE:
+		return new zc_line_protocol;
+	case TCP_LENGTH:
+		return new zc_length_protocol;
+	case WEBSOCKET:
+		return new zc_websocket_protocol;
+	default:
+		return nullptr;
 	}
-	else
+}
+
+// Returns the name of the protocol
+const char* zc_socket_server::protocol_name(protocol_t protocol)
+{
+	switch (protocol)
 	{
-		address_ = "0.0.0.0";
+	case HTTP:
+		return "HTTP";
+	case UDP:
+		return "UDP";
+	case TCP_LINE:
+		return "TCP line";
+	case TCP_LENGTH:
+		return "TCP length-prefixed";
+	case WEBSOCKET:
+		return "WebSocket";
+	case TCP_CUSTOM:
+		return "TCP";
+	default:
+		return "?";
 	}
-	memset(&client_addr_, 0, sizeof(client_addr_));
 }
 
 // Create and start the server
@@ -82,7 +218,7 @@ void zc_socket_server::run_server()
 	int result = create_server();
 	if (result)
 	{
-		switch (protocol_)
+		switch (services_[0]->protocol)
 		{
 		case UDP:
 			status_->misc_status(ST_ERROR, "SOCKET: Unable to listen for WSJT-X datagrams");
@@ -90,61 +226,121 @@ void zc_socket_server::run_server()
 		case HTTP:
 			status_->misc_status(ST_ERROR, "SOCKET: Unable to listen for FLDIGI XML-RPC requests");
 			break;
+		default:
+			status_->misc_status(ST_ERROR, "SOCKET: Unable to listen for %s requests", protocol_name(services_[0]->protocol));
+			break;
 		}
+		return;
 	}
-	// Start listening for packets - will set a timer to the listen after that
-	if (zc_app::debug(DEBUG_THREADS)) {
-		printf("SOCKET MAIN: Starting thread for %s\n", protocol_ == UDP ? "UDP" : "HTTP");
+	// Start listening for packets - one thread per shard polls a socket for each service
+	for (auto shard : shards_)
+	{
+		if (zc_app::debug(DEBUG_THREADS)) {
+			printf("SOCKET MAIN: Starting thread for %d services\n", (int)shard->listeners.size());
+		}
+		shard->thread = new std::thread(thread_run, this, shard);
 	}
-	th_socket_ = new std::thread(thread_run, this);
 }
 
 // Destructor
-zc_socket_server::~zc_socket_server(){};
+zc_socket_server::~zc_socket_server()
+{
+	close_server(true);
+	for (auto service : services_)
+	{
+		delete service;
+	}
+	services_.clear();
+}
 
-// Close the socket and clean up winsock
-void zc_socket_server::close_server(bool external)
+// Close the sockets and clean up winsock
+void zc_socket_server::close_server(bool)
 {
-	// WAit for rcv_packet to tidy up
+	// Wait for the listener threads to tidy up
 	closing_ = true;
-	if (external) {
-		while (!closed_) std::this_thread::yield();
-	}
-	if (th_socket_)
-		th_socket_->detach();
-	delete th_socket_;
-	th_socket_ = nullptr;
-	// Fl::remove_timeout(cb_timer_acc, this);
-	// Fl::remove_timeout(cb_timer_rcv, this);
-	if (server_ != INVALID_SOCKET)
-	{
-		SOCKADDR_IN server_addr;
-		LEN_SOCKET_ADDR len_server_addr = sizeof(server_addr);
-		char message[256];
-		getsockname(server_, (SOCKADDR *)&server_addr, &len_server_addr);
-		snprintf(message, 256, "SOCKET: Closing socket %s:%d", inet_ntoa(server_addr.sin_addr), htons(server_addr.sin_port));
-		status_->misc_status(ST_OK, message);
+	for (auto shard : shards_)
+	{
+		if (shard->thread)
+		{
+			// A listener closing the server cannot wait for itself
+			if (shard->thread->get_id() == std::this_thread::get_id())
+				shard->thread->detach();
+			else
+				shard->thread->join();
+			delete shard->thread;
+			shard->thread = nullptr;
+		}
+	}
+	// Deferred responses still refer to the listeners
+	std::lock_guard<std::mutex> lock_reply(mu_reply_);
+	epoch_++;
+	for (auto shard : shards_)
+	{
+		for (auto listener : shard->listeners)
+		{
+			if (listener->server != INVALID_SOCKET)
+			{
+				sockaddr_storage server_addr;
+				LEN_SOCKET_ADDR len_server_addr = sizeof(server_addr);
+				getsockname(listener->server, (SOCKADDR*)&server_addr, &len_server_addr);
+				status_->misc_status(ST_OK, "SOCKET: Closing socket %s", address_text((SOCKADDR*)&server_addr).c_str());
+				close_socket(listener->server);
+			}
+			listener->mu_connections.lock();
+			counters_.active_connections -= listener->connections.size();
+			listener->connections.clear();
+			listener->mu_connections.unlock();
+			delete listener;
+		}
+	}
+	// Packets still queued refer to the listeners
+	mu_packet_.lock();
+	while (!q_packet_.empty()) q_packet_.pop();
+	mu_packet_.unlock();
+	current_ = endpoint_t();
 #ifdef _WIN32
-		closesocket(server_);
-		WSACleanup();
-#else
-		shutdown(server_, 2);
-		close(server_);
+	if (shards_.size()) WSACleanup();
 #endif
-		server_ = INVALID_SOCKET;
+	for (auto shard : shards_)
+	{
+		delete shard;
 	}
+	shards_.clear();
+}
+
+// Set the number of listener threads
+void zc_socket_server::listeners(int count)
+{
+	num_listeners_ = count < 1 ? 1 : count;
+}
+
+// Returns the number of listener threads
+int zc_socket_server::listeners() const
+{
+	return num_listeners_;
+}
+
+// Set whether unicast services bind their own address
+void zc_socket_server::bind_address(bool bind)
+{
+	bind_address_ = bind;
+}
+
+// Returns true if unicast services bind their own address
+bool zc_socket_server::bind_address() const
+{
+	return bind_address_;
 }
 
-// Create the server after initialising winsock and opening socket
+// Create the server after initialising winsock and opening sockets
 int zc_socket_server::create_server()
 {
-	int result;
+#ifdef _WIN32
 	// Used for status messages
 	char message[256];
-#ifdef _WIN32
 	// Initailise Winsock
 	WSADATA ws_data;
-	result = WSAStartup(MAKEWORD(2, 2), &ws_data);
+	int result = WSAStartup(MAKEWORD(2, 2), &ws_data);
 	if (result)
 	{
 		handle_error("Unable to initialise winsock");
@@ -159,328 +355,798 @@ int zc_socket_server::create_server()
 	{
 		snprintf(message, 256, "Incompatible version of winsock %d.%d found", LOBYTE(ws_data.wVersion), HIBYTE(ws_data.wVersion));
 		handle_error(message);
+		WSACleanup();
 		return 1;
 	}
 #endif
-
-	// Create the socket
-	switch (protocol_)
+	int count = num_listeners_;
+#ifndef SO_REUSEPORT
+	if (count > 1)
 	{
-	case UDP:
-#ifdef _WIN32
-// Windows does not support SOCK_NONBLOCK
-		server_ = socket(AF_INET, SOCK_DGRAM, IPPROTO_IP);
-#else
-		server_ = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK, IPPROTO_UDP);
-#endif
-		break;
-	case HTTP:
-#ifdef _WIN32
-		server_ = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-#else
-		server_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP);
+		status_->misc_status(ST_WARNING, "SOCKET: Port sharing not supported - using a single listener");
+		count = 1;
+	}
 #endif
-		break;
+	for (int ix = 0; ix < count; ix++)
+	{
+		shard_t* shard = new shard_t;
+		shards_.push_back(shard);
+		for (auto service : services_)
+		{
+			// Every socket in a multicast group receives every datagram, so do not shard
+			if (ix > 0 && service->multicast) continue;
+			SOCKET s = create_socket(*service, count > 1);
+			if (s == INVALID_SOCKET)
+			{
+				close_server(false);
+				return 1;
+			}
+			listener_t* listener = new listener_t;
+			listener->server = s;
+			listener->service = service;
+			shard->listeners.push_back(listener);
+			if (service->multicast && count > 1)
+			{
+				status_->misc_status(ST_LOG, "SOCKET: Multicast group %s - using a single listener", service->address.c_str());
+			}
+		}
 	}
-	if (server_ == INVALID_SOCKET)
+	return 0;
+}
+
+// Open, bind and listen on one socket
+SOCKET zc_socket_server::create_socket(service_t& service, bool share)
+{
+	int result;
+	bool datagram = service.protocol == UDP;
+	// Resolve the local address - an IPv4 or IPv6 literal or a host name
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = datagram ? SOCK_DGRAM : SOCK_STREAM;
+	hints.ai_protocol = datagram ? IPPROTO_UDP : IPPROTO_TCP;
+	hints.ai_flags = AI_PASSIVE | AI_NUMERICSERV;
+	addrinfo* info = nullptr;
+	std::string port = std::to_string(service.port_num);
+	result = getaddrinfo(service.address.c_str(), port.c_str(), &hints, &info);
+	if (result || info == nullptr)
 	{
-		handle_error("Unable to create the socket");
-		return 1;
+		status_->misc_status(ST_ERROR, "SOCKET: Invalid address %s: %s", service.address.c_str(), gai_strerror(result));
+		return INVALID_SOCKET;
+	}
+	int family = info->ai_family;
+
+	// Create the socket
+	SOCKET server = socket(family, info->ai_socktype, info->ai_protocol);
+	if (server == INVALID_SOCKET)
+	{
+		handle_error("Unable to create the socket", false);
+		freeaddrinfo(info);
+		return INVALID_SOCKET;
 	}
 	else
 	{
-		switch (protocol_)
-		{
-		case UDP:
-			status_->misc_status(ST_LOG, "SOCKET: Created UDP socket");
-			break;
-		case HTTP:
-			status_->misc_status(ST_LOG, "SOCKET: Created HTTP socket");
-			break;
-		}
+		status_->misc_status(ST_LOG, "SOCKET: Created %s socket", protocol_name(service.protocol));
 	}
 
-	// Define the port we listen on and addresses we listen for
-	SOCKADDR_IN server_addr;
-	LEN_SOCKET_ADDR len_server_addr = sizeof(server_addr);
-	server_addr.sin_family = AF_INET;
-	server_addr.sin_port = htons(port_num_);
-	server_addr.sin_addr.s_addr = inet_addr(address_.c_str());
-
-	// Multicast addresses 224.0.0.0 to 239.255.255.255 = NB byte order
-	bool multicast = (server_addr.sin_addr.s_addr & (unsigned)0x000000F0) == (unsigned)0x000000E0;
-	if (multicast) {
-		// Allow multiple sockets to use the same port number
-		int set_option_on = 1;
-		result = setsockopt(server_, SOL_SOCKET, SO_REUSEADDR, (char*)&set_option_on,
+	int set_option_on = 1;
+	int set_option_off = 0;
+	// Allow address to be reused - it may be hanging around from a previous
+	// session, or shared by other members of a multicast group
+	result = setsockopt(server, SOL_SOCKET, SO_REUSEADDR, (char*)&set_option_on,
+		sizeof(set_option_on));
+	if (result < 0) {
+		handle_error("Unable to set socket reusable", false);
+		close_socket(server);
+		freeaddrinfo(info);
+		return INVALID_SOCKET;
+	}
+#ifdef SO_REUSEPORT
+	// Let the other listeners bind the same port - the kernel balances between them
+	if (share) {
+		result = setsockopt(server, SOL_SOCKET, SO_REUSEPORT, (char*)&set_option_on,
 			sizeof(set_option_on));
 		if (result < 0) {
-			handle_error("Unable to set socket reusable");
-			return result;
+			handle_error("Unable to share socket port", false);
+			close_socket(server);
+			freeaddrinfo(info);
+			return INVALID_SOCKET;
 		}
-		// Set up destimation address
-		SOCKADDR_IN d_addr;
-		memset(&d_addr, 0, sizeof(d_addr));
-		d_addr.sin_family = AF_INET;
-		d_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-		d_addr.sin_port = htons(port_num_);
+	}
+#endif
+	// A unicast service listens on all interfaces unless its own address is to be bound,
+	// and a multicast group receives on all interfaces
+	service.multicast = multicast_address(info->ai_addr);
+	bool any_interface = service.multicast || !bind_address_;
+	// Listening on "::" also accepts IPv4 clients (as IPv4-mapped addresses)
+	if (family == AF_INET6) {
+		int* v6only = (any_interface || ipv6_any(info->ai_addr)) ? &set_option_off : &set_option_on;
+		setsockopt(server, IPPROTO_IPV6, IPV6_V6ONLY, (char*)v6only, sizeof(int));
+	}
 
-		// Bind to receive address
-		result = bind(server_, (SOCKADDR*)&d_addr, sizeof(d_addr));
-		if (result < 0) {
-			handle_error("Unable to bind multicast");
-			return result;
+	if (any_interface) {
+		// Bind to receive address - the port on all interfaces
+		sockaddr_storage d_addr;
+		memset(&d_addr, 0, sizeof(d_addr));
+		d_addr.ss_family = (unsigned short)family;
+		if (family == AF_INET6) {
+			((sockaddr_in6*)&d_addr)->sin6_port = htons(service.port_num);
 		}
-
-		// Request to join multicase group
-		ip_mreq mreq;
-		mreq.imr_multiaddr.s_addr = inet_addr(address_.c_str());
-		mreq.imr_interface.s_addr = htonl(INADDR_ANY);
-		result = setsockopt(server_, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(mreq));
-		if (result < 0) {
-			handle_error("Request to join multicase declined");
-			return result;
+		else {
+			((sockaddr_in*)&d_addr)->sin_addr.s_addr = htonl(INADDR_ANY);
+			((sockaddr_in*)&d_addr)->sin_port = htons(service.port_num);
 		}
-
+		result = bind(server, (SOCKADDR*)&d_addr, address_length(d_addr));
 	}
 	else {
-		int set_option_on = 1;
-		// Allow address to be reused - it may be hanging around from a previous
-		result = setsockopt(server_, SOL_SOCKET, SO_REUSEADDR, (char*)&set_option_on,
-			sizeof(set_option_on));
-		if (result < 0) {
-			handle_error("Unable to set socket reusable");
-			return result;
-			// Associate the socket with this address data
-			result = bind(server_, (SOCKADDR*)&server_addr, len_server_addr);
-			if (result < 0)
-			{
-				handle_error("Unable to bind the socket");
-				return result;
-			}
-		}
-		// Set up destimation address
-		SOCKADDR_IN d_addr;
-		memset(&d_addr, 0, sizeof(d_addr));
-		d_addr.sin_family = AF_INET;
-		d_addr.sin_addr.s_addr = htonl(INADDR_ANY);
-		d_addr.sin_port = htons(port_num_);
+		// Associate the socket with the requested address
+		result = bind(server, info->ai_addr, (LEN_SOCKET_ADDR)info->ai_addrlen);
+	}
+	if (result < 0) {
+		handle_error(service.multicast ? "Unable to bind multicast" : "Unable to bind socket", false);
+		close_socket(server);
+		freeaddrinfo(info);
+		return INVALID_SOCKET;
+	}
 
-		// Bind to receive address
-		result = bind(server_, (SOCKADDR*)&d_addr, sizeof(d_addr));
+	if (service.multicast) {
+		// Request to join multicast group
+		if (family == AF_INET6) {
+			ipv6_mreq mreq;
+			memset(&mreq, 0, sizeof(mreq));
+			mreq.ipv6mr_multiaddr = ((sockaddr_in6*)info->ai_addr)->sin6_addr;
+			mreq.ipv6mr_interface = 0;
+			result = setsockopt(server, IPPROTO_IPV6, IPV6_JOIN_GROUP, (char*)&mreq, sizeof(mreq));
+		}
+		else {
+			ip_mreq mreq;
+			mreq.imr_multiaddr = ((sockaddr_in*)info->ai_addr)->sin_addr;
+			mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+			result = setsockopt(server, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char*)&mreq, sizeof(mreq));
+		}
 		if (result < 0) {
-			handle_error("Unable to bind socket");
-			return result;
+			handle_error("Request to join multicase declined", false);
+			close_socket(server);
+			freeaddrinfo(info);
+			return INVALID_SOCKET;
 		}
-
 	}
-//	getsockname(server_, (SOCKADDR *)&server_addr, &len_server_addr);
-	snprintf(message, 256, "SOCKET: Connected socket %s:%d", inet_ntoa(server_addr.sin_addr), htons(server_addr.sin_port));
-	status_->misc_status(ST_OK, message);
+	status_->misc_status(ST_OK, "SOCKET: Connected socket %s", address_text(info->ai_addr).c_str());
+	freeaddrinfo(info);
 
- #ifdef _WIN32
-	// Windows way of supporting non-blocking operations
- 	unsigned long nonblocking = 1;
- 	if (server_ != INVALID_SOCKET && ioctlsocket(server_, FIONBIO, &nonblocking))
- 	{
- 		handle_error("Unable to make socket non-blocking");
- 		return 1;
- 	}
- #endif
+	// Make all operations on the socket non-blocking
+	if (!set_nonblocking(server))
+	{
+		handle_error("Unable to make socket non-blocking", false);
+		close_socket(server);
+		return INVALID_SOCKET;
+	}
 
 	// Set socket into listening mode
-	if (protocol_ == HTTP)
+	if (!datagram)
 	{
-		result = listen(server_, SOMAXCONN);
+		result = listen(server, SOMAXCONN);
 		if (result < 0)
 		{
-			handle_error("Unable to establich connection");
-			return result;
+			handle_error("Unable to establich connection", false);
+			close_socket(server);
+			return INVALID_SOCKET;
 		}
 		else
 		{
-			getsockname(server_, (SOCKADDR *)&server_addr, &len_server_addr);
-			snprintf(message, 256, "SOCKET: Listening socket %s:%d", inet_ntoa(server_addr.sin_addr), htons(server_addr.sin_port));
-			status_->misc_status(ST_OK, message);
-		}
-
- #ifdef _WIN32
- 		// Make the client non-blocking as well
- 		unsigned long nonblocking = 1;
- 		if (client_ != INVALID_SOCKET && ioctlsocket(client_, FIONBIO, &nonblocking))
- 		{
- 			handle_error("Unable to make client socket non-blocking");
- 			return 1;
- 		}
-#endif
+			sockaddr_storage server_addr;
+			LEN_SOCKET_ADDR len_server_addr = sizeof(server_addr);
+			getsockname(server, (SOCKADDR *)&server_addr, &len_server_addr);
+			status_->misc_status(ST_OK, "SOCKET: Listening socket %s", address_text((SOCKADDR*)&server_addr).c_str());
+		}
 	}
-	return 0;
+	return server;
+}
+
+// Returns "address:port" (or "[address]:port" for IPv6)
+std::string zc_socket_server::address_text(const sockaddr* addr)
+{
+	char host[NI_MAXHOST];
+	char serv[NI_MAXSERV];
+	LEN_SOCKET_ADDR len = addr->sa_family == AF_INET6 ? sizeof(sockaddr_in6) : sizeof(sockaddr_in);
+	if (getnameinfo(addr, len, host, sizeof(host), serv, sizeof(serv), NI_NUMERICHOST | NI_NUMERICSERV))
+	{
+		return "?";
+	}
+	if (addr->sa_family == AF_INET6)
+		return std::string("[") + host + "]:" + serv;
+	else
+		return std::string(host) + ":" + serv;
 }
 
 // Accept any client asking to connect, use non-blocking call to avoid locking out other code
-zc_socket_server::client_status zc_socket_server::accept_client()
+zc_socket_server::client_status zc_socket_server::accept_client(listener_t* listener)
 {
-	LEN_SOCKET_ADDR len_client_addr = sizeof(client_addr_);
-	client_ = accept(server_, (SOCKADDR *)&client_addr_, &len_client_addr);
-	if (client_ == INVALID_SOCKET)
+	sockaddr_storage client_addr;
+	LEN_SOCKET_ADDR len_client_addr = sizeof(client_addr);
+	SOCKET client = accept(listener->server, (SOCKADDR *)&client_addr, &len_client_addr);
+	if (client == INVALID_SOCKET)
 	{
-#ifdef _WIN32
-		if (WSAGetLastError() == WSAEWOULDBLOCK)
+		if (would_block() || interrupted())
 		{
-			// status_->misc_status(ST_LOG, "SOCKET: No client socket to accept");
 			//  Non-blocking accept would have blocked - let other events get handled and try again
 			return BLOCK;
 		}
 		else
 		{
-			handle_error("Unable to accept connection");
+			handle_error("Unable to accept connection", false);
 			return NG;
 		}
-#else
-		return BLOCK;
-#endif
 	}
-	else
+	// The connection is polled along with the listening socket
+	set_nonblocking(client);
+	auto conn = std::make_shared<connection_t>();
+	conn->socket = client;
+	conn->addr = client_addr;
+	// Each connection frames its own stream
+	if (listener->service->handler) conn->handler.reset(listener->service->handler->clone());
+	listener->mu_connections.lock();
+	listener->connections[client] = conn;
+	listener->mu_connections.unlock();
+	counters_.accepts++;
+	counters_.active_connections++;
+	if (zc_app::debug(DEBUG_SOCKET)) {
+		printf("SOCKET: Accepted %s\n", address_text((SOCKADDR*)&client_addr).c_str());
+	}
+	return OK;
+}
+
+// Service the listening sockets of every service and their connections until closed
+int zc_socket_server::rcv_packet(shard_t* shard)
+{
+	running_++;
+	std::vector<POLLFD> fds;
+	// The listener and (for connections) the connection for each entry in fds
+	std::vector<endpoint_t> polled;
+	while (!closing_)
 	{
-		return OK;
+		// Wait for any server socket or connection to have something to read
+		fds.clear();
+		polled.clear();
+		POLLFD pfd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		endpoint_t ep;
+		for (auto listener : shard->listeners)
+		{
+			pfd.fd = listener->server;
+			fds.push_back(pfd);
+			ep.listener = listener;
+			ep.connection = nullptr;
+			polled.push_back(ep);
+			listener->mu_connections.lock();
+			for (auto& it : listener->connections)
+			{
+				pfd.fd = it.second->socket;
+				fds.push_back(pfd);
+				ep.connection = it.second;
+				polled.push_back(ep);
+			}
+			listener->mu_connections.unlock();
+		}
+		int result = POLL(fds.data(), (unsigned)fds.size(), POLL_INTERVAL);
+		if (result < 0)
+		{
+			if (interrupted()) continue;
+			if (!closing_) handle_error("Unable to wait for sockets", false);
+			break;
+		}
+		if (result == 0) continue;
+		for (size_t ix = 0; ix < fds.size() && !closing_; ix++)
+		{
+			listener_t* listener = polled[ix].listener;
+			if (!polled[ix].connection)
+			{
+				if (fds[ix].revents & POLLIN)
+				{
+					if (listener->service->protocol == UDP)
+					{
+						rcv_datagrams(listener);
+					}
+					else
+					{
+						// Accept everyone waiting
+						while (accept_client(listener) == OK);
+					}
+				}
+			}
+			else if (fds[ix].revents & (POLLIN | POLLHUP | POLLERR))
+			{
+				const std::shared_ptr<connection_t>& conn = polled[ix].connection;
+				if (!rcv_stream(listener, conn))
+				{
+					// Peer has closed - the socket closes when any response has gone
+					if (zc_app::debug(DEBUG_SOCKET)) {
+						printf("SOCKET: Closed %s\n", address_text((SOCKADDR*)&conn->addr).c_str());
+					}
+					listener->mu_connections.lock();
+					listener->connections.erase(conn->socket);
+					listener->mu_connections.unlock();
+					counters_.active_connections--;
+				}
+			}
+		}
+	}
+	for (auto listener : shard->listeners)
+	{
+		listener->mu_connections.lock();
+		counters_.active_connections -= listener->connections.size();
+		listener->connections.clear();
+		listener->mu_connections.unlock();
 	}
+	running_--;
+	return 0;
 }
-const int MAX_SOCKET = 10240;
 
-// Receive the packet
-int zc_socket_server::rcv_packet()
-{
-	closed_ = false;
-	char *buffer = new char[MAX_SOCKET];
-	int buffer_len = MAX_SOCKET;
-	int bytes_rcvd = 0;
-	// Generate a set of socket descriptors for use in select()
-//#ifdef _WIN32
-//	FD_SET set_sockets;
-//#else
-	fd_set set_sockets;
-//#endif
-	FD_ZERO(&set_sockets);
-	FD_SET(server_, &set_sockets);
-
-	// Now wait until we see a client
-	if (protocol_ == HTTP)
-	{
-		client_ = INVALID_SOCKET;
-		client_status result = BLOCK;
-		while (client_ == INVALID_SOCKET && result == BLOCK && !closing_)
+// Read what is available on a stream connection - returns false if it has closed
+bool zc_socket_server::rcv_stream(listener_t* listener, const std::shared_ptr<connection_t>& conn)
+{
+	char buffer[MAX_SOCKET];
+	endpoint_t from;
+	from.listener = listener;
+	from.connection = conn;
+	while (!closing_)
+	{
+		int bytes_rcvd = recv(conn->socket, buffer, MAX_SOCKET, 0);
+		if (bytes_rcvd > 0)
 		{
-			result = accept_client();
-			std::this_thread::yield();
+			conn->bytes_in += bytes_rcvd;
+			counters_.bytes_in += bytes_rcvd;
+			if (!conn->handler)
+			{
+				// Unframed - each read is a request
+				push_packet(std::string(buffer, bytes_rcvd), from);
+			}
+			else if (conn->rx.empty())
+			{
+				// Frame straight from the receive buffer and keep any partial message
+				size_t used;
+				if (!frame_stream(from, buffer, bytes_rcvd, used)) return false;
+				conn->rx.assign(buffer + used, bytes_rcvd - used);
+			}
+			else
+			{
+				size_t used;
+				conn->rx.append(buffer, bytes_rcvd);
+				if (!frame_stream(from, conn->rx.data(), conn->rx.length(), used)) return false;
+				conn->rx.erase(0, used);
+			}
 		}
-		if (result == NG)
+		else if (bytes_rcvd == 0)
 		{
-			return 1;
+			// Orderly close by peer
+			return false;
+		}
+		else if (would_block())
+		{
+			// Read all there is
+			return true;
+		}
+		else if (!interrupted())
+		{
+			// Connection reset or similar
+			return false;
 		}
 	}
+	return true;
+}
 
-	std::string resource = "";
-	std::string function = "";
-	LEN_SOCKET_ADDR len_client_addr = sizeof(client_addr_);
-	do
+// Pass each complete message to the main thread and answer any protocol exchanges
+bool zc_socket_server::frame_stream(const endpoint_t& from, const char* data, size_t length, size_t& used)
+{
+	zc_protocol_handler* handler = from.connection->handler.get();
+	used = 0;
+	while (used < length)
 	{
-		// Keep processing packets while they keep coming
-		switch (protocol_)
+		size_t len_frame = 0;
+		std::string message;
+		std::string reply;
+		zc_protocol_handler::frame_t result = handler->frame(data + used, length - used, len_frame, message, reply);
+		used += len_frame;
+		if (reply.length())
 		{
-		case UDP:
-			if (buffer) bytes_rcvd = recvfrom(server_, buffer, buffer_len, 0, (SOCKADDR *)&client_addr_, &len_client_addr);
+			send_buffers(from, nullptr, 0, reply.data(), reply.length(), nullptr, 0);
+		}
+		switch (result)
+		{
+		case zc_protocol_handler::FRAME_INCOMPLETE:
+			return true;
+		case zc_protocol_handler::FRAME_MESSAGE:
+			push_packet(std::move(message), from);
 			break;
-		case HTTP:
-			if (buffer) bytes_rcvd = recv(client_, buffer, buffer_len, 0);
+		case zc_protocol_handler::FRAME_CONTROL:
 			break;
+		case zc_protocol_handler::FRAME_CLOSE:
+			return false;
+		case zc_protocol_handler::FRAME_ERROR:
+			status_->misc_status(ST_WARNING, "SOCKET: %s protocol error from %s - closing connection",
+				protocol_name(from.listener->service->protocol), address_text((SOCKADDR*)&from.connection->addr).c_str());
+			return false;
 		}
-		if (bytes_rcvd > 0)
+		// A handler that consumes nothing would never finish
+		if (len_frame == 0) return true;
+	}
+	return true;
+}
+
+// Read all waiting datagrams
+void zc_socket_server::rcv_datagrams(listener_t* listener)
+{
+	char buffer[MAX_SOCKET];
+	while (!closing_)
+	{
+		endpoint_t from;
+		from.listener = listener;
+		LEN_SOCKET_ADDR len_addr = sizeof(from.addr);
+		int bytes_rcvd = recvfrom(listener->server, buffer, MAX_SOCKET, 0, (SOCKADDR*)&from.addr, &len_addr);
+		if (bytes_rcvd >= 0)
+		{
+			counters_.bytes_in += bytes_rcvd;
+			push_packet(std::string(buffer, bytes_rcvd), from);
+		}
+		else if (!interrupted())
+		{
+			// Would block - or an error reported by an earlier send (ICMP unreachable)
+			return;
+		}
+	}
+}
+
+// Queue the message for the main thread and wake it
+void zc_socket_server::push_packet(std::string&& data, const endpoint_t& from)
+{
+	if (zc_app::debug(DEBUG_SOCKET)) dump(data.data(), data.length());
+	counters_.packets_in++;
+	if (from.connection) from.connection->packets_in++;
+	mu_packet_.lock();
+	q_packet_.push({ std::move(data), from, std::chrono::steady_clock::now() });
+	if (q_packet_.size() > counters_.max_queue_depth) counters_.max_queue_depth = q_packet_.size();
+	mu_packet_.unlock();
+	Fl::awake(cb_th_packet, this);
+}
+
+// Send a response back - read the rest of the stream into one buffer
+int zc_socket_server::send_response(std::istream &response)
+{
+	std::string data((std::istreambuf_iterator<char>(response)), std::istreambuf_iterator<char>());
+	return send_response(nullptr, 0, data.data(), data.length());
+}
+
+// Send a response back as separate header and body strings
+int zc_socket_server::send_response(const std::string& header, const std::string& body)
+{
+	return send_response(header.data(), header.length(), body.data(), body.length());
+}
+
+// Send a response back - gather header and body without copying them
+int zc_socket_server::send_response(const char* header, size_t len_header, const char* body, size_t len_body)
+{
+	if (!current_.listener)
+	{
+		status_->misc_status(ST_WARNING, "SOCKET: No client to respond to");
+		return -1;
+	}
+	// Framed protocols precede the response with their own header
+	std::string prefix;
+	if (current_.connection && current_.connection->handler)
+	{
+		current_.connection->handler->encode(len_header + len_body, prefix);
+	}
+	return send_buffers(current_, prefix.data(), prefix.length(), header, len_header, body, len_body);
+}
+
+// A deferred response - the endpoint and the listeners it belongs to
+struct zc_socket_server::reply_t
+{
+	endpoint_t to;                    //!< Where the response goes
+	uint64_t epoch;                   //!< epoch_ when deferred
+	std::chrono::steady_clock::time_point received;   //!< When the request arrived
+};
+
+// Keep where the current packet came from for a later response
+std::shared_ptr<zc_socket_server::reply_t> zc_socket_server::defer_response()
+{
+	if (!current_.listener) return nullptr;
+	// The latency is recorded when the response is sent
+	current_deferred_ = true;
+	std::lock_guard<std::mutex> lock(mu_reply_);
+	return std::make_shared<reply_t>(reply_t{ current_, epoch_, current_received_ });
+}
+
+// Send a deferred response - from any thread
+int zc_socket_server::send_response_to(const std::shared_ptr<reply_t>& to, const char* header, size_t len_header,
+	const char* body, size_t len_body)
+{
+	std::unique_lock<std::mutex> lock(mu_reply_);
+	if (!to || to->epoch != epoch_)
+	{
+		status_->misc_status(ST_WARNING, "SOCKET: Server closed before the deferred response");
+		return -1;
+	}
+	// The reply holds the connection open, so a slow client does not hold up the listeners or
+	// close_server. A datagram goes on the listener's socket - so keep that until it has gone.
+	if (to->to.connection) lock.unlock();
+	std::string prefix;
+	if (to->to.connection && to->to.connection->handler)
+	{
+		to->to.connection->handler->encode(len_header + len_body, prefix);
+	}
+	int result = send_buffers(to->to, prefix.data(), prefix.length(), header, len_header, body, len_body);
+	record_latency(to->received);
+	return result;
+}
+
+// Gather the buffers into one send
+int zc_socket_server::send_buffers(const endpoint_t& to, const char* prefix, size_t len_prefix,
+	const char* header, size_t len_header, const char* body, size_t len_body)
+{
+	if (zc_app::debug(DEBUG_SOCKET)) {
+		if (len_prefix) dump(prefix, len_prefix);
+		if (len_header) dump(header, len_header);
+		if (len_body) dump(body, len_body);
+	}
+	// A connection does not need its listener - which a deferred response may have outlived
+	bool datagram = !to.connection && to.listener->service->protocol == UDP;
+	SOCKET s;
+	std::unique_lock<std::mutex> lock;
+	if (datagram)
+	{
+		s = to.listener->server;
+	}
+	else
+	{
+		if (!to.connection)
 		{
-			if (buffer && zc_app::debug(DEBUG_SOCKET)) dump(std::string(buffer, bytes_rcvd));
-			mu_packet_.lock();
-			std::string s = std::string(buffer, bytes_rcvd);
-			q_packet_.push(s);
-			mu_packet_.unlock();
-			Fl::awake(cb_th_packet, this);
+			status_->misc_status(ST_WARNING, "SOCKET: No client connection to respond to");
+			return -1;
 		}
+		// Do not interleave with another response on the same connection
+		lock = std::unique_lock<std::mutex>(to.connection->mu_send);
+		s = to.connection->socket;
+	}
 #ifdef _WIN32
-		else {
-			auto error = WSAGetLastError();
-			if (error == WSAEWOULDBLOCK)
+	WSABUF bufs[3];
+	DWORD num_bufs = 0;
+	if (len_prefix) bufs[num_bufs++] = { (ULONG)len_prefix, (CHAR*)prefix };
+	if (len_header) bufs[num_bufs++] = { (ULONG)len_header, (CHAR*)header };
+	if (len_body) bufs[num_bufs++] = { (ULONG)len_body, (CHAR*)body };
+#else
+	iovec bufs[3];
+	int num_bufs = 0;
+	if (len_prefix) bufs[num_bufs++] = { (void*)prefix, len_prefix };
+	if (len_header) bufs[num_bufs++] = { (void*)header, len_header };
+	if (len_body) bufs[num_bufs++] = { (void*)body, len_body };
+#endif
+	int first = 0;
+	while (first < (int)num_bufs)
+	{
+		// Send as much as the socket will take
+		long sent;
+#ifdef _WIN32
+		DWORD bytes_sent = 0;
+		int result;
+		if (datagram)
+		{
+			result = WSASendTo(s, &bufs[first], num_bufs - first, &bytes_sent, 0,
+				(SOCKADDR*)&to.addr, address_length(to.addr), nullptr, nullptr);
+		}
+		else
+		{
+			result = WSASend(s, &bufs[first], num_bufs - first, &bytes_sent, 0, nullptr, nullptr);
+		}
+		if (result == SOCKET_ERROR)
+		{
+			if (WSAGetLastError() == WSAEWOULDBLOCK)
 			{
-				// Try again immediately after letting FLTK in
-				std::this_thread::yield();
+				// Backpressure - wait for the peer to drain
+				if (wait_writable(s, SEND_TIMEOUT)) continue;
+				handle_error("Timed out sending to", false);
+				counters_.send_errors++;
+				return -1;
 			}
-			else if (error == WSAENOTSOCK && closing_)
+			handle_error("Unable to send to", false);
+			counters_.send_errors++;
+			return -1;
+		}
+		sent = (long)bytes_sent;
+#else
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		if (datagram)
+		{
+			msg.msg_name = (void*)&to.addr;
+			msg.msg_namelen = address_length(to.addr);
+		}
+		msg.msg_iov = &bufs[first];
+		msg.msg_iovlen = num_bufs - first;
+		sent = sendmsg(s, &msg, MSG_NOSIGNAL);
+		if (sent < 0)
+		{
+			if (errno == EINTR) continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
 			{
-				// We can get here through a race between closing and turning the timers off
-				delete[] buffer;
-				buffer = nullptr;
+				// Backpressure - wait for the peer to drain
+				if (wait_writable(s, SEND_TIMEOUT)) continue;
+				handle_error("Timed out sending to", false);
+				counters_.send_errors++;
+				return -1;
 			}
-			else
+			handle_error("Unable to send to", false);
+			counters_.send_errors++;
+			return -1;
+		}
+#endif
+		// Datagrams are sent whole or not at all
+		if (datagram) break;
+		// Step over what has been sent and resume from the first partial buffer
+		size_t remaining = (size_t)sent;
+		while (first < (int)num_bufs)
+		{
+#ifdef _WIN32
+			size_t len = bufs[first].len;
+			if (remaining < len)
 			{
-				handle_error("Unable to read from client");
-				delete[] buffer;
-				buffer = nullptr;
+				bufs[first].buf += remaining;
+				bufs[first].len -= (ULONG)remaining;
+				break;
 			}
-		}
 #else
-		else
-		{
-			// Try again after checking for any fltk events
-			//std::this_thread::yield();
-			std::this_thread::sleep_for(std::chrono::milliseconds(1));
-		}
+			size_t len = bufs[first].iov_len;
+			if (remaining < len)
+			{
+				bufs[first].iov_base = (char*)bufs[first].iov_base + remaining;
+				bufs[first].iov_len -= remaining;
+				break;
+			}
 #endif
-	} while (!closing_);
-	// Now see if we have another - the timer goes on the scheduling queue so other tasks will get in
-	closed_ = true;
-	std::this_thread::yield();
-	if (buffer) delete[] buffer;
+			remaining -= len;
+			first++;
+		}
+	}
+	size_t total = len_prefix + len_header + len_body;
+	counters_.bytes_out += total;
+	counters_.packets_out++;
+	if (to.connection)
+	{
+		to.connection->bytes_out += total;
+		to.connection->packets_out++;
+	}
 	return 0;
 }
 
-// Send a response back
-int zc_socket_server::send_response(std::istream &response)
+// Wait for the socket to accept more data
+bool zc_socket_server::wait_writable(SOCKET s, int timeout_ms)
 {
-	// calculate the data size
-	std::streampos startpos = response.tellg();
-	response.seekg(0, std::ios::end);
-	std::streampos endpos = response.tellg();
-	int resp_size = (int)endpos - (int)startpos;
-	response.seekg(0, std::ios::beg);
-	//
-	char *buffer = new char[resp_size + 1];
-	memset(buffer, '\0', resp_size + 1);
-	response.read(buffer, resp_size);
-	if (zc_app::debug(DEBUG_SOCKET)) dump(std::string(buffer));
-
-	// Send the response packet
+#ifdef _WIN32
+	WSAPOLLFD pfd;
+	pfd.fd = s;
+	pfd.events = POLLWRNORM;
+	pfd.revents = 0;
+	int result = WSAPoll(&pfd, 1, timeout_ms);
+#else
+	pollfd pfd;
+	pfd.fd = s;
+	pfd.events = POLLOUT;
+	pfd.revents = 0;
 	int result;
-	if (protocol_ == UDP)
+	do
+	{
+		result = poll(&pfd, 1, timeout_ms);
+	} while (result < 0 && errno == EINTR);
+#endif
+	return result > 0 && !closing_;
+}
+
+// Add the time since the request was received to the latency histogram
+void zc_socket_server::record_latency(std::chrono::steady_clock::time_point received)
+{
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - received).count();
+	int bucket = 0;
+	while (bucket < NUM_LATENCY_BUCKETS - 1 && us >= (1LL << bucket)) bucket++;
+	counters_.latency[bucket]++;
+	counters_.requests++;
+}
+
+// Returns a snapshot of the server counters
+zc_socket_server::metrics_t zc_socket_server::metrics() const
+{
+	metrics_t m;
+	m.elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - counters_.since).count();
+	m.bytes_in = counters_.bytes_in;
+	m.bytes_out = counters_.bytes_out;
+	m.packets_in = counters_.packets_in;
+	m.packets_out = counters_.packets_out;
+	m.send_errors = counters_.send_errors;
+	m.accepts = counters_.accepts;
+	m.active_connections = counters_.active_connections;
+	m.max_queue_depth = counters_.max_queue_depth;
+	m.requests = counters_.requests;
+	for (int ix = 0; ix < NUM_LATENCY_BUCKETS; ix++)
 	{
-		result = sendto(server_, buffer, resp_size, 0, (SOCKADDR *)&client_addr_, sizeof(client_addr_));
+		m.latency[ix] = counters_.latency[ix];
 	}
-	else
+	mu_packet_.lock();
+	m.queue_depth = q_packet_.size();
+	mu_packet_.unlock();
+	return m;
+}
+
+// Returns a snapshot of the counters for each open connection
+std::vector<zc_socket_server::connection_metrics_t> zc_socket_server::connection_metrics() const
+{
+	std::vector<connection_metrics_t> result;
+	auto now = std::chrono::steady_clock::now();
+	for (auto shard : shards_)
+	{
+		for (auto listener : shard->listeners)
+		{
+			std::lock_guard<std::mutex> lock(listener->mu_connections);
+			for (auto& it : listener->connections)
+			{
+				const connection_t& conn = *it.second;
+				connection_metrics_t m;
+				m.peer = address_text((const SOCKADDR*)&conn.addr);
+				m.age = std::chrono::duration<double>(now - conn.accepted).count();
+				m.bytes_in = conn.bytes_in;
+				m.bytes_out = conn.bytes_out;
+				m.packets_in = conn.packets_in;
+				m.packets_out = conn.packets_out;
+				result.push_back(m);
+			}
+		}
+	}
+	return result;
+}
+
+// Reset the server counters
+void zc_socket_server::reset_metrics()
+{
+	counters_.since = std::chrono::steady_clock::now();
+	counters_.bytes_in = 0;
+	counters_.bytes_out = 0;
+	counters_.packets_in = 0;
+	counters_.packets_out = 0;
+	counters_.send_errors = 0;
+	counters_.accepts = 0;
+	counters_.requests = 0;
+	mu_packet_.lock();
+	counters_.max_queue_depth = q_packet_.size();
+	mu_packet_.unlock();
+	for (int ix = 0; ix < NUM_LATENCY_BUCKETS; ix++)
 	{
-		result = send(client_, buffer, resp_size, 0);
+		counters_.latency[ix] = 0;
 	}
-	if (result < 0)
+}
+
+// Upper bound of the latency bucket containing fraction p of requests
+double zc_socket_server::metrics_t::latency_percentile(double p) const
+{
+	uint64_t total = 0;
+	for (int ix = 0; ix < NUM_LATENCY_BUCKETS; ix++) total += latency[ix];
+	if (total == 0) return 0.0;
+	double target = p * total;
+	uint64_t count = 0;
+	for (int ix = 0; ix < NUM_LATENCY_BUCKETS; ix++)
 	{
-		handle_error("Unable to send to");
-		return result;
+		count += latency[ix];
+		if (count >= target) return (double)(1LL << ix);
 	}
-	return 0;
+	return (double)(1LL << (NUM_LATENCY_BUCKETS - 1));
 }
 
 // Has a server
 bool zc_socket_server::has_server() const
 {
-	return (server_ != INVALID_SOCKET);
+	return !shards_.empty();
 }
 
 // Handle error - display error message
-void zc_socket_server::handle_error(const char *phase)
+void zc_socket_server::handle_error(const char *phase, bool close)
 {
 	char message[1028];
 #ifdef _WIN32
@@ -497,26 +1163,26 @@ void zc_socket_server::handle_error(const char *phase)
 	}
 #else
 	char* error_msg = strerror(errno);
-	snprintf(message, 1028, "SOCKET: %s %s(%d): %s", phase, address_.c_str(), port_num_, error_msg);
+	snprintf(message, 1028, "SOCKET: %s: %s", phase, error_msg);
 #endif
 	status_->misc_status(ST_ERROR, message);
-	close_server(false);
+	if (close) close_server(false);
 }
 
 // Set handlers
 void zc_socket_server::callback(void* instance, int (*request)(void*, std::stringstream &))
 {
-	instance_ = instance;
-	do_request = request;
+	services_[0]->instance = instance;
+	services_[0]->do_request = request;
 }
 
 // Diagnostic print
-void zc_socket_server::dump(std::string data)
+void zc_socket_server::dump(const char* data, size_t length)
 {
 	std::string escaped = "";
 	bool newline = false;
 	// For every data byte
-	for (auto it = data.begin(); it != data.end(); it++)
+	for (const char* it = data; it != data + length; it++)
 	{
 		unsigned char c = *it;
 		if (c < 32 || c > 0x7F)
@@ -562,24 +1228,31 @@ void zc_socket_server::cb_th_packet(void *v)
 	that->mu_packet_.lock();
 	while (!that->q_packet_.empty())
 	{
-		std::string s = that->q_packet_.front();
-		std::stringstream ss;
-		ss.clear();
-		ss << s;
+		packet_t packet = std::move(that->q_packet_.front());
 		that->q_packet_.pop();
 		that->mu_packet_.unlock();
 		// Process packet having unlocked queue to allow another packet in
-		that->do_request(that->instance_, ss);
+		std::stringstream ss;
+		ss.str(packet.data);
+		// Any response goes back to where the packet came from
+		that->current_ = std::move(packet.from);
+		that->current_received_ = packet.received;
+		that->current_deferred_ = false;
+		service_t* service = that->current_.listener->service;
+		if (service->do_request) service->do_request(service->instance, ss);
+		that->current_ = endpoint_t();
+		// A deferred response records its latency when it is sent
+		if (!that->current_deferred_) that->record_latency(packet.received);
 		that->mu_packet_.lock();
 	}
 	that->mu_packet_.unlock();
 }
 
 // Thread runner
-void zc_socket_server::thread_run(zc_socket_server *that)
+void zc_socket_server::thread_run(zc_socket_server *that, shard_t* shard)
 {
 	if (zc_app::debug(DEBUG_THREADS)) {
 		printf("SOCKET THREAD: Listening for packets\n");
 	}
-	that->rcv_packet();
-}
\ No newline at end of file
+	that->rcv_packet(shard);
+}
@@ -18,18 +18,36 @@
 #include "zc_url_handler.h"
 
 #include "zc_debug.h"
+#include "zc_file_holder.h"
 #include "zc_utils.h"
 
+#include <algorithm>
+#include <cctype>
 #include <cstdio>
 #include <cstring>
+#include <filesystem>
+#include <fstream>
 #include <istream>
+#include <list>
+#include <random>
 #include <mutex>
 #include <ostream>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <curl/curl.h>
 #include <curl/easy.h>
+#include <zlib.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 extern debug_flag DEBUG_CURL;
 extern std::string APP_NAME;
@@ -37,24 +55,110 @@ extern std::string APP_VERSION;
 std::string USER_AGENT = APP_NAME + '/' + APP_VERSION;
 zc_url_handler* url_handler_ = nullptr;
 
-// Make sure only one HTML transfer happens at once
-std::recursive_mutex zc_url_handler::lock_;
-
 // Constructor
 zc_url_handler::zc_url_handler()
-	: curl_(nullptr)
+	: share_(nullptr)
+	, multi_(nullptr)
+	, multi_closing_(false)
+	, cache_enabled_(false)
+	, cache_max_memory_(DEFAULT_CACHE_MEMORY)
+	, cache_memory_(0)
+	, cache_max_disk_(DEFAULT_CACHE_DISK)
+	, cache_disk_(0)
 {
 	// Global initialisation of CURL
 	curl_global_init(CURL_GLOBAL_ALL);
+	// Share the DNS, TLS session and connection caches between all the transfers
+	share_ = curl_share_init();
+	if (share_) {
+		curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, cb_lock);
+		curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, cb_unlock);
+		curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+		curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+		curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+		curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+	}
+	// Runs the asynchronous transfers
+	multi_ = curl_multi_init();
 }
 
 // Destructor
 zc_url_handler::~zc_url_handler()
 {
+	// Stop the transfer thread - failing any outstanding transfers
+	multi_lock_.lock();
+	multi_closing_ = true;
+	multi_lock_.unlock();
+	if (multi_thread_.joinable()) {
+		curl_multi_wakeup(multi_);
+		multi_thread_.join();
+	}
+	if (multi_) {
+		curl_multi_cleanup(multi_);
+	}
+	// The handles must go before the caches they share
+	for (CURL* curl : pool_) {
+		curl_easy_cleanup(curl);
+	}
+	pool_.clear();
+	if (share_) {
+		curl_share_cleanup(share_);
+	}
 	// we're done with libcurl, so clean it up 
 	curl_global_cleanup();
 }
 
+// Take an idle handle from the pool or create a new one
+CURL* zc_url_handler::acquire_handle() {
+	CURL* curl = nullptr;
+	pool_lock_.lock();
+	if (pool_.size()) {
+		curl = pool_.back();
+		pool_.pop_back();
+	}
+	pool_lock_.unlock();
+	if (curl == nullptr) {
+		curl = curl_easy_init();
+		if (curl == nullptr) return nullptr;
+	}
+	// curl_easy_reset detaches the share so attach it each time
+	if (share_) {
+		curl_easy_setopt(curl, CURLOPT_SHARE, share_);
+		curl_easy_setopt(curl, CURLOPT_MAXCONNECTS, MAX_CACHED_CONNECTIONS);
+	}
+	// Transfers run on any thread so timeouts must not use signals
+	curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+	return curl;
+}
+
+// Clear the options (but not the connections) and put the handle back in the pool
+void zc_url_handler::release_handle(CURL* curl) {
+	curl_easy_reset(curl);
+	pool_lock_.lock();
+	if (pool_.size() < MAX_POOLED_HANDLES) {
+		pool_.push_back(curl);
+		curl = nullptr;
+	}
+	pool_lock_.unlock();
+	// Pool is full - the connection stays in the shared cache
+	if (curl) {
+		curl_easy_cleanup(curl);
+	}
+}
+
+// Lock the shared cache
+void zc_url_handler::cb_lock(CURL* handle, curl_lock_data data, curl_lock_access access, void* userp) {
+	(void)handle;
+	(void)access;
+	((zc_url_handler*)userp)->share_locks_[data].lock();
+}
+
+// Unlock the shared cache
+void zc_url_handler::cb_unlock(CURL* handle, curl_lock_data data, void* userp) {
+	(void)handle;
+	((zc_url_handler*)userp)->share_locks_[data].unlock();
+}
+
 // Handles the URL GET callback - copy the data directly to the output stream
 size_t zc_url_handler::cb_write(char* data, size_t size, size_t nmemb, void* os) {
 	// calculate the number of bytes in data
@@ -86,152 +190,1332 @@ size_t zc_url_handler::cb_read(char* data, size_t size, size_t nmemb, void* is)
 	}
 }
 
-// Read the URL (HTTP GET) and write it back to the output stream
-bool zc_url_handler::read_url(std::string url, std::ostream* os) {
+// Set the response up - and send the data to it
+void zc_url_handler::prepare_response(CURL* curl, const host_policy& p, response_sink& response) {
+	response.curl = curl;
+	// Only the first attempt - perform decides for the others
+	response.drop_busy = p.max_retries > 0;
+	/* send all data to this function  */
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, cb_write_response);
+	/* we pass the response to the callback function */
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+}
 
+// The server is busy and has not acted on the request
+bool zc_url_handler::busy_status(long code) {
+	return code == 429 || code == 503;
+}
 
-	lock_.lock();
+// Handles the response callback - drop a reply that will not be passed on, else copy it to the output stream
+size_t zc_url_handler::cb_write_response(char* data, size_t size, size_t nmemb, void* userp) {
+	response_sink* response = (response_sink*)userp;
+	long code = 0;
+	curl_easy_getinfo(response->curl, CURLINFO_RESPONSE_CODE, &code);
+	if ((response->drop_busy && busy_status(code)) || (response->drop_refused && code == 415)) {
+		return size * nmemb;
+	}
+	return cb_write(data, size, nmemb, response->os);
+}
 
-	CURLcode result;
-	// Start a new transfer
-	curl_ = curl_easy_init();
+// Set the options to read the URL (HTTP GET) into the output stream
+void zc_url_handler::prepare_get(CURL* curl, const std::string& url, response_sink* response, char* error_msg) {
+	/* specify URL to get */
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	// Accept any compression curl can decode
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	host_policy p = policy(url_host(url));
+	if (response) {
+		prepare_response(curl, p, *response);
+	}
+	// Set the connection and overall timeouts from the host's policy
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)p.connect_timeout.count());
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)p.timeout.count());
+
+	/* some servers don't like requests that are made without a user-agent
+	field, so we provide one */
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, USER_AGENT.c_str());
+	// Error buffer
+	error_msg[0] = '\0';
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_msg);
 
+	if (zc_app::debug(DEBUG_CURL)) {
+		// Add extra verbosity
+		curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, cb_debug);
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	}
+}
 
-	/* specify URL to get */
-	curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
-	/* send all data to this function  */
-	curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, cb_write);
-	/* we pass the output stream to the callback function */
-	curl_easy_setopt(curl_, CURLOPT_WRITEDATA, os);
-	// Set connection timeout to 10s
-	curl_easy_setopt(curl_, CURLOPT_CONNECTTIMEOUT, 10L);
-	// Set overall timeout to 30s
-	curl_easy_setopt(curl_, CURLOPT_TIMEOUT, 30L);
+// Compress length bytes of data with gzip into out
+static bool gzip(const char* data, size_t length, std::string& out) {
+	z_stream zs;
+	memset(&zs, 0, sizeof(zs));
+	// Window bits 15 + 16 asks for the gzip wrapper rather than zlib's
+	if (deflateInit2(&zs, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+		return false;
+	}
+	out.resize(deflateBound(&zs, (uLong)length));
+	zs.next_in = (Bytef*)data;
+	zs.avail_in = (uInt)length;
+	zs.next_out = (Bytef*)&out[0];
+	zs.avail_out = (uInt)out.size();
+	int result = deflate(&zs, Z_FINISH);
+	out.resize(zs.total_out);
+	deflateEnd(&zs);
+	return result == Z_STREAM_END;
+}
 
+// Set the options to post the input stream to the URL (HTTP POST) - the response goes to the output stream
+bool zc_url_handler::prepare_post(CURL* curl, const std::string& url, const std::string& resource, std::istream* req,
+	std::string_view data, char* error_msg, post_state& post) {
+	long req_length = (long)data.length();
+	post.req.is = req;
+	if (req) {
+		// Get the request length - from where the stream is now to its end
+		post.req.start = req->tellg();
+		req->seekg(0, std::ios::end);
+		std::streampos endpos = req->tellg();
+		req_length = (long)(endpos - post.req.start);
+		req->seekg(post.req.start);
+	}
+
+	post.body.clear();
+	post.headers = nullptr;
+	// Specify the URL
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	// Accept any compression curl can decode
+	curl_easy_setopt(curl, CURLOPT_ACCEPT_ENCODING, "");
+	/* now specify we want to POST data */
+	curl_easy_setopt(curl, CURLOPT_POST, 1L);
+	host_policy p = policy(url_host(url));
+	// Request target
+	if (resource.length()) {
+		curl_easy_setopt(curl, CURLOPT_REQUEST_TARGET, resource.c_str());
+	}
+	// Compress the request if the host accepts it and it is big enough to be worth it
+	if (req_length >= MIN_COMPRESS_SIZE && compress_host(url)) {
+		bool ok;
+		if (req) {
+			std::string plain((size_t)req_length, '\0');
+			req->read(&plain[0], req_length);
+			ok = req->gcount() == req_length && gzip(plain.data(), plain.length(), post.body);
+		}
+		else {
+			ok = gzip(data.data(), data.length(), post.body);
+		}
+		if (ok) {
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)post.body.length());
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, post.body.data());
+			post.headers = curl_slist_append(post.headers, "Content-Encoding: gzip");
+		}
+		else {
+			// Send it as it is
+			post.body.clear();
+			if (req) {
+				req->clear();
+				req->seekg(post.req.start);
+			}
+		}
+	}
+	if (post.body.empty()) {
+		if (req) {
+			// Set the request handler
+			curl_easy_setopt(curl, CURLOPT_READFUNCTION, cb_read_stream);
+			// Provde the request data
+			curl_easy_setopt(curl, CURLOPT_READDATA, &post.req);
+			// Let curl rewind it if it has to send it again
+			curl_easy_setopt(curl, CURLOPT_SEEKFUNCTION, cb_seek_stream);
+			curl_easy_setopt(curl, CURLOPT_SEEKDATA, &post.req);
+			/* Set the expected POST size */
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE, req_length);
+		}
+		else {
+			// Send it straight from the caller's memory
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDSIZE_LARGE, (curl_off_t)data.length());
+			curl_easy_setopt(curl, CURLOPT_POSTFIELDS, data.data());
+		}
+	}
+	prepare_response(curl, p, post.response);
+	// Don't pass on the reply if the host refuses the compressed request
+	post.response.drop_refused = !post.body.empty();
+	if (post.content_type.length()) {
+		post.headers = curl_slist_append(post.headers, ("Content-Type: " + post.content_type).c_str());
+	}
+	if (post.headers) {
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, post.headers);
+	}
+	// Set the connection and overall timeouts from the host's policy
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)p.connect_timeout.count());
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)p.timeout.count());
 	/* some servers don't like requests that are made without a user-agent
 	field, so we provide one */
-	curl_easy_setopt(curl_, CURLOPT_USERAGENT, USER_AGENT.c_str());
+	curl_easy_setopt(curl, CURLOPT_USERAGENT, USER_AGENT.c_str());
 	// Error buffer
-	char* error_msg = new char[CURL_ERROR_SIZE];
-	curl_easy_setopt(curl_, CURLOPT_ERRORBUFFER, error_msg);
+	error_msg[0] = '\0';
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_msg);
 
 	if (zc_app::debug(DEBUG_CURL)) {
 		// Add extra verbosity
-		curl_easy_setopt(curl_, CURLOPT_DEBUGFUNCTION, cb_debug);
-		curl_easy_setopt(curl_, CURLOPT_VERBOSE, 1);
+		curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, cb_debug);
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
+	}
+	return !post.body.empty();
+}
+
+// Get the host from the URL
+std::string zc_url_handler::url_host(const std::string& url) {
+	std::string host;
+	CURLU* h = curl_url();
+	char* part = nullptr;
+	if (h && curl_url_set(h, CURLUPART_URL, url.c_str(), 0) == CURLUE_OK &&
+		curl_url_get(h, CURLUPART_HOST, &part, 0) == CURLUE_OK) {
+		host = part;
+		curl_free(part);
+	}
+	curl_url_cleanup(h);
+	return host;
+}
+
+// Compress requests to the host
+void zc_url_handler::compress_requests(const std::string& host, bool enable) {
+	compress_lock_.lock();
+	if (enable) {
+		compress_hosts_.insert(host);
+	}
+	else {
+		compress_hosts_.erase(host);
+	}
+	compress_lock_.unlock();
+}
+
+// Are requests to the URL's host compressed
+bool zc_url_handler::compress_host(const std::string& url) {
+	compress_lock_.lock();
+	bool compress = !compress_hosts_.empty() && compress_hosts_.count(url_host(url)) != 0;
+	compress_lock_.unlock();
+	return compress;
+}
+
+// Read the URL (HTTP GET) and write it back to the output stream
+bool zc_url_handler::read_url(std::string url, std::ostream* os) {
+	if (cache_enabled_) {
+		std::string data;
+		if (!read_cached(url, data)) return false;
+		os->write(data.data(), data.length());
+		return true;
 	}
+
+	CURLcode result;
+	// Start a new transfer
+	CURL* curl = acquire_handle();
+	if (curl == nullptr) {
+		printf("ERROR - URL_HANDLER: failed to get an instance of 'curl'\n");
+		return false;
+	}
+	char error_msg[CURL_ERROR_SIZE];
+	response_sink response;
+	response.os = os;
+	prepare_get(curl, url, &response, error_msg);
+
 	/* get it! */
-	result = curl_easy_perform(curl_);
+	result = perform(curl, url, nullptr, true, &response);
 
 	/* check for errors */
 	if (result != CURLE_OK) {
 		printf("ERROR - URL_HANDLER: %s\n", error_msg);
-		curl_easy_cleanup(curl_);
-		lock_.unlock();
+		release_handle(curl);
 		return false;
 	}
 
-
 	/* reset transfer details */
-	curl_easy_cleanup(curl_);
-	lock_.unlock();
+	release_handle(curl);
 
 	return true;
 }
 
+// Set the policy for the host - or the default
+void zc_url_handler::policy(const std::string& host, const host_policy& p) {
+	hosts_lock_.lock();
+	if (host.empty()) {
+		default_policy_ = p;
+	}
+	else {
+		host_state& state = hosts_[host];
+		state.policy = p;
+		state.has_policy = true;
+	}
+	hosts_lock_.unlock();
+	// A waiting transfer may now be allowed
+	hosts_cv_.notify_all();
+	if (multi_) curl_multi_wakeup(multi_);
+}
+
+// Get the policy for the host
+zc_url_handler::host_policy zc_url_handler::policy(const std::string& host) {
+	std::lock_guard<std::mutex> lock(hosts_lock_);
+	auto it = hosts_.find(host);
+	if (it != hosts_.end() && it->second.has_policy) {
+		return it->second.policy;
+	}
+	return default_policy_;
+}
+
+// Start a transfer if the host has a free slot and a token
+bool zc_url_handler::try_admit(const std::string& host, std::chrono::steady_clock::time_point& when) {
+	std::lock_guard<std::mutex> lock(hosts_lock_);
+	return try_admit_locked(host, when);
+}
+
+// Start a transfer if the host has a free slot and a token - hosts_lock_ is held
+bool zc_url_handler::try_admit_locked(const std::string& host, std::chrono::steady_clock::time_point& when) {
+	host_state& state = hosts_[host];
+	const host_policy& p = state.has_policy ? state.policy : default_policy_;
+	if (p.max_concurrent > 0 && state.active >= p.max_concurrent) {
+		// Wait for leave
+		when = std::chrono::steady_clock::time_point::max();
+		return false;
+	}
+	if (p.max_rate > 0.0) {
+		// Top up the token bucket for the time since it was last done
+		auto now = std::chrono::steady_clock::now();
+		double burst = (double)std::max(p.burst, 1);
+		if (state.refilled.time_since_epoch().count() == 0) {
+			state.tokens = burst;
+		}
+		else {
+			std::chrono::duration<double> elapsed = now - state.refilled;
+			state.tokens = std::min(burst, state.tokens + elapsed.count() * p.max_rate);
+		}
+		state.refilled = now;
+		if (state.tokens < 1.0) {
+			// Time until the next whole token
+			std::chrono::duration<double> wait((1.0 - state.tokens) / p.max_rate);
+			when = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>(wait);
+			return false;
+		}
+		state.tokens -= 1.0;
+	}
+	state.active++;
+	return true;
+}
+
+// Wait for a free slot and a token
+void zc_url_handler::admit(const std::string& host) {
+	std::chrono::steady_clock::time_point when;
+	// Check and wait under the same lock so that a leave cannot be missed
+	std::unique_lock<std::mutex> lock(hosts_lock_);
+	while (!try_admit_locked(host, when)) {
+		if (when == std::chrono::steady_clock::time_point::max()) {
+			hosts_cv_.wait(lock);
+		}
+		else {
+			hosts_cv_.wait_until(lock, when);
+		}
+	}
+}
+
+// Free the slot
+void zc_url_handler::leave(const std::string& host) {
+	hosts_lock_.lock();
+	hosts_[host].active--;
+	hosts_lock_.unlock();
+	hosts_cv_.notify_all();
+	// The transfer thread may have transfers waiting for the slot
+	if (multi_) curl_multi_wakeup(multi_);
+}
+
+// Returns the time between the two points of the transfer - zero if the phase did not happen
+static std::chrono::microseconds phase(curl_off_t from, curl_off_t to) {
+	return std::chrono::microseconds(to > from ? to - from : 0);
+}
+
+// Add the timing and sizes of the attempt to the host's totals
+void zc_url_handler::record(const std::string& host, CURL* curl, CURLcode result, bool retrying) {
+	// Each time is from the start of the attempt
+	curl_off_t dns = 0, connect = 0, tls = 0, pretransfer = 0, first_byte = 0, total = 0;
+	curl_easy_getinfo(curl, CURLINFO_NAMELOOKUP_TIME_T, &dns);
+	curl_easy_getinfo(curl, CURLINFO_CONNECT_TIME_T, &connect);
+	curl_easy_getinfo(curl, CURLINFO_APPCONNECT_TIME_T, &tls);
+	curl_easy_getinfo(curl, CURLINFO_PRETRANSFER_TIME_T, &pretransfer);
+	curl_easy_getinfo(curl, CURLINFO_STARTTRANSFER_TIME_T, &first_byte);
+	curl_easy_getinfo(curl, CURLINFO_TOTAL_TIME_T, &total);
+	curl_off_t sent = 0, received = 0;
+	curl_easy_getinfo(curl, CURLINFO_SIZE_UPLOAD_T, &sent);
+	curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+	long code = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+	transfer_timing timing;
+	timing.dns = phase(0, dns);
+	timing.connect = phase(dns, connect);
+	timing.tls = phase(connect, tls);
+	timing.first_byte = phase(pretransfer, first_byte);
+	timing.total = phase(0, total);
+
+	hosts_lock_.lock();
+	host_metrics& m = hosts_[host].metrics;
+	m.transfers++;
+	if (retrying) m.retries++;
+	if (result != CURLE_OK && code == 0) m.errors++;
+	else if (code >= 400) m.http_errors++;
+	m.bytes_sent += sent;
+	m.bytes_received += received;
+	m.time.dns += timing.dns;
+	m.time.connect += timing.connect;
+	m.time.tls += timing.tls;
+	m.time.first_byte += timing.first_byte;
+	m.time.total += timing.total;
+	if (timing.total > m.slowest.total) m.slowest = timing;
+	hosts_lock_.unlock();
+
+	if (zc_app::debug(DEBUG_CURL)) {
+		printf("URL_HANDLER: %s %ld - DNS %lld, connect %lld, TLS %lld, first byte %lld, total %lld us - %lld bytes sent, %lld received\n",
+			host.c_str(), code, (long long)timing.dns.count(), (long long)timing.connect.count(),
+			(long long)timing.tls.count(), (long long)timing.first_byte.count(), (long long)timing.total.count(),
+			(long long)sent, (long long)received);
+	}
+}
+
+// Get the totals for the host
+zc_url_handler::host_metrics zc_url_handler::metrics(const std::string& host) {
+	std::lock_guard<std::mutex> lock(hosts_lock_);
+	auto it = hosts_.find(host);
+	return it == hosts_.end() ? host_metrics() : it->second.metrics;
+}
+
+// Get the totals for all the hosts
+std::map<std::string, zc_url_handler::host_metrics> zc_url_handler::metrics() {
+	std::map<std::string, host_metrics> result;
+	std::lock_guard<std::mutex> lock(hosts_lock_);
+	for (auto& it : hosts_) {
+		if (it.second.metrics.transfers) result[it.first] = it.second.metrics;
+	}
+	return result;
+}
+
+// Start counting again
+void zc_url_handler::reset_metrics() {
+	std::lock_guard<std::mutex> lock(hosts_lock_);
+	for (auto& it : hosts_) {
+		it.second.metrics = host_metrics();
+	}
+}
+
+// Decide if and when to try again
+std::chrono::milliseconds zc_url_handler::retry_delay(const host_policy& p, int attempt, CURL* curl, CURLcode result,
+	bool idempotent) {
+	const std::chrono::milliseconds no_retry(-1);
+	if (attempt >= p.max_retries) return no_retry;
+	long code = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+	bool retry = false;
+	if (busy_status(code)) {
+		// The server is busy and has not acted on the request - its reply has been dropped
+		retry = true;
+	}
+	else {
+		// Never retry once the caller has been given some of the response
+		curl_off_t received = 0;
+		curl_easy_getinfo(curl, CURLINFO_SIZE_DOWNLOAD_T, &received);
+		if (received > 0) return no_retry;
+		switch (result) {
+		case CURLE_COULDNT_RESOLVE_HOST:
+		case CURLE_COULDNT_CONNECT:
+			// The request has not been sent
+			retry = true;
+			break;
+		case CURLE_OPERATION_TIMEDOUT:
+		case CURLE_SEND_ERROR:
+		case CURLE_RECV_ERROR:
+		case CURLE_GOT_NOTHING:
+		case CURLE_SSL_CONNECT_ERROR:
+			// The request may have been acted on
+			retry = idempotent;
+			break;
+		default:
+			break;
+		}
+	}
+	if (!retry) return no_retry;
+	// Exponential backoff - with a random half so that clients that failed together spread out
+	std::chrono::milliseconds limit = p.max_retry_delay;
+	if (attempt < 30 && p.retry_delay * (1LL << attempt) < limit) {
+		limit = p.retry_delay * (1LL << attempt);
+	}
+	static thread_local std::minstd_rand generator(std::random_device{}());
+	std::uniform_int_distribution<long long> jitter(0, limit.count() / 2);
+	std::chrono::milliseconds delay(limit.count() - limit.count() / 2 + jitter(generator));
+	// The server may ask for longer
+	curl_off_t retry_after = 0;
+	if (curl_easy_getinfo(curl, CURLINFO_RETRY_AFTER, &retry_after) == CURLE_OK && retry_after > 0) {
+		delay = std::max(delay, std::min(p.max_retry_delay, std::chrono::milliseconds(retry_after * 1000)));
+	}
+	return delay;
+}
+
+// Run the transfer when the policy allows it, and again if it fails for a transient reason
+CURLcode zc_url_handler::perform(CURL* curl, const std::string& url, stream_reader* req, bool idempotent,
+	response_sink* response) {
+	std::string host = url_host(url);
+	host_policy p = policy(host);
+	for (int attempt = 0; ; attempt++) {
+		// Pass a busy reply on once there are no more attempts
+		if (response) response->drop_busy = attempt < p.max_retries;
+		admit(host);
+		CURLcode result = curl_easy_perform(curl);
+		leave(host);
+		std::chrono::milliseconds delay = retry_delay(p, attempt, curl, result, idempotent);
+		record(host, curl, result, delay.count() >= 0);
+		if (delay.count() < 0) return result;
+		if (zc_app::debug(DEBUG_CURL)) {
+			printf("URL_HANDLER: Retrying %s in %d ms\n", url.c_str(), (int)delay.count());
+		}
+		std::this_thread::sleep_for(delay);
+		if (req) {
+			// Send the request from the start again
+			req->is->clear();
+			req->is->seekg(req->start);
+		}
+	}
+}
+
 // Perform an HTTP PUT operation - this may respond with data
 bool zc_url_handler::post_url(std::string url, std::string resource, std::istream* req, std::ostream* resp) {
+	return do_post(url, resource, req, std::string_view(), resp);
+}
+
+// Perform an HTTP POST operation from memory
+bool zc_url_handler::post_url(std::string url, std::string resource, std::string_view req, std::ostream* resp) {
+	return do_post(url, resource, nullptr, req, resp);
+}
+
+// Perform an HTTP POST operation from memory with a Content-Type
+bool zc_url_handler::post_url(std::string url, std::string resource, std::string content_type, std::string_view req,
+	std::ostream* resp, long& code, std::string& error) {
+	return do_post(url, resource, nullptr, req, resp, content_type, &code, &error);
+}
+
+//! Read-only view of a whole file mapped into memory
+class mapped_file {
+public:
+	mapped_file(const std::string& filename);
+	~mapped_file();
+	//! Returns true if the file was opened and mapped.
+	bool ok() const { return ok_; }
+	//! The file contents.
+	std::string_view data() const { return std::string_view(data_, length_); }
+
+protected:
+#ifdef _WIN32
+	HANDLE file_;          //!< The open file
+	HANDLE mapping_;       //!< The mapping of the file
+#else
+	int fd_;               //!< The open file
+#endif
+	const char* data_;     //!< Start of the mapped contents
+	size_t length_;        //!< Size of the file
+	bool ok_;              //!< Opened and mapped
+};
+
+// Open the file and map it
+mapped_file::mapped_file(const std::string& filename)
+	: data_(nullptr)
+	, length_(0)
+	, ok_(false)
+{
+#ifdef _WIN32
+	mapping_ = nullptr;
+	file_ = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+	if (file_ == INVALID_HANDLE_VALUE) return;
+	LARGE_INTEGER size;
+	if (!GetFileSizeEx(file_, &size)) return;
+	length_ = (size_t)size.QuadPart;
+	if (length_ == 0) {
+		// Cannot map an empty file
+		ok_ = true;
+		return;
+	}
+	mapping_ = CreateFileMappingA(file_, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (mapping_ == nullptr) return;
+	data_ = (const char*)MapViewOfFile(mapping_, FILE_MAP_READ, 0, 0, 0);
+	ok_ = data_ != nullptr;
+#else
+	fd_ = open(filename.c_str(), O_RDONLY);
+	if (fd_ < 0) return;
+	struct stat st;
+	if (fstat(fd_, &st) != 0) return;
+	length_ = (size_t)st.st_size;
+	if (length_ == 0) {
+		// Cannot map an empty file
+		ok_ = true;
+		return;
+	}
+	void* map = mmap(nullptr, length_, PROT_READ, MAP_PRIVATE, fd_, 0);
+	if (map == MAP_FAILED) return;
+	// It is read once from start to end
+	madvise(map, length_, MADV_SEQUENTIAL);
+	data_ = (const char*)map;
+	ok_ = true;
+#endif
+}
+
+// Unmap and close the file
+mapped_file::~mapped_file()
+{
+#ifdef _WIN32
+	if (data_) UnmapViewOfFile(data_);
+	if (mapping_) CloseHandle(mapping_);
+	if (file_ != INVALID_HANDLE_VALUE) CloseHandle(file_);
+#else
+	if (data_) munmap((void*)data_, length_);
+	if (fd_ >= 0) close(fd_);
+#endif
+}
+
+// Perform an HTTP POST operation from a file
+bool zc_url_handler::post_file(std::string url, std::string resource, std::string filename, std::ostream* resp) {
+	mapped_file file(filename);
+	if (!file.ok()) {
+		printf("URL_HANDLER: ERROR - cannot read %s\n", filename.c_str());
+		return false;
+	}
+	return do_post(url, resource, nullptr, file.data(), resp);
+}
+
+// POST the stream or memory
+bool zc_url_handler::do_post(const std::string& url, const std::string& resource, std::istream* req, std::string_view data,
+	std::ostream* resp, const std::string& content_type, long* code, std::string* error) {
 
-    lock_.lock();
 	CURLcode result;
 	// Start a new transfer
-	curl_ = curl_easy_init();
+	CURL* curl = acquire_handle();
+	if (curl == nullptr) {
+		printf("URL_HANDLER: ERROR - failed to get an instance of 'curl'\n");
+		return false;
+	}
+	char error_msg[CURL_ERROR_SIZE];
+	post_state post;
+	post.response.os = resp;
+	post.content_type = content_type;
+	bool compressed = prepare_post(curl, url, resource, req, data, error_msg, post);
 
-	// Get the request length
-	std::streampos startpos = req->tellg();
-	req->seekg(0, std::ios::end);
-	std::streampos endpos = req->tellg();
-	long req_length = (long)(endpos - startpos);
-	req->seekg(0, std::ios::beg);
+	/* get it! */
+	result = perform(curl, url, req && post.body.empty() ? &post.req : nullptr, false, &post.response);
 
-	// Specify the URL
-	curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
-	/* now specify we want to POST data */
-	curl_easy_setopt(curl_, CURLOPT_POST, 1L);
-	// Request target
-	if (resource.length()) {
-		curl_easy_setopt(curl_, CURLOPT_REQUEST_TARGET, resource.c_str());
-	}
-	// Set the request handler
-	curl_easy_setopt(curl_, CURLOPT_READFUNCTION, cb_read);
-	// Provde the request data
-	curl_easy_setopt(curl_, CURLOPT_READDATA, req);
-	/* Set the expected POST size */
-	curl_easy_setopt(curl_, CURLOPT_POSTFIELDSIZE, req_length);
-	/* send all data to this function  */
-	curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, cb_write);
-	/* we pass the output stream to the callback function */
-	curl_easy_setopt(curl_, CURLOPT_WRITEDATA, resp);
-	// Set connection timeout to 10s
-	curl_easy_setopt(curl_, CURLOPT_CONNECTTIMEOUT, 10L);
-	// Set overall timeout to 30s
-	curl_easy_setopt(curl_, CURLOPT_TIMEOUT, 30L);
-	/* some servers don't like requests that are made without a user-agent
-	field, so we provide one */
-	curl_easy_setopt(curl_, CURLOPT_USERAGENT, USER_AGENT.c_str());
-	// Error buffer
-	char* error_msg = new char[CURL_ERROR_SIZE];
-	curl_easy_setopt(curl_, CURLOPT_ERRORBUFFER, error_msg);
+	long http_code = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &http_code);
+	release_handle(curl);
+	curl_slist_free_all(post.headers);
+	if (code) *code = http_code;
+	/* check for errors */
+	if (result != CURLE_OK) {
+		if (error) {
+			*error = error_msg[0] ? error_msg : curl_easy_strerror(result);
+		}
+		else {
+			printf("URL_HANDLER: ERROR %s\n", error_msg);
+		}
+		return false;
+	}
+	if (compressed && http_code == 415) {
+		// The host does not accept compressed requests after all - send it plain
+		compress_requests(url_host(url), false);
+		return do_post(url, resource, req, data, resp, content_type, code, error);
+	}
+	return true;
+}
 
-	if (zc_app::debug(DEBUG_CURL)) {
-		// Add extra verbosity
-		curl_easy_setopt(curl_, CURLOPT_DEBUGFUNCTION, cb_debug);
-		curl_easy_setopt(curl_, CURLOPT_VERBOSE, 1);
+// Performa an HTTP POST FORM operation 
+bool zc_url_handler::post_form(std::string url, std::vector<field_pair> fields, std::istream* req, std::ostream* resp) {
+	return do_post_form(url, fields, req, std::string_view(), resp);
+}
+
+// Performa an HTTP POST FORM operation from memory
+bool zc_url_handler::post_form(std::string url, const std::vector<field_pair>& fields, std::string_view req, std::ostream* resp) {
+	return do_post_form(url, fields, nullptr, req, resp);
+}
+
+// Send the next part of the request stream
+size_t zc_url_handler::cb_read_stream(char* data, size_t size, size_t nmemb, void* userp) {
+	return cb_read(data, size, nmemb, ((stream_reader*)userp)->is);
+}
+
+// Go back in the request stream (eg to send it again) - the offset is from the start of the request
+int zc_url_handler::cb_seek_stream(void* userp, curl_off_t offset, int origin) {
+	stream_reader* reader = (stream_reader*)userp;
+	if (origin != SEEK_SET) {
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+	reader->is->clear();
+	reader->is->seekg(reader->start + (std::streamoff)offset);
+	return reader->is->fail() ? CURL_SEEKFUNC_FAIL : CURL_SEEKFUNC_OK;
+}
+
+// Send the next part of the field data
+size_t zc_url_handler::cb_read_view(char* data, size_t size, size_t nmemb, void* userp) {
+	view_reader* reader = (view_reader*)userp;
+	size_t count = reader->data.copy(data, size * nmemb, reader->position);
+	reader->position += count;
+	return count;
+}
+
+// Go back (eg to resend after a redirect)
+int zc_url_handler::cb_seek_view(void* userp, curl_off_t offset, int origin) {
+	view_reader* reader = (view_reader*)userp;
+	if (origin != SEEK_SET || offset < 0 || (size_t)offset > reader->data.length()) {
+		return CURL_SEEKFUNC_CANTSEEK;
+	}
+	reader->position = (size_t)offset;
+	return CURL_SEEKFUNC_OK;
+}
+
+// If line is the header name, set value to its (trimmed) value
+static bool header_value(const char* line, size_t length, const char* name, std::string& value) {
+	size_t len_name = strlen(name);
+	if (length <= len_name || line[len_name] != ':') return false;
+	for (size_t ix = 0; ix < len_name; ix++) {
+		if (tolower((unsigned char)line[ix]) != tolower((unsigned char)name[ix])) return false;
+	}
+	size_t start = len_name + 1;
+	while (start < length && (line[start] == ' ' || line[start] == '\t')) start++;
+	size_t end = length;
+	while (end > start && (line[end - 1] == '\r' || line[end - 1] == '\n' || line[end - 1] == ' ')) end--;
+	value.assign(line + start, end - start);
+	return true;
+}
+
+// Handles the response headers of a download - keep the validators for the next conditional GET and the caching directives
+size_t zc_url_handler::cb_header(char* data, size_t size, size_t nmemb, void* dl) {
+	size_t real_size = size * nmemb;
+	download* d = (download*)dl;
+	if (real_size > 5 && strncmp(data, "HTTP/", 5) == 0) {
+		// Status line - a new response (eg after a redirect) so forget the last one's
+		d->etag.clear();
+		d->last_modified.clear();
+		d->cache_control.clear();
+		d->expires.clear();
+		return real_size;
+	}
+	std::string value;
+	if (header_value(data, real_size, "Cache-Control", value)) {
+		// The directives may be spread over several headers
+		if (d->cache_control.length()) d->cache_control += ',';
+		d->cache_control += value;
 	}
+	else if (!header_value(data, real_size, "ETag", d->etag) &&
+		!header_value(data, real_size, "Last-Modified", d->last_modified)) {
+		header_value(data, real_size, "Expires", d->expires);
+	}
+	return real_size;
+}
+
+// Handles the URL GET callback - append the data to the buffer, reserved to the full size first time
+size_t zc_url_handler::cb_write_buffer(char* data, size_t size, size_t nmemb, void* dl) {
+	size_t real_size = size * nmemb;
+	download* d = (download*)dl;
+	if (!d->sized) {
+		curl_off_t length = -1;
+		if (curl_easy_getinfo(d->curl, CURLINFO_CONTENT_LENGTH_DOWNLOAD_T, &length) == CURLE_OK && length > 0) {
+			d->buffer->reserve(d->buffer->size() + (size_t)length);
+		}
+		d->sized = true;
+	}
+	d->buffer->append(data, real_size);
+	return real_size;
+}
+
+// Handles the URL GET callback - write the data straight to the file
+size_t zc_url_handler::cb_write_file(char* data, size_t size, size_t nmemb, void* dl) {
+	return fwrite(data, size, nmemb, ((download*)dl)->file) * size;
+}
+
+// GET the URL into the download - with If-None-Match and If-Modified-Since from the validator
+bool zc_url_handler::read_download(const std::string& url, download& dl, url_validator* validator) {
+	CURLcode result;
+	// Start a new transfer
+	CURL* curl = acquire_handle();
+	if (curl == nullptr) {
+		printf("ERROR - URL_HANDLER: failed to get an instance of 'curl'\n");
+		return false;
+	}
+	dl.curl = curl;
+	dl.sized = false;
+	char error_msg[CURL_ERROR_SIZE];
+	prepare_get(curl, url, nullptr, error_msg);
+	// Replace the stream with the download
+	curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, dl.file ? cb_write_file : cb_write_buffer);
+	curl_easy_setopt(curl, CURLOPT_WRITEDATA, &dl);
+	curl_easy_setopt(curl, CURLOPT_HEADERFUNCTION, cb_header);
+	curl_easy_setopt(curl, CURLOPT_HEADERDATA, &dl);
+	// Don't keep an error page as the data
+	curl_easy_setopt(curl, CURLOPT_FAILONERROR, 1L);
+	// Only send the data if it has changed
+	struct curl_slist* headers = nullptr;
+	if (validator) {
+		validator->not_modified = false;
+		if (validator->etag.length()) {
+			headers = curl_slist_append(headers, ("If-None-Match: " + validator->etag).c_str());
+		}
+		if (validator->last_modified.length()) {
+			headers = curl_slist_append(headers, ("If-Modified-Since: " + validator->last_modified).c_str());
+		}
+		curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+	}
+
 	/* get it! */
-	result = curl_easy_perform(curl_);
+	result = perform(curl, url, nullptr, true, nullptr);
 
+	long code = 0;
+	curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+	dl.code = code;
+	release_handle(curl);
+	curl_slist_free_all(headers);
 	/* check for errors */
 	if (result != CURLE_OK) {
-		char msg[256];
-		memset(msg, 0, sizeof(msg));
-		printf(msg, sizeof(msg), "URL_HANDLER: ERROR %s\n", error_msg);
-		// Reset the operation and clean up
+		printf("ERROR - URL_HANDLER: %s\n", error_msg);
+		return false;
+	}
+	if (validator) {
+		if (code == 304) {
+			// Our copy is up to date - keep its validators
+			validator->not_modified = true;
+		}
+		else {
+			validator->etag = dl.etag;
+			validator->last_modified = dl.last_modified;
+		}
+	}
+	return true;
+}
 
-		curl_easy_reset(curl_);
-		curl_easy_cleanup(curl_);
-		lock_.unlock();
+// Read the URL (HTTP GET) into memory
+bool zc_url_handler::read_url(std::string url, std::string& data, url_validator* validator) {
+	if (cache_enabled_ && validator == nullptr) {
+		return read_cached(url, data);
+	}
+	download dl;
+	dl.buffer = &data;
+	dl.file = nullptr;
+	return read_download(url, dl, validator);
+}
+
+// Read the URL (HTTP GET) into a file - via a temporary file so a failure leaves the old one
+bool zc_url_handler::read_url_to_file(std::string url, std::string filename, url_validator* validator) {
+	std::string partname = filename + ".part";
+	download dl;
+	dl.buffer = nullptr;
+	dl.file = fopen(partname.c_str(), "wb");
+	if (dl.file == nullptr) {
+		printf("ERROR - URL_HANDLER: cannot write %s\n", partname.c_str());
+		return false;
+	}
+	// Write in large blocks rather than every time curl passes us data
+	std::vector<char> file_buffer(DOWNLOAD_BUFFER_SIZE);
+	setvbuf(dl.file, file_buffer.data(), _IOFBF, file_buffer.size());
+	bool ok = read_download(url, dl, validator);
+	if (fclose(dl.file) != 0) ok = false;
+	if (!ok || (validator && validator->not_modified)) {
+		remove(partname.c_str());
+		return ok;
+	}
+#ifdef _WIN32
+	// rename will not replace an existing file
+	remove(filename.c_str());
+#endif
+	if (rename(partname.c_str(), filename.c_str()) != 0) {
+		printf("ERROR - URL_HANDLER: cannot rename %s\n", partname.c_str());
+		remove(partname.c_str());
 		return false;
 	}
+	return true;
+}
 
-	/* reset transfer details */
-	curl_easy_cleanup(curl_);
-    lock_.unlock();
+// Use the cache for read_url - in the working directory if there is one
+void zc_url_handler::cache_responses(bool enable, size_t max_memory, uint64_t max_disk) {
+	std::lock_guard<std::mutex> lock(cache_lock_);
+	cache_max_memory_ = max_memory;
+	cache_max_disk_ = max_disk;
+	if (!enable) {
+		cache_lru_.clear();
+		cache_index_.clear();
+		cache_memory_ = 0;
+		cache_enabled_ = false;
+		return;
+	}
+	cache_directory_.clear();
+	if (file_holder_) {
+		std::string directory = file_holder_->get_directory(FDD_REF_WORKING) + "url_cache/";
+		std::error_code ec;
+		std::filesystem::create_directories(directory, ec);
+		if (ec) {
+			printf("ERROR - URL_HANDLER: cannot create %s - caching in memory only\n", directory.c_str());
+		}
+		else {
+			cache_directory_ = directory;
+			// Count what is there from before - and trim it to the limit
+			cache_trim_disk(cache_max_disk_ ? cache_max_disk_ : UINT64_MAX);
+		}
+	}
+	cache_enabled_ = true;
+}
+
+// Forget all the cached responses
+void zc_url_handler::clear_cache() {
+	std::lock_guard<std::mutex> lock(cache_lock_);
+	cache_lru_.clear();
+	cache_index_.clear();
+	cache_memory_ = 0;
+	if (cache_directory_.length()) {
+		std::error_code ec;
+		for (auto& file : std::filesystem::directory_iterator(cache_directory_, ec)) {
+			std::filesystem::remove(file.path(), ec);
+		}
+	}
+	cache_disk_ = 0;
+}
+
+// The file is named by the SHA-1 of the URL
+std::string zc_url_handler::cache_filename(const std::string& url) const {
+	if (cache_directory_.empty()) return "";
+	return cache_directory_ + zc::string_to_hex(zc::sha1(url)) + ".cache";
+}
+
+// Look in memory and then on disk
+zc_url_handler::cache_entry* zc_url_handler::cache_find(const std::string& url) {
+	auto it = cache_index_.find(url);
+	if (it != cache_index_.end()) {
+		cache_lru_.splice(cache_lru_.begin(), cache_lru_, it->second);
+		return &cache_lru_.front();
+	}
+	std::string filename = cache_filename(url);
+	if (filename.empty()) return nullptr;
+	std::ifstream is(filename, std::ios::binary);
+	if (!is.good()) return nullptr;
+	// URL, ETag, Last-Modified and expiry time on a line each, then the response
+	cache_entry entry;
+	std::string expires;
+	std::getline(is, entry.url);
+	std::getline(is, entry.validator.etag);
+	std::getline(is, entry.validator.last_modified);
+	std::getline(is, expires);
+	if (!is.good() || entry.url != url) return nullptr;
+	entry.expires = (time_t)strtoll(expires.c_str(), nullptr, 10);
+	std::streampos start = is.tellg();
+	is.seekg(0, std::ios::end);
+	entry.data.resize((size_t)(is.tellg() - start));
+	is.seekg(start);
+	is.read(&entry.data[0], entry.data.length());
+	if (is.fail()) return nullptr;
+	cache_memory_ += entry.url.length() + entry.data.length();
+	cache_lru_.push_front(std::move(entry));
+	cache_index_[url] = cache_lru_.begin();
+	// Make room - but keep this one
+	cache_trim(1);
+	return &cache_lru_.front();
+}
+
+// Replace any entry for the URL - the oldest are dropped from memory to make room
+void zc_url_handler::cache_store(cache_entry&& entry) {
+	cache_remove(entry.url);
+	cache_write(entry);
+	cache_memory_ += entry.url.length() + entry.data.length();
+	std::string url = entry.url;
+	cache_lru_.push_front(std::move(entry));
+	cache_index_[url] = cache_lru_.begin();
+	cache_trim(0);
+}
+
+// Drop the least recently used from memory - they are still on disk
+void zc_url_handler::cache_trim(size_t keep) {
+	while (cache_memory_ > cache_max_memory_ && cache_lru_.size() > keep) {
+		cache_entry& oldest = cache_lru_.back();
+		cache_memory_ -= oldest.url.length() + oldest.data.length();
+		cache_index_.erase(oldest.url);
+		cache_lru_.pop_back();
+	}
+}
+
+// Write the entry via a temporary file so a reader never sees half of it
+void zc_url_handler::cache_write(const cache_entry& entry) {
+	std::string filename = cache_filename(entry.url);
+	if (filename.empty()) return;
+	std::string partname = filename + ".part";
+	std::ofstream os(partname, std::ios::binary | std::ios::trunc);
+	std::string header = entry.url + '\n' + entry.validator.etag + '\n' + entry.validator.last_modified + '\n' +
+		std::to_string((long long)entry.expires) + '\n';
+	os.write(header.data(), header.length());
+	os.write(entry.data.data(), entry.data.length());
+	os.close();
+	if (os.fail()) {
+		printf("ERROR - URL_HANDLER: cannot write %s\n", partname.c_str());
+		remove(partname.c_str());
+		return;
+	}
+	// Any earlier copy is replaced
+	std::error_code ec;
+	uintmax_t replaced = std::filesystem::file_size(filename, ec);
+	if (!ec) cache_disk_ -= std::min<uint64_t>(cache_disk_, replaced);
+#ifdef _WIN32
+	// rename will not replace an existing file
+	remove(filename.c_str());
+#endif
+	if (rename(partname.c_str(), filename.c_str()) != 0) {
+		printf("ERROR - URL_HANDLER: cannot rename %s\n", partname.c_str());
+		remove(partname.c_str());
+		return;
+	}
+	cache_disk_ += header.length() + entry.data.length();
+	if (cache_max_disk_ && cache_disk_ > cache_max_disk_) {
+		// Well below the limit so that the directory is not scanned after every write
+		cache_trim_disk(cache_max_disk_ / 4 * 3);
+	}
+}
+
+// Delete the files written longest ago
+void zc_url_handler::cache_trim_disk(uint64_t target) {
+	struct cache_file {
+		std::filesystem::path path;
+		std::filesystem::file_time_type written;
+		uintmax_t size;
+	};
+	std::vector<cache_file> files;
+	uint64_t total = 0;
+	std::error_code ec;
+	for (auto& file : std::filesystem::directory_iterator(cache_directory_, ec)) {
+		std::error_code fec;
+		cache_file f{ file.path(), file.last_write_time(fec), 0 };
+		if (!fec) f.size = file.file_size(fec);
+		if (fec) continue;
+		total += f.size;
+		files.push_back(std::move(f));
+	}
+	if (total > target) {
+		std::sort(files.begin(), files.end(), [](const cache_file& a, const cache_file& b) {
+			return a.written < b.written;
+		});
+		for (auto& f : files) {
+			if (total <= target) break;
+			if (std::filesystem::remove(f.path, ec)) total -= f.size;
+		}
+	}
+	cache_disk_ = total;
+}
+
+// Forget the URL
+void zc_url_handler::cache_remove(const std::string& url) {
+	auto it = cache_index_.find(url);
+	if (it != cache_index_.end()) {
+		cache_memory_ -= it->second->url.length() + it->second->data.length();
+		cache_lru_.erase(it->second);
+		cache_index_.erase(it);
+	}
+	std::string filename = cache_filename(url);
+	if (filename.length()) {
+		std::error_code ec;
+		uintmax_t size = std::filesystem::file_size(filename, ec);
+		if (!ec && remove(filename.c_str()) == 0) cache_disk_ -= std::min<uint64_t>(cache_disk_, size);
+	}
+}
+
+// Cache-Control no-store, no-cache or max-age, otherwise Expires - revalidate every time if none
+time_t zc_url_handler::cache_expiry(const download& dl, time_t now) {
+	std::string directives = dl.cache_control;
+	for (char& c : directives) c = (char)tolower((unsigned char)c);
+	if (directives.find("no-store") != std::string::npos) return -1;
+	if (directives.find("no-cache") != std::string::npos) return now;
+	size_t pos = directives.find("max-age=");
+	if (pos != std::string::npos) {
+		return now + (time_t)strtoll(directives.c_str() + pos + 8, nullptr, 10);
+	}
+	if (dl.expires.length()) {
+		time_t expires = curl_getdate(dl.expires.c_str(), nullptr);
+		if (expires != -1) return expires;
+	}
+	return now;
+}
+
+// Read the URL (HTTP GET) through the cache - the server is only asked when the cached copy has expired
+bool zc_url_handler::read_cached(const std::string& url, std::string& data) {
+	time_t now = time(nullptr);
+	url_validator validator;
+	bool cached = false;
+	cache_lock_.lock();
+	cache_entry* entry = cache_find(url);
+	if (entry) {
+		if (now < entry->expires) {
+			data += entry->data;
+			cache_lock_.unlock();
+			if (zc_app::debug(DEBUG_CURL)) {
+				printf("URL_HANDLER: %s from cache\n", url.c_str());
+			}
+			return true;
+		}
+		validator = entry->validator;
+		cached = true;
+	}
+	cache_lock_.unlock();
+
+	// Ask the server - only for the data if it has changed since the cached copy
+	std::string response;
+	download dl;
+	dl.buffer = &response;
+	dl.file = nullptr;
+	bool ok = read_download(url, dl, cached ? &validator : nullptr);
+	time_t expires = cache_expiry(dl, now);
+
+	std::unique_lock<std::mutex> lock(cache_lock_);
+	entry = cached ? cache_find(url) : nullptr;
+	if (!ok) {
+		if (entry && dl.code == 0) {
+			// Offline - the cached copy is better than nothing
+			printf("URL_HANDLER: WARNING using cached copy of %s\n", url.c_str());
+			data += entry->data;
+			return true;
+		}
+		return false;
+	}
+	if (validator.not_modified) {
+		if (entry) {
+			if (expires > now) {
+				entry->expires = expires;
+				cache_write(*entry);
+			}
+			data += entry->data;
+			if (zc_app::debug(DEBUG_CURL)) {
+				printf("URL_HANDLER: %s not modified - from cache\n", url.c_str());
+			}
+			return true;
+		}
+		// The cache was cleared meanwhile - fetch it all
+		lock.unlock();
+		return read_cached(url, data);
+	}
+	if (expires < 0) {
+		cache_remove(url);
+	}
+	else {
+		cache_entry fresh;
+		fresh.url = url;
+		fresh.data = response;
+		fresh.validator.etag = dl.etag;
+		fresh.validator.last_modified = dl.last_modified;
+		fresh.expires = expires;
+		cache_store(std::move(fresh));
+	}
+	data += response;
 	return true;
 }
 
-// Performa an HTTP POST FORM operation 
-bool zc_url_handler::post_form(std::string url, std::vector<field_pair> fields, std::istream* req, std::ostream* resp) {
-	lock_.lock();
+// Start an HTTP GET on the transfer thread
+std::future<bool> zc_url_handler::read_url_async(std::string url, std::ostream* os, transfer_fn done) {
+	transfer* t = new transfer;
+	t->done = done;
+	t->curl = acquire_handle();
+	if (t->curl) {
+		t->post.response.os = os;
+		prepare_get(t->curl, url, &t->post.response, t->error_msg);
+	}
+	return start_transfer(t, url, true);
+}
+
+// Start an HTTP POST on the transfer thread
+std::future<bool> zc_url_handler::post_url_async(std::string url, std::string resource, std::istream* req, std::ostream* resp,
+	transfer_fn done) {
+	transfer* t = new transfer;
+	t->done = done;
+	t->curl = acquire_handle();
+	if (t->curl) {
+		t->post.response.os = resp;
+		prepare_post(t->curl, url, resource, req, std::string_view(), t->error_msg, t->post);
+	}
+	return start_transfer(t, url, false);
+}
+
+// Start an HTTP POST from memory on the transfer thread
+std::future<bool> zc_url_handler::post_url_async(std::string url, std::string resource, std::string_view req, std::ostream* resp,
+	transfer_fn done) {
+	transfer* t = new transfer;
+	t->done = done;
+	t->curl = acquire_handle();
+	if (t->curl) {
+		t->post.response.os = resp;
+		prepare_post(t->curl, url, resource, nullptr, req, t->error_msg, t->post);
+	}
+	return start_transfer(t, url, false);
+}
+
+// Queue the transfer and wake the transfer thread
+std::future<bool> zc_url_handler::start_transfer(transfer* t, const std::string& url, bool idempotent) {
+	std::future<bool> result = t->result.get_future();
+	if (t->curl == nullptr || multi_ == nullptr) {
+		printf("URL_HANDLER: ERROR - failed to get an instance of 'curl'\n");
+		if (t->curl) release_handle(t->curl);
+		t->curl = nullptr;
+		finish_transfer(t, CURLE_FAILED_INIT);
+		return result;
+	}
+	curl_easy_setopt(t->curl, CURLOPT_PRIVATE, t);
+	t->host = url_host(url);
+	t->policy = policy(t->host);
+	t->idempotent = idempotent;
+	multi_lock_.lock();
+	multi_pending_.push_back(t);
+	if (!multi_thread_.joinable()) {
+		multi_thread_ = std::thread(&zc_url_handler::multi_thread, this);
+	}
+	multi_lock_.unlock();
+	curl_multi_wakeup(multi_);
+	return result;
+}
+
+// Return the handle to the pool and tell the caller
+void zc_url_handler::finish_transfer(transfer* t, CURLcode result) {
+	bool ok = result == CURLE_OK;
+	if (t->curl) {
+		if (!ok) {
+			printf("URL_HANDLER: ERROR %s\n", t->error_msg[0] ? t->error_msg : curl_easy_strerror(result));
+		}
+		else if (t->post.body.length()) {
+			long code = 0;
+			curl_easy_getinfo(t->curl, CURLINFO_RESPONSE_CODE, &code);
+			if (code == 415) {
+				// Refused the compressed request - the caller must send it again
+				char* url = nullptr;
+				curl_easy_getinfo(t->curl, CURLINFO_EFFECTIVE_URL, &url);
+				if (url) compress_requests(url_host(url), false);
+				ok = false;
+			}
+		}
+		release_handle(t->curl);
+	}
+	curl_slist_free_all(t->post.headers);
+	if (t->done) {
+		t->done(ok);
+	}
+	t->result.set_value(ok);
+	delete t;
+}
+
+// Add the queued transfers to the multi handle as their hosts' policies allow and drive them all until closing
+void zc_url_handler::multi_thread() {
+	std::vector<transfer*> active;
+	std::vector<transfer*> starting;
+	// Waiting for the policy of the host (or a retry delay) to allow them to start
+	std::vector<transfer*> waiting;
+	while (true) {
+		multi_lock_.lock();
+		bool closing = multi_closing_;
+		starting.swap(multi_pending_);
+		multi_lock_.unlock();
+		if (closing) break;
+		waiting.insert(waiting.end(), starting.begin(), starting.end());
+		starting.clear();
+		// Start those that are allowed - and note when to look again at the rest
+		auto now = std::chrono::steady_clock::now();
+		auto wake = now + std::chrono::seconds(1);
+		for (auto it = waiting.begin(); it != waiting.end(); ) {
+			transfer* t = *it;
+			std::chrono::steady_clock::time_point when = t->not_before;
+			if (now >= t->not_before && try_admit(t->host, when)) {
+				// Pass a busy reply on once there are no more attempts
+				t->post.response.drop_busy = t->attempt < t->policy.max_retries;
+				curl_multi_add_handle(multi_, t->curl);
+				active.push_back(t);
+				it = waiting.erase(it);
+			}
+			else {
+				wake = std::min(wake, when);
+				it++;
+			}
+		}
+		// Move data on all the transfers that are ready
+		int running = 0;
+		curl_multi_perform(multi_, &running);
+		// And report those that have finished
+		CURLMsg* msg;
+		int left;
+		while ((msg = curl_multi_info_read(multi_, &left)) != nullptr) {
+			if (msg->msg != CURLMSG_DONE) continue;
+			transfer* t = nullptr;
+			curl_easy_getinfo(msg->easy_handle, CURLINFO_PRIVATE, (char**)&t);
+			CURLcode result = msg->data.result;
+			curl_multi_remove_handle(multi_, t->curl);
+			for (auto it = active.begin(); it != active.end(); it++) {
+				if (*it == t) {
+					active.erase(it);
+					break;
+				}
+			}
+			leave(t->host);
+			std::chrono::milliseconds delay = retry_delay(t->policy, t->attempt, t->curl, result, t->idempotent);
+			record(t->host, t->curl, result, delay.count() >= 0);
+			if (delay.count() >= 0) {
+				// Try again later
+				if (zc_app::debug(DEBUG_CURL)) {
+					char* url = nullptr;
+					curl_easy_getinfo(t->curl, CURLINFO_EFFECTIVE_URL, &url);
+					printf("URL_HANDLER: Retrying %s in %d ms\n", url ? url : "", (int)delay.count());
+				}
+				t->attempt++;
+				t->not_before = std::chrono::steady_clock::now() + delay;
+				wake = std::min(wake, t->not_before);
+				if (t->post.req.is && t->post.body.empty()) {
+					// Send the request from the start again
+					t->post.req.is->clear();
+					t->post.req.is->seekg(t->post.req.start);
+				}
+				waiting.push_back(t);
+			}
+			else {
+				finish_transfer(t, result);
+			}
+		}
+		// Wait for activity, the next transfer to be allowed, or a wakeup from start_transfer or leave
+		auto timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wake - std::chrono::steady_clock::now());
+		curl_multi_poll(multi_, nullptr, 0, timeout.count() > 0 ? (int)timeout.count() : 0, nullptr);
+	}
+	// Closing - fail anything still going
+	for (transfer* t : active) {
+		curl_multi_remove_handle(multi_, t->curl);
+		leave(t->host);
+		finish_transfer(t, CURLE_ABORTED_BY_CALLBACK);
+	}
+	for (transfer* t : waiting) {
+		finish_transfer(t, CURLE_ABORTED_BY_CALLBACK);
+	}
+	for (transfer* t : starting) {
+		finish_transfer(t, CURLE_ABORTED_BY_CALLBACK);
+	}
+}
+
+// POST FORM the fields - any without a value take the stream or memory
+bool zc_url_handler::do_post_form(const std::string& url, const std::vector<field_pair>& fields, std::istream* req,
+	std::string_view data, std::ostream* resp) {
 	CURLcode result;
 	// Start a new transfer
-	curl_ = curl_easy_init();
+	CURL* curl = acquire_handle();
+	if (curl == nullptr) {
+		printf("URL_HANDLER: ERROR - failed to get an instance of 'curl'\n");
+		return false;
+	}
 	curl_mime* form = nullptr;
 	curl_mimepart* field = nullptr;
+	// One reader for each field that sends the data - the list does not move them
+	std::list<view_reader> readers;
+	// The request stream - sent by fields without a value
+	stream_reader upload;
+	response_sink response;
+	response.os = resp;
 
 
 	// Specify the URL
-	curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
-	/* send all data to this function  */
-	curl_easy_setopt(curl_, CURLOPT_WRITEFUNCTION, cb_write);
-	/* we pass the output stream to the callback function */
-	curl_easy_setopt(curl_, CURLOPT_WRITEDATA, resp);
-	// Set connection timeout to 10s
-	curl_easy_setopt(curl_, CURLOPT_CONNECTTIMEOUT, 10L);
-	// Set overall timeout to 30s
-	curl_easy_setopt(curl_, CURLOPT_TIMEOUT, 30L);
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+	host_policy p = policy(url_host(url));
+	prepare_response(curl, p, response);
+	// Set the connection and overall timeouts from the host's policy
+	curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)p.connect_timeout.count());
+	curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)p.timeout.count());
 	// now apend the form fields
-	form = curl_mime_init(curl_);
+	form = curl_mime_init(curl);
 	for (auto it = fields.begin(); it != fields.end(); it++) {
 		field = curl_mime_addpart(form);
 		curl_mime_name(field, (*it).name.c_str());
@@ -240,14 +1524,21 @@ bool zc_url_handler::post_form(std::string url, std::vector<field_pair> fields,
 			curl_mime_data(field, (*it).value.c_str(), (*it).value.length());
 		}
 		else if (req != nullptr) {
-			// Get the request length
-			std::streampos startpos = req->tellg();
+			// Get the request length - from where the stream is now to its end
+			upload.is = req;
+			upload.start = req->tellg();
 			req->seekg(0, std::ios::end);
 			std::streampos endpos = req->tellg();
-			long req_length = (long)(endpos - startpos);
-			req->seekg(0, std::ios::beg);
+			long req_length = (long)(endpos - upload.start);
+			req->seekg(upload.start);
 			// Use the specified input stream
-			curl_mime_data_cb(field, req_length, cb_read, nullptr, nullptr, req);
+			curl_mime_data_cb(field, req_length, cb_read_stream, cb_seek_stream, nullptr, &upload);
+		}
+		else if (data.data() != nullptr) {
+			// Read straight from the caller's memory
+			readers.emplace_back();
+			readers.back().data = data;
+			curl_mime_data_cb(field, (curl_off_t)data.length(), cb_read_view, cb_seek_view, nullptr, &readers.back());
 		}
 		else {
 		}
@@ -261,39 +1552,37 @@ bool zc_url_handler::post_form(std::string url, std::vector<field_pair> fields,
 		}
 	}
 	// Add the form to the post
-	curl_easy_setopt(curl_, CURLOPT_MIMEPOST, form);
+	curl_easy_setopt(curl, CURLOPT_MIMEPOST, form);
 	if (zc_app::debug(DEBUG_CURL)) {
 		// Add extra verbosity
-		curl_easy_setopt(curl_, CURLOPT_DEBUGFUNCTION, cb_debug);
-		curl_easy_setopt(curl_, CURLOPT_VERBOSE, 1);
+		curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, cb_debug);
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 	}
 	/* get it! */
-	result = curl_easy_perform(curl_);
+	result = perform(curl, url, nullptr, false, &response);
 
 	/* check for errors */
 	if (result != CURLE_OK) {
-		// NB: This doesn't clean up all the memory
 		// Reset the operation and clean up
-		curl_easy_reset(curl_);
-		curl_easy_cleanup(curl_);
-		lock_.unlock();
+		release_handle(curl);
+		curl_mime_free(form);
 		return false;
 	}
 	else {
 		long code;
 		// Check the HTTP response
-		if (curl_easy_getinfo(curl_, CURLINFO_RESPONSE_CODE, &code) == CURLE_OK) {
+		if (curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code) == CURLE_OK) {
 			if (code != 200) {
-				lock_.unlock();
+				release_handle(curl);
+				curl_mime_free(form);
 				return false;
 			}
 		}
 	}
 
 	/* reset transfer details */
-	curl_easy_cleanup(curl_);
+	release_handle(curl);
 	curl_mime_free(form);
-    lock_.unlock();
 	return true;
 }
 
@@ -302,35 +1591,32 @@ bool zc_url_handler::send_email(std::string url, std::string user, std::string p
 	std::vector<std::string> to_list, std::vector<std::string> cc_list, std::vector<std::string> bcc_list,
 	std::string subject, std::string payload, std::vector<std::string> attachments, std::vector<std::string> formats) {
 
-	lock_.lock();
 	CURLcode result;
 	char text[128];
 	// Start a new transfer
-	curl_ = curl_easy_init();
-
-	if (curl_ == nullptr) {
+	CURL* curl = acquire_handle();
+	if (curl == nullptr) {
 		printf("URL_HANDLER: ERROR - failed to get an instance of 'curl'\n");
-		lock_.unlock();
 		return false;
 	}
 
 	if (zc_app::debug(DEBUG_CURL)) {
 		// Add extra verbosity
-		curl_easy_setopt(curl_, CURLOPT_DEBUGFUNCTION, cb_debug);
-		curl_easy_setopt(curl_, CURLOPT_VERBOSE, 1);
+		curl_easy_setopt(curl, CURLOPT_DEBUGFUNCTION, cb_debug);
+		curl_easy_setopt(curl, CURLOPT_VERBOSE, 1L);
 	}
 
 	// Set username and password
-	curl_easy_setopt(curl_, CURLOPT_USERNAME, user.c_str());
-	curl_easy_setopt(curl_, CURLOPT_PASSWORD, password.c_str());
+	curl_easy_setopt(curl, CURLOPT_USERNAME, user.c_str());
+	curl_easy_setopt(curl, CURLOPT_PASSWORD, password.c_str());
 	// Set the URL address of the mail server
-	curl_easy_setopt(curl_, CURLOPT_URL, url.c_str());
+	curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
 	// Set SSL
-	curl_easy_setopt(curl_, CURLOPT_USE_SSL, CURLUSESSL_ALL);
+	curl_easy_setopt(curl, CURLOPT_USE_SSL, CURLUSESSL_ALL);
 
 	// Set the sender 
 	snprintf(text, sizeof(text), "<%s>", user.c_str());
-	curl_easy_setopt(curl_, CURLOPT_MAIL_FROM, text);
+	curl_easy_setopt(curl, CURLOPT_MAIL_FROM, text);
 	// Add the recipients - which hopefully should not be seen
 	struct curl_slist* recipients = nullptr;
 	for (auto it = to_list.begin(); it != to_list.end(); it++) {
@@ -342,9 +1628,9 @@ bool zc_url_handler::send_email(std::string url, std::string user, std::string p
 	for (auto it = bcc_list.begin(); it != bcc_list.end(); it++) {
 		recipients = curl_slist_append(recipients, (*it).c_str());
 	}
-	curl_easy_setopt(curl_, CURLOPT_MAIL_RCPT, recipients);
+	curl_easy_setopt(curl, CURLOPT_MAIL_RCPT, recipients);
 	/* allow one of the recipients to fail and still consider it okay */
-	curl_easy_setopt(curl_, CURLOPT_MAIL_RCPT_ALLLOWFAILS, 1L);
+	curl_easy_setopt(curl, CURLOPT_MAIL_RCPT_ALLLOWFAILS, 1L);
 
 	// Add the header Date:, To: From: Cc: Subject:
 	struct curl_slist* headers = nullptr;
@@ -365,9 +1651,9 @@ bool zc_url_handler::send_email(std::string url, std::string user, std::string p
 	snprintf(text, sizeof(text), "Subject: %s", subject.c_str());
 	headers = curl_slist_append(headers, text);
 	headers = curl_slist_append(headers, "");
-	curl_easy_setopt(curl_, CURLOPT_HTTPHEADER, headers);
+	curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
 	// Now add the txt
-	curl_mime* mime = curl_mime_init(curl_);
+	curl_mime* mime = curl_mime_init(curl);
 	curl_mimepart* part = curl_mime_addpart(mime);
 	curl_mime_data(part, payload.c_str(), payload.length());
 	curl_mime_type(part, "text/plain; charset=\"utf-8\"");
@@ -379,35 +1665,32 @@ bool zc_url_handler::send_email(std::string url, std::string user, std::string p
 		curl_mime_encoder(part, "base64");
 	}
 	// Add the mime to the mail
-	curl_easy_setopt(curl_, CURLOPT_MIMEPOST, mime);
+	curl_easy_setopt(curl, CURLOPT_MIMEPOST, mime);
 
 	// Add debug and error stuff
-	char* error_msg = new char[CURL_ERROR_SIZE];
-	curl_easy_setopt(curl_, CURLOPT_ERRORBUFFER, error_msg);
+	char error_msg[CURL_ERROR_SIZE] = "";
+	curl_easy_setopt(curl, CURLOPT_ERRORBUFFER, error_msg);
 
 	// Now send the e-mail
-	result = curl_easy_perform(curl_);
+	result = curl_easy_perform(curl);
 
 	/* check for errors */
 	if (result != CURLE_OK) {
 		printf("URL_HANDLER: ERROR - %s", error_msg);
-		// Reset the operation and clean up
-
+		// Reset the operation and clean up - the handle no longer refers to the lists
+		release_handle(curl);
 		curl_slist_free_all(recipients);
 		curl_slist_free_all(headers);
-		curl_easy_reset(curl_);
-		curl_easy_cleanup(curl_);
-		lock_.unlock();
+		curl_mime_free(mime);
 		return false;
 	}
 
 	// Now tidy up
+	release_handle(curl);
 	curl_slist_free_all(recipients);
 	curl_slist_free_all(headers);
+	curl_mime_free(mime);
 
-	curl_easy_cleanup(curl_);
-
-	lock_.unlock();
 	return true;
 
 }
@@ -678,46 +678,88 @@ unsigned char zc::decode_base_64(unsigned char c) {
 // Convert from base64 encoding for string
 std::string zc::decode_base_64(std::string value) {
 	std::string result;
-	unsigned char out = 0;
-	unsigned char in = 0;
-	// Each data byte provides 6 bits of the required string
-	for (size_t i = 0; i < value.length(); i++) {
-		// Get the base64 character
-		unsigned char base_64 = value[i];
-		// Convert to the next 6 bits of the string
-		in = decode_base_64(base_64);
-		// Is it a padding byte?
-		if (in != 0xFF) {
-			// 4 base64 characters make 3 bytes
-			switch (i % 4) {
-			case 0:
-				// First 6 bits of output byte 0
-				out = in << 2;
-				break;
-			case 1:
-				// Last 2 bits of output byte 0
-				out |= (in & 0x30) >> 4;
-				result += out;
-				// First 4 bytes of output byte 1
-				out = (in & 0x0F) << 4;
-				break;
-			case 2:
-				// last 4 bits of output byte 1
-				out |= (in & 0x3C) >> 2;
-				result += out;
-				// first 2 bits of output byte 2
-				out = (in & 0x03) << 6;
-				break;
-			case 3:
-				// last 6 bits of output byte 2
-				out |= in;
-				result += out;
-				out = 0;
-				break;
+	decode_base_64(value.data(), value.length(), result);
+	return result;
+}
+
+// Maximum decoded length - 3 bytes for every 4 characters or part thereof
+size_t zc::base_64_decoded_length(size_t length) {
+	return (length + 3) / 4 * 3;
+}
+
+// Decode base64 appending to out
+bool zc::decode_base_64(const char* text, size_t length, std::string& out) {
+	// Look-up table: 6-bit value, or one of the markers below
+	const unsigned char INVALID = 0xFF;
+	const unsigned char PAD = 0xFE;
+	const unsigned char SPACE = 0xFD;
+	static const struct table_t {
+		unsigned char value[256];
+		table_t() {
+			for (int c = 0; c < 256; c++) {
+				value[c] = decode_base_64((unsigned char)c);
 			}
+			value[(unsigned char)'='] = PAD;
+			for (unsigned char c : { ' ', '\t', '\r', '\n', '\f', '\v' }) value[c] = SPACE;
+		}
+	} table;
+	// Allow for the most output and trim it at the end
+	size_t start = out.length();
+	out.resize(start + base_64_decoded_length(length));
+	unsigned char* dest = (unsigned char*)&out[start];
+	const unsigned char* src = (const unsigned char*)text;
+	const unsigned char* end = src + length;
+	bool ok = true;
+	uint32_t bits = 0;
+	int count = 0;
+	while (src < end) {
+		// Fast path: four base64 characters make three bytes
+		if (count == 0 && end - src >= 4) {
+			unsigned char a = table.value[src[0]];
+			unsigned char b = table.value[src[1]];
+			unsigned char c = table.value[src[2]];
+			unsigned char d = table.value[src[3]];
+			if ((a | b | c | d) < 0x40) {
+				uint32_t group = (a << 18) | (b << 12) | (c << 6) | d;
+				dest[0] = (unsigned char)(group >> 16);
+				dest[1] = (unsigned char)(group >> 8);
+				dest[2] = (unsigned char)group;
+				dest += 3;
+				src += 4;
+				continue;
+			}
+		}
+		// One character at a time around whitespace, padding and errors
+		unsigned char in = table.value[*src++];
+		if (in == SPACE) continue;
+		if (in == PAD) break;
+		if (in == INVALID) {
+			ok = false;
+			continue;
+		}
+		bits = (bits << 6) | in;
+		if (++count == 4) {
+			dest[0] = (unsigned char)(bits >> 16);
+			dest[1] = (unsigned char)(bits >> 8);
+			dest[2] = (unsigned char)bits;
+			dest += 3;
+			bits = 0;
+			count = 0;
 		}
 	}
-	return result;
+	// A partial group - 2 characters make 1 byte, 3 make 2
+	if (count == 2) {
+		*dest++ = (unsigned char)(bits >> 4);
+	}
+	else if (count == 3) {
+		*dest++ = (unsigned char)(bits >> 10);
+		*dest++ = (unsigned char)(bits >> 2);
+	}
+	else if (count == 1) {
+		ok = false;
+	}
+	out.resize(dest - (unsigned char*)out.data());
+	return ok;
 }
 
 // Encode single character to base64
@@ -737,40 +779,111 @@ unsigned char zc::encode_base_64(unsigned char c) {
 // Encode the string to base64
 std::string zc::encode_base_64(const std::string& value) {
 	std::string result;
-	unsigned char out = 0;
-	unsigned char in = 0;
-	// Each 6 bits of the input string provides a byte of the output string
-	for (size_t i = 0; i < value.length(); i++) {
-		in = value[i];
-		// 3 bytes of input generate 4 bytes of output
-		switch (i % 3) {
-		case 0:
-			// write out first 6 bits of byte 0
-			out = (in & 0xFC) >> 2;
-			result += encode_base_64(out);
-			// save remeber last 2 bytes
-			out = (in & 0x03) << 4;
-			break;
-		case 1:
-			// concatenate first 4 bits of byte 1
-			out |= (in & 0xF0) >> 4;
-			result += encode_base_64(out);
-			// save last 4 bytes
-			out = (in & 0x0F) << 2;
-			break;
-		case 2:
-			// concatenate first 2 bits of byte 2
-			out |= (in & 0xC0) >> 6;
-			result += encode_base_64(out);
-			// write iut last 6 bits
-			out = in & 0x3F;
-			result += encode_base_64(out);
-			break;
+	encode_base_64(value.data(), value.length(), result);
+	return result;
+}
+
+// Encoded length - 4 characters for every 3 bytes or part thereof
+size_t zc::base_64_encoded_length(size_t length) {
+	return (length + 2) / 3 * 4;
+}
+
+// Encode to base64 appending to out
+void zc::encode_base_64(const char* data, size_t length, std::string& out) {
+	static const char look_up[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	// Size the output once and write into it
+	size_t start = out.length();
+	out.resize(start + base_64_encoded_length(length));
+	char* dest = &out[start];
+	const unsigned char* src = (const unsigned char*)data;
+	const unsigned char* end = src + length / 3 * 3;
+	// 3 bytes of input generate 4 bytes of output
+	for (; src < end; src += 3) {
+		uint32_t group = (src[0] << 16) | (src[1] << 8) | src[2];
+		dest[0] = look_up[(group >> 18) & 0x3F];
+		dest[1] = look_up[(group >> 12) & 0x3F];
+		dest[2] = look_up[(group >> 6) & 0x3F];
+		dest[3] = look_up[group & 0x3F];
+		dest += 4;
+	}
+	// Write out the remaining bits of a partial group and pad it
+	switch (length % 3) {
+	case 1: {
+		uint32_t group = src[0] << 16;
+		dest[0] = look_up[(group >> 18) & 0x3F];
+		dest[1] = look_up[(group >> 12) & 0x3F];
+		dest[2] = '=';
+		dest[3] = '=';
+		break;
+	}
+	case 2: {
+		uint32_t group = (src[0] << 16) | (src[1] << 8);
+		dest[0] = look_up[(group >> 18) & 0x3F];
+		dest[1] = look_up[(group >> 12) & 0x3F];
+		dest[2] = look_up[(group >> 6) & 0x3F];
+		dest[3] = '=';
+		break;
+	}
+	}
+}
+
+// SHA-1 digest (FIPS 180-4)
+std::string zc::sha1(const std::string& data) {
+	uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+	// Pad with 0x80, zeros and the 64-bit big-endian bit length to a multiple of 64 bytes
+	std::string message = data;
+	uint64_t bits = (uint64_t)data.length() * 8;
+	message += (char)0x80;
+	while (message.length() % 64 != 56) message += (char)0;
+	for (int ix = 7; ix >= 0; ix--) message += (char)((bits >> (ix * 8)) & 0xFF);
+	// Process each 512-bit block
+	auto rotl = [](uint32_t x, int n) { return (x << n) | (x >> (32 - n)); };
+	for (size_t block = 0; block < message.length(); block += 64) {
+		uint32_t w[80];
+		for (int ix = 0; ix < 16; ix++) {
+			const unsigned char* p = (const unsigned char*)message.data() + block + ix * 4;
+			w[ix] = ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+		}
+		for (int ix = 16; ix < 80; ix++) {
+			w[ix] = rotl(w[ix - 3] ^ w[ix - 8] ^ w[ix - 14] ^ w[ix - 16], 1);
+		}
+		uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+		for (int ix = 0; ix < 80; ix++) {
+			uint32_t f, k;
+			if (ix < 20) {
+				f = (b & c) | (~b & d);
+				k = 0x5A827999;
+			}
+			else if (ix < 40) {
+				f = b ^ c ^ d;
+				k = 0x6ED9EBA1;
+			}
+			else if (ix < 60) {
+				f = (b & c) | (b & d) | (c & d);
+				k = 0x8F1BBCDC;
+			}
+			else {
+				f = b ^ c ^ d;
+				k = 0xCA62C1D6;
+			}
+			uint32_t temp = rotl(a, 5) + f + e + k + w[ix];
+			e = d;
+			d = c;
+			c = rotl(b, 30);
+			b = a;
+			a = temp;
 		}
+		h[0] += a;
+		h[1] += b;
+		h[2] += c;
+		h[3] += d;
+		h[4] += e;
 	}
-	// Pad the resulting string
-	while (result.length() % 4 != 0) {
-		result += '=';
+	std::string result;
+	for (int ix = 0; ix < 5; ix++) {
+		for (int shift = 24; shift >= 0; shift -= 8) {
+			result += (char)((h[ix] >> shift) & 0xFF);
+		}
 	}
 	return result;
 }
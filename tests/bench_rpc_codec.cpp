@@ -0,0 +1,292 @@
+/*
+	Benchmark for zc_rpc_codec
+
+	This encodes and decodes a representative XML-RPC request and response
+	(a struct of mixed scalars and an array) repeatedly, first with zc_rpc_codec
+	with the decoded items in a zc_rpc_arena, then as JSON-RPC with
+	zc_rpc_json_codec, and then with a pugixml document tree - the way
+	zc_rpc_handler used to - and reports calls per second for each.
+
+	Usage: bench_rpc_codec [iterations] [array size] [base64 bytes]
+
+	If base64 bytes is given, the struct also carries a binary blob of that size.
+
+	Copyright 2026, Philip Rose, GM3ZZA
+*/
+
+#include "zc_rpc_codec.h"
+#include "zc_rpc_data_item.h"
+#include "zc_rpc_json_codec.h"
+#include "zc_utils.h"
+
+#include "pugixml.hpp"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+// Build the parameters for the test call
+static void build_params(int array_size, int blob_size, zc_rpc_data_item::rpc_list& params)
+{
+	zc_rpc_data_item* name = new zc_rpc_data_item;
+	name->set(std::string("GM3ZZA <test> & check"), XRT_STRING);
+	params.push_back(name);
+	zc_rpc_data_item::rpc_struct* str = new zc_rpc_data_item::rpc_struct;
+	zc_rpc_data_item* freq = new zc_rpc_data_item;
+	freq->set(14.074);
+	(*str)["frequency"] = freq;
+	zc_rpc_data_item* mode = new zc_rpc_data_item;
+	mode->set(std::string("FT8"), XRT_STRING);
+	(*str)["mode"] = mode;
+	zc_rpc_data_item* power = new zc_rpc_data_item;
+	power->set(100, XRT_INT);
+	(*str)["power"] = power;
+	zc_rpc_data_item* tx = new zc_rpc_data_item;
+	tx->set(1, XRT_BOOLEAN);
+	(*str)["transmit"] = tx;
+	zc_rpc_data_item::rpc_array* array = new zc_rpc_data_item::rpc_array;
+	for (int ix = 0; ix < array_size; ix++) {
+		zc_rpc_data_item* value = new zc_rpc_data_item;
+		value->set(ix * 3, XRT_INT);
+		array->push_back(value);
+	}
+	zc_rpc_data_item* levels = new zc_rpc_data_item;
+	levels->set(array);
+	(*str)["levels"] = levels;
+	if (blob_size) {
+		std::string bytes(blob_size, '\0');
+		for (int ix = 0; ix < blob_size; ix++) bytes[ix] = (char)(ix * 7);
+		zc_rpc_data_item* blob = new zc_rpc_data_item;
+		blob->set(bytes, XRT_BYTES);
+		(*str)["blob"] = blob;
+	}
+	zc_rpc_data_item* item = new zc_rpc_data_item;
+	item->set(str);
+	params.push_back(item);
+}
+
+// Reference: write an item into a pugixml node
+static void pugi_write(zc_rpc_data_item& item, pugi::xml_node& node)
+{
+	pugi::xml_node n_value = node.append_child("value");
+	switch (item.type()) {
+	case XRT_BOOLEAN:
+		n_value.append_child("boolean").text().set(item.get_int() == 1);
+		break;
+	case XRT_INT:
+		n_value.append_child("int").text().set(item.get_int());
+		break;
+	case XRT_DOUBLE:
+		n_value.append_child("double").text().set(item.get_double());
+		break;
+	case XRT_STRING:
+		n_value.append_child("string").text().set(item.get_string().c_str());
+		break;
+	case XRT_BYTES:
+		n_value.append_child("base64").text().set(zc::encode_base_64(item.get_string()).c_str());
+		break;
+	case XRT_ARRAY: {
+		pugi::xml_node n_data = n_value.append_child("array").append_child("data");
+		for (auto datum : *item.get_array()) pugi_write(*datum, n_data);
+		break;
+	}
+	case XRT_STRUCT: {
+		pugi::xml_node n_struct = n_value.append_child("struct");
+		for (auto& member : *item.get_struct()) {
+			pugi::xml_node n_member = n_struct.append_child("member");
+			n_member.append_child("name").text().set(member.first.c_str());
+			pugi_write(*member.second, n_member);
+		}
+		break;
+	}
+	default:
+		break;
+	}
+}
+
+// Reference: read the content of a <value> node
+static void pugi_read(pugi::xml_node n_value, zc_rpc_data_item& item)
+{
+	pugi::xml_node n_item = n_value.first_child();
+	const char* type = n_item.name();
+	if (strcmp(type, "array") == 0) {
+		zc_rpc_data_item::rpc_array* array = new zc_rpc_data_item::rpc_array;
+		for (auto n_datum : n_item.child("data").children("value")) {
+			zc_rpc_data_item* datum = new zc_rpc_data_item;
+			pugi_read(n_datum, *datum);
+			array->push_back(datum);
+		}
+		item.set(array);
+	}
+	else if (strcmp(type, "struct") == 0) {
+		zc_rpc_data_item::rpc_struct* str = new zc_rpc_data_item::rpc_struct;
+		for (auto member : n_item.children("member")) {
+			zc_rpc_data_item* datum = new zc_rpc_data_item;
+			pugi_read(member.child("value"), *datum);
+			(*str)[member.child("name").text().as_string()] = datum;
+		}
+		item.set(str);
+	}
+	else if (strcmp(type, "boolean") == 0) item.set(n_item.text().as_bool() ? 1 : 0, XRT_BOOLEAN);
+	else if (strcmp(type, "double") == 0) item.set(n_item.text().as_double());
+	else if (strcmp(type, "int") == 0 || strcmp(type, "i4") == 0) item.set(n_item.text().as_int(), XRT_INT);
+	else if (strcmp(type, "base64") == 0) item.set(zc::decode_base_64(n_item.text().as_string()), XRT_BYTES);
+	else item.set(std::string(n_item.text().as_string()), XRT_STRING);
+}
+
+// One call with the pugixml DOM - encode request, decode it, encode response, decode it
+static size_t pugi_call(zc_rpc_data_item::rpc_list& params)
+{
+	// Client: request
+	std::stringstream request;
+	{
+		pugi::xml_document doc;
+		auto n_decl = doc.append_child(pugi::node_declaration);
+		n_decl.append_attribute("version") = "1.0";
+		pugi::xml_node n_call = doc.append_child("methodCall");
+		n_call.append_child("methodName").text().set("bench.call");
+		pugi::xml_node n_params = n_call.append_child("params");
+		for (auto param : params) {
+			pugi::xml_node n_param = n_params.append_child("param");
+			pugi_write(*param, n_param);
+		}
+		doc.save(request, " ");
+	}
+	// Server: decode request and reply with the struct
+	std::stringstream response;
+	{
+		pugi::xml_document doc;
+		doc.load(request);
+		zc_rpc_data_item::rpc_list decoded;
+		for (auto n_param : doc.document_element().child("params").children("param")) {
+			zc_rpc_data_item* item = new zc_rpc_data_item;
+			pugi_read(n_param.child("value"), *item);
+			decoded.push_back(item);
+		}
+		pugi::xml_document out;
+		auto n_decl = out.append_child(pugi::node_declaration);
+		n_decl.append_attribute("version") = "1.0";
+		pugi::xml_node n_param = out.append_child("methodResponse").append_child("params").append_child("param");
+		pugi_write(*decoded.back(), n_param);
+		out.save(response, " ");
+		for (auto item : decoded) delete item;
+	}
+	// Client: decode response
+	size_t length = response.str().length();
+	pugi::xml_document doc;
+	doc.load(response);
+	zc_rpc_data_item result;
+	pugi_read(doc.document_element().child("params").child("param").child("value"), result);
+	return length;
+}
+
+// One call with zc_rpc_codec - decoded items are on the heap or in the arena if given
+static size_t codec_call(zc_rpc_data_item::rpc_list& params, std::string& request, std::string& response, zc_rpc_arena* arena)
+{
+	request.clear();
+	zc_rpc_codec::write_request("bench.call", &params, request);
+	std::string method_name;
+	zc_rpc_data_item::rpc_list decoded;
+	if (!zc_rpc_codec::read_request(request.data(), request.length(), method_name, &decoded, arena)) {
+		printf("Request did not decode\n");
+		exit(1);
+	}
+	response.clear();
+	zc_rpc_codec::write_response(false, decoded.back(), response);
+	if (arena) arena->release();
+	else for (auto item : decoded) delete item;
+	zc_rpc_data_item heap_result;
+	zc_rpc_data_item* result = arena ? arena->new_item() : &heap_result;
+	bool fault;
+	if (!zc_rpc_codec::read_response(response.data(), response.length(), result, fault, arena)) {
+		printf("Response did not decode\n");
+		exit(1);
+	}
+	if (arena) arena->release();
+	return response.length();
+}
+
+// One call with zc_rpc_json_codec - decoded items are in the arena
+static size_t json_call(zc_rpc_data_item::rpc_list& params, std::string& request, std::string& response, zc_rpc_arena& arena)
+{
+	request.clear();
+	zc_rpc_json_codec::write_request("bench.call", &params, "1", request);
+	std::string method_name;
+	std::string id;
+	zc_rpc_data_item::rpc_list decoded;
+	if (!zc_rpc_json_codec::read_request(request.data(), request.length(), method_name, &decoded, id, &arena)) {
+		printf("JSON request did not decode\n");
+		exit(1);
+	}
+	response.clear();
+	zc_rpc_json_codec::write_response(false, decoded.back(), id, response);
+	arena.release();
+	zc_rpc_data_item* result = arena.new_item();
+	bool fault;
+	if (!zc_rpc_json_codec::read_response(response.data(), response.length(), result, fault, &arena)) {
+		printf("JSON response did not decode\n");
+		exit(1);
+	}
+	arena.release();
+	return response.length();
+}
+
+int main(int argc, char** argv) {
+	int iterations = argc > 1 ? atoi(argv[1]) : 20000;
+	int array_size = argc > 2 ? atoi(argv[2]) : 16;
+	int blob_size = argc > 3 ? atoi(argv[3]) : 0;
+
+	zc_rpc_data_item::rpc_list params;
+	build_params(array_size, blob_size, params);
+
+	// Check the codec round trip before timing it
+	std::string request;
+	std::string response;
+	zc_rpc_arena arena;
+	codec_call(params, request, response, nullptr);
+	codec_call(params, request, response, &arena);
+	printf("Request %zu bytes, response %zu bytes\n", request.length(), response.length());
+	std::string json_request;
+	std::string json_response;
+	json_call(params, json_request, json_response, arena);
+	printf("JSON-RPC request %zu bytes, response %zu bytes\n", json_request.length(), json_response.length());
+
+	auto start = std::chrono::steady_clock::now();
+	size_t bytes = 0;
+	for (int ix = 0; ix < iterations; ix++) {
+		bytes += codec_call(params, request, response, nullptr);
+	}
+	double codec_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	for (int ix = 0; ix < iterations; ix++) {
+		bytes += codec_call(params, request, response, &arena);
+	}
+	double arena_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	for (int ix = 0; ix < iterations; ix++) {
+		bytes += json_call(params, json_request, json_response, arena);
+	}
+	double json_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	start = std::chrono::steady_clock::now();
+	for (int ix = 0; ix < iterations; ix++) {
+		bytes += pugi_call(params);
+	}
+	double pugi_time = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	printf("%d calls (encode and decode request and response), %d-element array, %d-byte base64\n",
+		iterations, array_size, blob_size);
+	printf("zc_rpc_codec (heap):  %.3f s, %.0f calls/s\n", codec_time, iterations / codec_time);
+	printf("zc_rpc_codec (arena): %.3f s, %.0f calls/s\n", arena_time, iterations / arena_time);
+	printf("zc_rpc_json_codec:    %.3f s, %.0f calls/s\n", json_time, iterations / json_time);
+	printf("pugixml DOM:          %.3f s, %.0f calls/s\n", pugi_time, iterations / pugi_time);
+	printf("Speed-up: %.1fx (heap), %.1fx (arena)\n", pugi_time / codec_time, pugi_time / arena_time);
+
+	for (auto item : params) delete item;
+	return bytes ? 0 : 1;
+}
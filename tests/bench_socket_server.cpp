@@ -0,0 +1,350 @@
+/*
+	Benchmark for zc_socket_server and zc_rpc_handler
+
+	This starts a server on the loopback interface and drives it from concurrent
+	client threads, each using a persistent connection, then reports requests per
+	second, client-measured latency percentiles and the process CPU use.
+
+	Usage: bench_socket_server [rpc|raw|client] [clients] [requests] [listeners] [payload]
+	  rpc       - XML-RPC method "bench.echo" through zc_rpc_handler (default)
+	  raw       - length-prefixed echo straight from zc_socket_server
+	  client    - as rpc, but the clients call zc_rpc_handler::do_request, sharing
+	              one client handler with a connection for each client thread
+	  clients   - number of client threads (default 8)
+	  requests  - requests sent by each client (default 2000)
+	  listeners - server listener threads (default 1)
+	  payload   - bytes of payload in each request (default 64)
+
+	Copyright 2026, Philip Rose, GM3ZZA
+*/
+
+#include "zc_rpc_data_item.h"
+#include "zc_rpc_handler.h"
+#include "zc_socket_server.h"
+#include "zc_status.h"
+
+#include <FL/Fl.H>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifdef _WIN32
+#include <WinSock2.h>
+#include <WS2tcpip.h>
+#else
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+// Application globals expected by the library
+std::string APP_NAME = "bench_socket_server";
+std::string APP_VERSION = "1.0";
+std::string APP_VENDOR = "GM3ZZA";
+std::string APP_TIMESTAMP = __DATE__ " " __TIME__;
+std::string APP_SOURCE_DIR = ".";
+std::string COPYRIGHT = "\302\251 Philip Rose GM3ZZA";
+std::string PARTY3RD_COPYRIGHT = "";
+std::string CONTACT = "gm3zza@@btinternet.com";
+std::string CONTACT2 = "gm3zza@btinternet.com";
+std::string DATA_COPYRIGHT = "";
+
+// Loopback port used by the benchmark
+const int BENCH_PORT = 18650;
+
+// Benchmark parameters
+bool rpc_mode = true;
+bool client_mode = false;
+int num_clients = 8;
+int num_requests = 2000;
+int num_listeners = 1;
+size_t payload_size = 64;
+
+// Raw server
+zc_socket_server* server = nullptr;
+// XML-RPC client for client mode
+zc_rpc_handler* rpc_client = nullptr;
+// Client results
+std::mutex mu_results;
+std::vector<double> latencies;
+std::atomic<int> clients_done{ 0 };
+std::atomic<int> client_errors{ 0 };
+
+// Returns CPU (user, system) seconds used by the process
+static void cpu_time(double& user, double& system)
+{
+#ifdef _WIN32
+	FILETIME create, exit, kernel, usr;
+	GetProcessTimes(GetCurrentProcess(), &create, &exit, &kernel, &usr);
+	auto seconds = [](const FILETIME& ft) {
+		return (((unsigned long long)ft.dwHighDateTime << 32) | ft.dwLowDateTime) / 1e7;
+	};
+	user = seconds(usr);
+	system = seconds(kernel);
+#else
+	rusage ru;
+	getrusage(RUSAGE_SELF, &ru);
+	user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+	system = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+#endif
+}
+
+// Close the client socket
+static void close_client(SOCKET s)
+{
+#ifdef _WIN32
+	closesocket(s);
+#else
+	close(s);
+#endif
+}
+
+// Send all the data - returns false on error
+static bool send_all(SOCKET s, const std::string& data)
+{
+	size_t sent = 0;
+	while (sent < data.length()) {
+		int n = send(s, data.data() + sent, (int)(data.length() - sent), 0);
+		if (n <= 0) return false;
+		sent += n;
+	}
+	return true;
+}
+
+// Receive exactly length bytes, appending them to data - returns false on error
+static bool recv_all(SOCKET s, size_t length, std::string& data)
+{
+	char buffer[4096];
+	while (length) {
+		int n = recv(s, buffer, (int)std::min(length, sizeof(buffer)), 0);
+		if (n <= 0) return false;
+		data.append(buffer, n);
+		length -= n;
+	}
+	return true;
+}
+
+// Receive an HTTP response - returns false on error
+static bool recv_http(SOCKET s, std::string& response)
+{
+	response.clear();
+	char buffer[4096];
+	size_t end_header;
+	// Read until the end of the header
+	while ((end_header = response.find("\r\n\r\n")) == std::string::npos) {
+		int n = recv(s, buffer, sizeof(buffer), 0);
+		if (n <= 0) return false;
+		response.append(buffer, n);
+	}
+	end_header += 4;
+	size_t pos = response.find("Content-Length:");
+	if (pos == std::string::npos || pos > end_header) return false;
+	size_t length = strtoul(response.c_str() + pos + 15, nullptr, 10);
+	if (response.length() < end_header + length) {
+		return recv_all(s, end_header + length - response.length(), response);
+	}
+	return true;
+}
+
+// Client thread for client mode - call bench.echo through zc_rpc_handler
+static void rpc_client_run(int id)
+{
+	std::vector<double> times;
+	times.reserve(num_requests);
+	zc_rpc_data_item* payload = new zc_rpc_data_item;
+	payload->set(std::string(payload_size, (char)('a' + id % 26)), XRT_STRING);
+	zc_rpc_data_item::rpc_list params = { payload };
+	for (int ix = 0; ix < num_requests; ix++) {
+		auto start = std::chrono::steady_clock::now();
+		zc_rpc_data_item response;
+		if (!rpc_client->do_request("bench.echo", &params, &response) ||
+			response.get_string() != payload->get_string()) {
+			client_errors++;
+			break;
+		}
+		times.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+	}
+	delete payload;
+	mu_results.lock();
+	latencies.insert(latencies.end(), times.begin(), times.end());
+	mu_results.unlock();
+	clients_done++;
+	Fl::awake();
+}
+
+// Client thread - send requests one at a time and time each round trip
+static void client_run(int id)
+{
+	std::vector<double> times;
+	times.reserve(num_requests);
+	SOCKET s = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+	sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(BENCH_PORT);
+	inet_pton(AF_INET, "127.0.0.1", &addr.sin_addr);
+	if (connect(s, (sockaddr*)&addr, sizeof(addr)) != 0) {
+		client_errors++;
+		clients_done++;
+		Fl::awake();
+		return;
+	}
+	int nodelay = 1;
+	setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (char*)&nodelay, sizeof(nodelay));
+	std::string payload(payload_size, (char)('a' + id % 26));
+	// Build the request once
+	std::string request;
+	if (rpc_mode) {
+		std::string body = "<?xml version=\"1.0\"?><methodCall><methodName>bench.echo</methodName>"
+			"<params><param><value><string>" + payload + "</string></value></param></params></methodCall>";
+		request = "POST /RPC2 HTTP/1.1\r\nHost: 127.0.0.1\r\nContent-Type: text/xml\r\nContent-Length: " +
+			std::to_string(body.length()) + "\r\n\r\n" + body;
+	}
+	else {
+		request.resize(4);
+		request[0] = (char)((payload_size >> 24) & 0xFF);
+		request[1] = (char)((payload_size >> 16) & 0xFF);
+		request[2] = (char)((payload_size >> 8) & 0xFF);
+		request[3] = (char)(payload_size & 0xFF);
+		request += payload;
+	}
+	std::string response;
+	for (int ix = 0; ix < num_requests; ix++) {
+		auto start = std::chrono::steady_clock::now();
+		bool ok = send_all(s, request);
+		if (ok) {
+			response.clear();
+			if (rpc_mode) {
+				ok = recv_http(s, response) && response.find(payload) != std::string::npos;
+			}
+			else {
+				ok = recv_all(s, 4 + payload_size, response) && response.compare(4, std::string::npos, payload) == 0;
+			}
+		}
+		if (!ok) {
+			client_errors++;
+			break;
+		}
+		times.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count());
+	}
+	close_client(s);
+	mu_results.lock();
+	latencies.insert(latencies.end(), times.begin(), times.end());
+	mu_results.unlock();
+	clients_done++;
+	Fl::awake();
+}
+
+// XML-RPC method bench.echo - returns its first parameter
+static int bench_echo(void* /*v*/, zc_rpc_data_item::rpc_list& params, zc_rpc_data_item& response)
+{
+	std::string s;
+	if (params.size()) params.front()->get(s);
+	response.set(s, XRT_STRING);
+	return 0;
+}
+
+// Raw server callback - echo the message back with the same length prefix
+static int raw_echo(void* /*v*/, std::stringstream& ss)
+{
+	const std::string& data = ss.str();
+	return server->send_response(nullptr, 0, data.data(), data.length());
+}
+
+// Returns the latency at fraction p of the sorted list
+static double percentile(const std::vector<double>& sorted, double p)
+{
+	if (sorted.empty()) return 0.0;
+	size_t ix = (size_t)(p * (sorted.size() - 1) + 0.5);
+	return sorted[ix];
+}
+
+int main(int argc, char** argv) {
+	if (argc > 1) rpc_mode = strcmp(argv[1], "raw") != 0;
+	if (argc > 1) client_mode = strcmp(argv[1], "client") == 0;
+	if (argc > 2) num_clients = std::max(1, atoi(argv[2]));
+	if (argc > 3) num_requests = std::max(1, atoi(argv[3]));
+	if (argc > 4) num_listeners = std::max(1, atoi(argv[4]));
+	if (argc > 5) payload_size = (size_t)std::max(1, atoi(argv[5]));
+
+	// Enable FLTK thread support - requests are handled in this thread via Fl::awake()
+	Fl::lock();
+	status_ = new zc_status(zc_status::HAS_CONSOLE, {});
+
+	// Start the server
+	zc_rpc_handler* rpc = nullptr;
+	if (rpc_mode) {
+		rpc = new zc_rpc_handler("127.0.0.1", BENCH_PORT, "/RPC2");
+		rpc->add_method(nullptr, { "bench.echo", "s:s", "Return the parameter" }, bench_echo);
+		rpc->add_metrics_method();
+		rpc->listeners(num_listeners);
+		rpc->run_server();
+		if (!rpc->has_server()) return 1;
+		if (client_mode) {
+			rpc_client = new zc_rpc_handler("http://127.0.0.1:" + std::to_string(BENCH_PORT), 0, "/RPC2");
+			rpc_client->client_connections(num_clients);
+		}
+	}
+	else {
+		server = new zc_socket_server(zc_socket_server::TCP_LENGTH, "127.0.0.1", BENCH_PORT);
+		server->listeners(num_listeners);
+		server->callback(nullptr, raw_echo);
+		server->run_server();
+		if (!server->has_server()) return 1;
+	}
+
+	// Run the clients while handling requests
+	double user0, system0, user1, system1;
+	cpu_time(user0, system0);
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> clients;
+	for (int ix = 0; ix < num_clients; ix++) {
+		clients.emplace_back(client_mode ? rpc_client_run : client_run, ix);
+	}
+	while (clients_done < num_clients) {
+		Fl::wait(0.1);
+	}
+	for (auto& t : clients) t.join();
+	double elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	cpu_time(user1, system1);
+
+	// Report
+	std::sort(latencies.begin(), latencies.end());
+	printf("Mode %s: %d clients x %d requests, %d listener(s), %zu-byte payload\n",
+		client_mode ? "client" : rpc_mode ? "rpc" : "raw", num_clients, num_requests, num_listeners, payload_size);
+	printf("Completed %zu requests in %.3f s: %.0f requests/s (%d errors)\n",
+		latencies.size(), elapsed, latencies.size() / elapsed, (int)client_errors);
+	printf("Latency (us): p50 %.1f  p90 %.1f  p99 %.1f  max %.1f\n",
+		percentile(latencies, 0.5), percentile(latencies, 0.9), percentile(latencies, 0.99),
+		latencies.empty() ? 0.0 : latencies.back());
+	double cpu = (user1 - user0) + (system1 - system0);
+	printf("CPU: user %.3f s  system %.3f s  (%.0f%% of one core, %.1f us per request)\n",
+		user1 - user0, system1 - system0, 100.0 * cpu / elapsed,
+		latencies.empty() ? 0.0 : 1e6 * cpu / latencies.size());
+
+	if (rpc_client) {
+		delete rpc_client;
+	}
+	if (rpc) {
+		rpc->close_server();
+		delete rpc;
+	}
+	if (server) {
+		zc_socket_server::metrics_t m = server->metrics();
+		printf("Server: max queue depth %llu, p99 handling < %.0f us\n",
+			(unsigned long long)m.max_queue_depth, m.latency_percentile(0.99));
+		delete server;
+	}
+	return client_errors ? 1 : 0;
+}
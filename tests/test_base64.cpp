@@ -0,0 +1,131 @@
+/*
+	Tests for the base64 and SHA-1 functions in zc_utils
+
+	This checks the RFC 4648 test vectors in both directions, decoding with
+	and without padding and around whitespace, the characters and lengths
+	that must be rejected, and the RFC 3174 SHA-1 digests.
+
+	Usage: test_base64
+
+	It prints each check that fails and returns the number of failures.
+
+	Copyright 2026, Philip Rose, GM3ZZA
+*/
+
+#include "zc_utils.h"
+
+#include <cstdio>
+#include <string>
+
+// Number of checks that have failed
+static int failures = 0;
+
+// Report the check if it failed
+static void check(bool ok, const char* text, int line)
+{
+	if (!ok) {
+		printf("FAILED line %d: %s\n", line, text);
+		failures++;
+	}
+}
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+// Decode the text - returns false if it is rejected
+static bool decode(const std::string& text, std::string& out)
+{
+	out.clear();
+	return zc::decode_base_64(text.data(), text.length(), out);
+}
+
+// Returns the data as lower-case hex without spaces
+static std::string hex(const std::string& data)
+{
+	const char* digits = "0123456789abcdef";
+	std::string result;
+	for (unsigned char c : data) {
+		result += digits[c >> 4];
+		result += digits[c & 0xF];
+	}
+	return result;
+}
+
+// RFC 4648 section 10 in both directions, and all byte values
+static void test_vectors()
+{
+	const struct vector_t {
+		std::string data;
+		std::string encoded;
+	} vectors[] = {
+		{ "", "" },
+		{ "f", "Zg==" },
+		{ "fo", "Zm8=" },
+		{ "foo", "Zm9v" },
+		{ "foob", "Zm9vYg==" },
+		{ "fooba", "Zm9vYmE=" },
+		{ "foobar", "Zm9vYmFy" },
+	};
+	std::string out;
+	for (auto& v : vectors) {
+		CHECK(zc::encode_base_64(v.data) == v.encoded);
+		CHECK(zc::base_64_encoded_length(v.data.length()) == v.encoded.length());
+		CHECK(decode(v.encoded, out) && out == v.data);
+	}
+	std::string all;
+	for (int c = 0; c < 256; c++) all += (char)c;
+	std::string encoded = zc::encode_base_64(all);
+	CHECK(decode(encoded, out) && out == all);
+	// Appends to what is there already
+	out = "x";
+	CHECK(zc::decode_base_64("Zm9v", 4, out) && out == "xfoo");
+}
+
+// Padding may be left off and whitespace is skipped
+static void test_lenient()
+{
+	std::string out;
+	CHECK(decode("Zg", out) && out == "f");
+	CHECK(decode("Zm8", out) && out == "fo");
+	CHECK(decode("Zm9vYg", out) && out == "foob");
+	CHECK(decode("Zm9v\r\nYmFy\r\n", out) && out == "foobar");
+	CHECK(decode(" Z m 9 v\tY g = = ", out) && out == "foob");
+	CHECK(decode("\n", out) && out.empty());
+	// Decoding stops at the padding
+	CHECK(decode("Zg==Zm9v", out) && out == "f");
+}
+
+// Characters outside the alphabet and a single character left over
+static void test_invalid()
+{
+	std::string out;
+	CHECK(!decode("Zm9v*YmFy", out));
+	CHECK(!decode("Zm9v-_", out));
+	CHECK(!decode("Zm9vY", out));
+	CHECK(!decode("Z", out));
+	CHECK(!decode(std::string("Zm\0v", 4), out));
+	CHECK(!decode("Zm9v\xc3\xa9", out));
+}
+
+// RFC 3174 section 7.3, and the digest used by the WebSocket handshake
+static void test_sha1()
+{
+	CHECK(hex(zc::sha1("abc")) == "a9993e364706816aba3e25717850c26c9cd0d89d");
+	CHECK(hex(zc::sha1("abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq")) ==
+		"84983e441c3bd26ebaae4aa1f95129e5e54670f1");
+	CHECK(hex(zc::sha1(std::string(1000000, 'a'))) == "34aa973cd4c4daa4f61eeb2bdbad27316534016f");
+	CHECK(hex(zc::sha1("")) == "da39a3ee5e6b4b0d3255bfef95601890afd80709");
+	// Lengths either side of the padding boundary
+	CHECK(hex(zc::sha1(std::string(55, 'a'))) == "c1c8bbdc22796e28c0e15163d20899b65621d65a");
+	CHECK(hex(zc::sha1(std::string(56, 'a'))) == "c2db330f6083854c99d4b5bfb6e8f29f201be699");
+	CHECK(zc::encode_base_64(zc::sha1("dGhlIHNhbXBsZSBub25jZQ==258EAFA5-E914-47DA-95CA-C5AB0DC85B11")) ==
+		"s3pPLMBiTxaQ9kYGzzhZRbK+xOo=");
+}
+
+int main(int argc, char** argv)
+{
+	test_vectors();
+	test_lenient();
+	test_invalid();
+	test_sha1();
+	printf("test_base64: %d failed\n", failures);
+	return failures;
+}
@@ -0,0 +1,132 @@
+/*
+	Tests for zc_http_parser
+
+	This parses requests and responses that arrive whole and in pieces, then
+	checks the handling of Content-Length - repeated, conflicting, empty, not
+	a number and too large - and of malformed headers.
+
+	Usage: test_http_parser
+
+	It prints each check that fails and returns the number of failures.
+
+	Copyright 2026, Philip Rose, GM3ZZA
+*/
+
+#include "zc_http_parser.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+// Number of checks that have failed
+static int failures = 0;
+
+// Report the check if it failed
+static void check(bool ok, const char* text, int line)
+{
+	if (!ok) {
+		printf("FAILED line %d: %s\n", line, text);
+		failures++;
+	}
+}
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+// Parse the message - the parser refers to it, so it must outlive the checks
+static zc_http_parser::result_t parse(zc_http_parser& parser, const std::string& message)
+{
+	return parser.parse(message.data(), message.length());
+}
+
+// A request and a response, whole and arriving a byte at a time
+static void test_messages()
+{
+	const std::string request = "POST /RPC2 HTTP/1.1\r\nHost: localhost\r\ncontent-type:  text/xml \r\n"
+		"Content-Length: 5\r\nConnection: keep-alive, Upgrade\r\n\r\nhello";
+	zc_http_parser parser;
+	CHECK(parse(parser, request) == zc_http_parser::HTTP_OK);
+	CHECK(parser.method() == "POST");
+	CHECK(parser.target() == "/RPC2");
+	CHECK(parser.version() == "HTTP/1.1");
+	CHECK(parser.field("Content-Type") == "text/xml");
+	CHECK(parser.has_field("HOST"));
+	CHECK(!parser.has_field("Accept"));
+	CHECK(parser.field_has_token("Connection", "upgrade"));
+	CHECK(!parser.field_has_token("Connection", "close"));
+	CHECK(parser.content_length() == 5);
+	CHECK(parser.complete());
+	CHECK(parser.body() == "hello");
+	CHECK(parser.header_length() == request.length() - 5);
+
+	// Incomplete until the blank line, then short of the body
+	size_t header = request.length() - 5;
+	for (size_t length = 0; length < request.length(); length++) {
+		zc_http_parser::result_t result = parser.parse(request.data(), length);
+		if (length < header) {
+			CHECK(result == zc_http_parser::HTTP_INCOMPLETE);
+		}
+		else {
+			CHECK(result == zc_http_parser::HTTP_OK && !parser.complete());
+		}
+	}
+
+	// Lines may end in LF alone
+	const std::string response = "HTTP/1.1 200 OK\nContent-Length: 0\n\n";
+	CHECK(parse(parser, response) == zc_http_parser::HTTP_OK);
+	CHECK(parser.method() == "HTTP/1.1");
+	CHECK(parser.target() == "200");
+	CHECK(parser.version() == "OK");
+	CHECK(parser.complete());
+}
+
+// Content-Length must be one unambiguous number that fits
+static void test_content_length()
+{
+	zc_http_parser parser;
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 3\r\n\r\nabc") == zc_http_parser::HTTP_OK);
+	CHECK(parser.content_length() == 3);
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length: 3\r\nContent-Length: 4\r\n\r\nabcd") == zc_http_parser::HTTP_ERROR);
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length: 0\r\nContent-Length: 12\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length:\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length: -1\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length: 1 2\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length: 0x10\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+
+	// A large value that fits, and values that would overflow size_t
+	std::string large = std::to_string(SIZE_MAX / 10);
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length: " + large + "\r\n\r\n") == zc_http_parser::HTTP_OK);
+	CHECK(parser.content_length() == SIZE_MAX / 10 && !parser.complete());
+	std::string too_large = std::to_string(SIZE_MAX) + "0";
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length: " + too_large + "\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nContent-Length: 99999999999999999999999999\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+
+	// Without Content-Length there is no body
+	const std::string no_length = "GET / HTTP/1.1\r\n\r\nextra";
+	CHECK(parse(parser, no_length) == zc_http_parser::HTTP_OK);
+	CHECK(parser.content_length() == 0 && parser.body().empty());
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n\r\n") == zc_http_parser::HTTP_OK);
+	CHECK(parser.chunked());
+}
+
+// Malformed header lines and too many fields
+static void test_malformed()
+{
+	zc_http_parser parser;
+	CHECK(parse(parser, "POST / HTTP/1.1\r\nNo colon here\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+	CHECK(parse(parser, "POST / HTTP/1.1\r\n: no name\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+	std::string many = "GET / HTTP/1.1\r\n";
+	for (size_t ix = 0; ix < zc_http_parser::MAX_FIELDS; ix++) {
+		many += "X-Field-" + std::to_string(ix) + ": 1\r\n";
+	}
+	CHECK(parse(parser, many + "\r\n") == zc_http_parser::HTTP_OK);
+	CHECK(parser.num_fields() == zc_http_parser::MAX_FIELDS);
+	CHECK(parse(parser, many + "X-One-More: 1\r\n\r\n") == zc_http_parser::HTTP_ERROR);
+}
+
+int main(int argc, char** argv)
+{
+	test_messages();
+	test_content_length();
+	test_malformed();
+	printf("test_http_parser: %d failed\n", failures);
+	return failures;
+}
@@ -0,0 +1,271 @@
+/*
+	Tests for zc_rpc_codec and zc_rpc_json_codec
+
+	This encodes requests and responses carrying every value type, decodes them
+	again and checks that nothing has changed, then checks that malformed
+	messages - bad markup, bad character references, corrupt base64, nesting
+	beyond the limit and incomplete JSON - are rejected.
+
+	Usage: test_rpc_codec
+
+	It prints each check that fails and returns the number of failures.
+
+	Copyright 2026, Philip Rose, GM3ZZA
+*/
+
+#include "zc_rpc_codec.h"
+#include "zc_rpc_data_item.h"
+#include "zc_rpc_json_codec.h"
+
+#include <cstdio>
+#include <string>
+
+// Number of checks that have failed
+static int failures = 0;
+
+// Report the check if it failed
+static void check(bool ok, const char* text, int line)
+{
+	if (!ok) {
+		printf("FAILED line %d: %s\n", line, text);
+		failures++;
+	}
+}
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+// Returns a new item holding the string
+static zc_rpc_data_item* new_string(const std::string& value, rpc_data_t type = XRT_STRING)
+{
+	zc_rpc_data_item* item = new zc_rpc_data_item;
+	item->set(value, type);
+	return item;
+}
+
+// Returns a new item holding the integer
+static zc_rpc_data_item* new_int(int32_t value, rpc_data_t type = XRT_INT)
+{
+	zc_rpc_data_item* item = new zc_rpc_data_item;
+	item->set(value, type);
+	return item;
+}
+
+// Parameters with one of each type, including markup and bytes that need escaping
+static void build_params(zc_rpc_data_item::rpc_list& params)
+{
+	params.push_back(new_string("GM3ZZA <test> & \"check\" \xc3\xa9"));
+	params.push_back(new_int(-2147483647 - 1));
+	params.push_back(new_int(1, XRT_BOOLEAN));
+	zc_rpc_data_item* freq = new zc_rpc_data_item;
+	freq->set(14.074);
+	params.push_back(freq);
+	params.push_back(new_string(std::string("\0\x01\xff binary", 10), XRT_BYTES));
+	params.push_back(new_string("20260101T12:00:00", XRT_DATETIME));
+	params.push_back(new_string(""));
+	zc_rpc_data_item::rpc_array* levels = new zc_rpc_data_item::rpc_array;
+	for (int ix = 0; ix < 5; ix++) {
+		levels->push_back(new_int(ix * 3));
+	}
+	zc_rpc_data_item::rpc_struct* str = new zc_rpc_data_item::rpc_struct;
+	(*str)["mode"] = new_string("FT8");
+	zc_rpc_data_item* item = new zc_rpc_data_item;
+	item->set(levels);
+	(*str)["levels"] = item;
+	(*str)["empty"] = new zc_rpc_data_item;
+	(*str)["empty"]->set(new zc_rpc_data_item::rpc_array);
+	item = new zc_rpc_data_item;
+	item->set(str);
+	params.push_back(item);
+}
+
+// Delete the parameters
+static void free_params(zc_rpc_data_item::rpc_list& params)
+{
+	for (auto p : params) delete p;
+	params.clear();
+}
+
+// Decode the XML-RPC request, check it matches the parameters and that it encodes the same again
+static void test_xml_request()
+{
+	zc_rpc_data_item::rpc_list params;
+	build_params(params);
+	std::string xml;
+	zc_rpc_codec::write_request("test.method", &params, xml);
+	std::string method_name;
+	zc_rpc_data_item::rpc_list decoded;
+	zc_rpc_arena arena;
+	CHECK(zc_rpc_codec::read_request(xml.data(), xml.length(), method_name, &decoded, &arena));
+	CHECK(method_name == "test.method");
+	CHECK(decoded.size() == params.size());
+	if (decoded.size() == params.size()) {
+		auto it = params.begin();
+		for (auto d : decoded) {
+			CHECK(d->type() == (*it)->type());
+			it++;
+		}
+		CHECK(decoded.front()->get_string() == params.front()->get_string());
+		CHECK((*std::next(decoded.begin(), 1))->get_int() == -2147483647 - 1);
+		CHECK((*std::next(decoded.begin(), 3))->get_double() == 14.074);
+		CHECK((*std::next(decoded.begin(), 4))->get_string() == std::string("\0\x01\xff binary", 10));
+	}
+	std::string again;
+	zc_rpc_codec::write_request("test.method", &decoded, again);
+	CHECK(again == xml);
+	free_params(params);
+}
+
+// Decode responses - a value and a fault
+static void test_xml_response()
+{
+	zc_rpc_data_item value;
+	value.set(std::string("a & b"), XRT_STRING);
+	std::string xml;
+	zc_rpc_codec::write_response(false, &value, xml);
+	zc_rpc_data_item response;
+	bool fault = true;
+	CHECK(zc_rpc_codec::read_response(xml.data(), xml.length(), &response, fault));
+	CHECK(!fault);
+	CHECK(response.get_string() == "a & b");
+
+	zc_rpc_data_item::rpc_struct* str = new zc_rpc_data_item::rpc_struct;
+	(*str)["faultCode"] = new_int(-32601);
+	(*str)["faultString"] = new_string("Unknown method");
+	zc_rpc_data_item error;
+	error.set(str);
+	xml.clear();
+	zc_rpc_codec::write_response(true, &error, xml);
+	zc_rpc_data_item decoded;
+	CHECK(zc_rpc_codec::read_response(xml.data(), xml.length(), &decoded, fault));
+	CHECK(fault);
+	CHECK(decoded.type() == XRT_STRUCT && (*decoded.get_struct())["faultCode"]->get_int() == -32601);
+}
+
+// Decode the value from a response holding \p value
+static bool read_value(const std::string& value, zc_rpc_data_item& item)
+{
+	std::string xml = "<?xml version=\"1.0\"?><methodResponse><params><param><value>" + value +
+		"</value></param></params></methodResponse>";
+	bool fault = false;
+	return zc_rpc_codec::read_response(xml.data(), xml.length(), &item, fault);
+}
+
+// Returns \p depth arrays each holding the next, around an int
+static std::string nested(int depth)
+{
+	std::string value;
+	for (int ix = 0; ix < depth; ix++) value += "<array><data><value>";
+	value += "<int>1</int>";
+	for (int ix = 0; ix < depth; ix++) value += "</value></data></array>";
+	return value;
+}
+
+// The forms of values that XML-RPC allows, and malformed ones
+static void test_xml_values()
+{
+	zc_rpc_data_item item;
+	CHECK(read_value("untyped", item) && item.get_string() == "untyped");
+	CHECK(read_value("<string/>", item) && item.type() == XRT_STRING && item.get_string().empty());
+	CHECK(read_value("<i4>42</i4>", item) && item.get_int() == 42);
+	CHECK(read_value("<i8>5000000000</i8>", item) && item.get_double() == 5000000000.0);
+	CHECK(read_value("<string><![CDATA[<raw>]]></string>", item) && item.get_string() == "<raw>");
+	CHECK(read_value("<string>&#65;&#x42;&lt;&#x1F600;</string>", item) && item.get_string() == "AB<\xf0\x9f\x98\x80");
+	CHECK(read_value("<base64>AAEC\r\n/w==</base64>", item) && item.get_string() == std::string("\0\x01\x02\xff", 4));
+	CHECK(read_value(nested(zc_rpc_codec::MAX_DEPTH), item));
+
+	CHECK(!read_value("<string>&#x;</string>", item));
+	CHECK(!read_value("<string>&#0;</string>", item));
+	CHECK(!read_value("<string>&#xD800;</string>", item));
+	CHECK(!read_value("<string>&#1114112;</string>", item));
+	CHECK(!read_value("<string>&#12a;</string>", item));
+	CHECK(!read_value("<base64>AA*C</base64>", item));
+	CHECK(!read_value("<int>1</i4>", item));
+	CHECK(!read_value("<unknown>1</unknown>", item));
+	CHECK(!read_value("<struct><member><value><int>1</int></value></member></struct>", item));
+	CHECK(!read_value(nested(zc_rpc_codec::MAX_DEPTH + 1), item));
+	// Deep enough to overflow the stack without the limit
+	CHECK(!read_value(nested(200000), item));
+
+	std::string method_name;
+	zc_rpc_data_item::rpc_list params;
+	const std::string truncated = "<methodCall><methodName>x</methodName><params><param><value><int>1";
+	CHECK(!zc_rpc_codec::read_request(truncated.data(), truncated.length(), method_name, &params));
+	free_params(params);
+	const std::string comment = "<?xml version=\"1.0\"?><!-- note --><methodCall><methodName>x.y</methodName></methodCall>";
+	CHECK(zc_rpc_codec::read_request(comment.data(), comment.length(), method_name, &params) && method_name == "x.y");
+	free_params(params);
+}
+
+// Decode the JSON-RPC request and check that it encodes the same again
+static void test_json_request()
+{
+	zc_rpc_data_item::rpc_list params;
+	build_params(params);
+	std::string json;
+	zc_rpc_json_codec::write_request("test.method", &params, "7", json);
+	std::string method_name;
+	std::string id;
+	zc_rpc_data_item::rpc_list decoded;
+	zc_rpc_arena arena;
+	CHECK(zc_rpc_json_codec::read_request(json.data(), json.length(), method_name, &decoded, id, &arena));
+	CHECK(method_name == "test.method");
+	CHECK(id == "7");
+	CHECK(decoded.size() == params.size());
+	if (decoded.size() == params.size()) {
+		CHECK(decoded.front()->get_string() == params.front()->get_string());
+		CHECK((*std::next(decoded.begin(), 1))->get_int() == -2147483647 - 1);
+	}
+	std::string again;
+	zc_rpc_json_codec::write_request("test.method", &decoded, "7", again);
+	CHECK(again == json);
+	free_params(params);
+
+	// A notification has no id
+	const std::string notification = "{\"jsonrpc\":\"2.0\",\"method\":\"n\",\"params\":{\"a\":1}}";
+	CHECK(zc_rpc_json_codec::read_request(notification.data(), notification.length(), method_name, &decoded, id, &arena));
+	CHECK(id.empty());
+	CHECK(decoded.back()->type() == XRT_STRUCT);
+}
+
+// Decode JSON-RPC responses, and reject malformed messages
+static void test_json_response()
+{
+	zc_rpc_data_item response;
+	bool fault = true;
+	const std::string result = "{\"jsonrpc\":\"2.0\",\"result\":[1,2.5,\"x\",true,null,5000000000],\"id\":1}";
+	CHECK(zc_rpc_json_codec::read_response(result.data(), result.length(), &response, fault));
+	CHECK(!fault && response.type() == XRT_ARRAY && response.get_array()->size() == 6);
+	if (response.type() == XRT_ARRAY && response.get_array()->size() == 6) {
+		CHECK((*response.get_array())[5]->get_double() == 5000000000.0);
+	}
+	const std::string error = "{\"jsonrpc\":\"2.0\",\"error\":{\"code\":-32601,\"message\":\"Unknown\"},\"id\":1}";
+	zc_rpc_data_item error_item;
+	CHECK(zc_rpc_json_codec::read_response(error.data(), error.length(), &error_item, fault));
+	CHECK(fault && (*error_item.get_struct())["faultCode"]->get_int() == -32601);
+
+	std::string method_name;
+	std::string id;
+	zc_rpc_data_item::rpc_list params;
+	for (const std::string bad : {
+		"{\"jsonrpc\":\"2.0\",\"method\":\"x\"",
+		"{\"jsonrpc\":\"1.0\",\"method\":\"x\"}",
+		"{\"jsonrpc\":\"2.0\"}",
+		"{\"jsonrpc\":\"2.0\",\"method\":\"x\",\"params\":1}",
+		"[1,2]" }) {
+		CHECK(!zc_rpc_json_codec::read_request(bad.data(), bad.length(), method_name, &params, id));
+		free_params(params);
+	}
+	const std::string no_result = "{\"jsonrpc\":\"2.0\",\"id\":1}";
+	zc_rpc_data_item missing;
+	CHECK(!zc_rpc_json_codec::read_response(no_result.data(), no_result.length(), &missing, fault));
+}
+
+int main(int argc, char** argv)
+{
+	test_xml_request();
+	test_xml_response();
+	test_xml_values();
+	test_json_request();
+	test_json_response();
+	printf("test_rpc_codec: %d failed\n", failures);
+	return failures;
+}
@@ -0,0 +1,184 @@
+/*
+	Tests for zc_websocket_protocol
+
+	This checks the opening handshake against the example in RFC 6455 1.3 and
+	the requests that must be refused (4.2.1), then the framing examples of
+	5.7: masked, fragmented, ping and extended-length frames, the responses
+	sent back and frames that break the rules.
+
+	Usage: test_websocket
+
+	It prints each check that fails and returns the number of failures.
+
+	Copyright 2026, Philip Rose, GM3ZZA
+*/
+
+#include "zc_protocol_handler.h"
+
+#include <cstdio>
+#include <string>
+
+// Number of checks that have failed
+static int failures = 0;
+
+// Report the check if it failed
+static void check(bool ok, const char* text, int line)
+{
+	if (!ok) {
+		printf("FAILED line %d: %s\n", line, text);
+		failures++;
+	}
+}
+#define CHECK(condition) check(condition, #condition, __LINE__)
+
+// The key from RFC 6455 1.3 and the accept value the server must return for it
+const std::string SAMPLE_KEY = "dGhlIHNhbXBsZSBub25jZQ==";
+const std::string SAMPLE_ACCEPT = "s3pPLMBiTxaQ9kYGzzhZRbK+xOo=";
+
+// Returns an opening handshake with the fields changed as given
+static std::string handshake(const std::string& method = "GET", const std::string& upgrade = "websocket",
+	const std::string& connection = "Upgrade", const std::string& version = "13")
+{
+	std::string request = method + " /chat HTTP/1.1\r\nHost: server.example.com\r\n";
+	if (upgrade.length()) request += "Upgrade: " + upgrade + "\r\n";
+	if (connection.length()) request += "Connection: " + connection + "\r\n";
+	request += "Sec-WebSocket-Key: " + SAMPLE_KEY + "\r\n";
+	if (version.length()) request += "Sec-WebSocket-Version: " + version + "\r\n";
+	return request + "\r\n";
+}
+
+// Returns the status line of the reply
+static std::string status_line(const std::string& reply)
+{
+	return reply.substr(0, reply.find("\r\n"));
+}
+
+// Returns a client frame - masked with the key from the RFC 6455 5.7 examples
+static std::string client_frame(unsigned char first, const std::string& payload)
+{
+	const unsigned char mask[4] = { 0x37, 0xfa, 0x21, 0x3d };
+	std::string frame;
+	frame += (char)first;
+	if (payload.length() < 126) {
+		frame += (char)(0x80 | payload.length());
+	}
+	else {
+		frame += (char)(0x80 | 126);
+		frame += (char)(payload.length() >> 8);
+		frame += (char)(payload.length() & 0xFF);
+	}
+	frame.append((const char*)mask, 4);
+	for (size_t ix = 0; ix < payload.length(); ix++) {
+		frame += (char)(payload[ix] ^ mask[ix % 4]);
+	}
+	return frame;
+}
+
+// Pass the data to the handler
+static zc_protocol_handler::frame_t frame(zc_websocket_protocol& ws, const std::string& data, size_t& used,
+	std::string& message, std::string& reply)
+{
+	message.clear();
+	reply.clear();
+	return ws.frame(data.data(), data.length(), used, message, reply);
+}
+
+// The opening handshake and the requests that are refused
+static void test_handshake()
+{
+	zc_websocket_protocol ws;
+	size_t used = 0;
+	std::string message;
+	std::string reply;
+	std::string request = handshake();
+	// Nothing is done until the whole header has arrived
+	CHECK(frame(ws, request.substr(0, request.length() - 1), used, message, reply) == zc_protocol_handler::FRAME_INCOMPLETE);
+	CHECK(frame(ws, request + "extra", used, message, reply) == zc_protocol_handler::FRAME_CONTROL);
+	CHECK(used == request.length());
+	CHECK(status_line(reply) == "HTTP/1.1 101 Switching Protocols");
+	CHECK(reply.find("\r\nSec-WebSocket-Accept: " + SAMPLE_ACCEPT + "\r\n") != std::string::npos);
+
+	// Tokens are matched ignoring case, and Connection may hold several
+	zc_websocket_protocol other;
+	CHECK(frame(other, handshake("GET", "WebSocket", "keep-alive, upgrade"), used, message, reply) ==
+		zc_protocol_handler::FRAME_CONTROL);
+
+	struct refused_t {
+		std::string request;
+		std::string status;
+	} refused[] = {
+		{ handshake("POST"), "HTTP/1.1 400 Bad Request" },
+		{ handshake("GET", ""), "HTTP/1.1 400 Bad Request" },
+		{ handshake("GET", "h2c"), "HTTP/1.1 400 Bad Request" },
+		{ handshake("GET", "websocket", ""), "HTTP/1.1 400 Bad Request" },
+		{ handshake("GET", "websocket", "keep-alive"), "HTTP/1.1 400 Bad Request" },
+		{ handshake("GET", "websocket", "Upgrade", "8"), "HTTP/1.1 426 Upgrade Required" },
+		{ handshake("GET", "websocket", "Upgrade", ""), "HTTP/1.1 426 Upgrade Required" },
+		{ "GET /chat HTTP/1.1\r\nUpgrade: websocket\r\nConnection: Upgrade\r\nSec-WebSocket-Version: 13\r\n\r\n",
+			"HTTP/1.1 400 Bad Request" },
+	};
+	for (auto& r : refused) {
+		zc_websocket_protocol fresh;
+		CHECK(frame(fresh, r.request, used, message, reply) == zc_protocol_handler::FRAME_ERROR);
+		CHECK(status_line(reply) == r.status);
+	}
+	zc_websocket_protocol old;
+	frame(old, handshake("GET", "websocket", "Upgrade", "8"), used, message, reply);
+	CHECK(reply.find("\r\nSec-WebSocket-Version: 13\r\n") != std::string::npos);
+}
+
+// Frames after the handshake
+static void test_frames()
+{
+	zc_websocket_protocol ws;
+	size_t used = 0;
+	std::string message;
+	std::string reply;
+	frame(ws, handshake(), used, message, reply);
+
+	// A single masked text frame - RFC 6455 5.7
+	const std::string hello = client_frame(0x81, "Hello");
+	CHECK(hello == std::string("\x81\x85\x37\xfa\x21\x3d\x7f\x9f\x4d\x51\x58", 11));
+	CHECK(frame(ws, hello.substr(0, 6), used, message, reply) == zc_protocol_handler::FRAME_INCOMPLETE);
+	CHECK(frame(ws, hello, used, message, reply) == zc_protocol_handler::FRAME_MESSAGE);
+	CHECK(message == "Hello" && used == hello.length());
+	std::string header;
+	ws.encode(5, header);
+	CHECK(header == std::string("\x81\x05", 2));
+
+	// A fragmented message - and a ping between the fragments
+	CHECK(frame(ws, client_frame(0x01, "Hel"), used, message, reply) == zc_protocol_handler::FRAME_CONTROL);
+	CHECK(frame(ws, client_frame(0x89, "Hello"), used, message, reply) == zc_protocol_handler::FRAME_CONTROL);
+	CHECK(reply == std::string("\x8a\x05", 2) + "Hello");
+	CHECK(frame(ws, client_frame(0x80, "lo"), used, message, reply) == zc_protocol_handler::FRAME_MESSAGE);
+	CHECK(message == "Hello");
+
+	// 256 bytes of binary - a 16-bit length, and the response is binary too
+	std::string binary(256, '\x5a');
+	CHECK(frame(ws, client_frame(0x82, binary), used, message, reply) == zc_protocol_handler::FRAME_MESSAGE);
+	CHECK(message == binary);
+	ws.encode(256, header);
+	CHECK(header == std::string("\x82\x7e\x01\x00", 4));
+	ws.encode(65536, header);
+	CHECK(header == std::string("\x82\x7f\x00\x00\x00\x00\x00\x01\x00\x00", 10));
+
+	// Close - the status code is echoed
+	CHECK(frame(ws, client_frame(0x88, "\x03\xe8" "bye"), used, message, reply) == zc_protocol_handler::FRAME_CLOSE);
+	CHECK(reply == std::string("\x88\x02\x03\xe8", 4));
+
+	// Broken rules: unmasked, fragmented control, continuation without a start, unknown opcode
+	zc_websocket_protocol strict;
+	frame(strict, handshake(), used, message, reply);
+	CHECK(frame(strict, std::string("\x81\x05", 2) + "Hello", used, message, reply) == zc_protocol_handler::FRAME_ERROR);
+	CHECK(frame(strict, client_frame(0x09, "x"), used, message, reply) == zc_protocol_handler::FRAME_ERROR);
+	CHECK(frame(strict, client_frame(0x80, "x"), used, message, reply) == zc_protocol_handler::FRAME_ERROR);
+	CHECK(frame(strict, client_frame(0x83, "x"), used, message, reply) == zc_protocol_handler::FRAME_ERROR);
+}
+
+int main(int argc, char** argv)
+{
+	test_handshake();
+	test_frames();
+	printf("test_websocket: %d failed\n", failures);
+	return failures;
+}